@@ -8,16 +8,19 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/mpage.h>
+#include <linux/pagevec.h>
+#include <linux/uio.h>
 #include "sfs_fs.h"
 #include "sfs.h"
 
 //Associate logical block to physical block
+//Up to bh_result->b_size bytes are mapped if the extent is long enough.
 int sfs_get_block
 (struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create)
 {
-  unsigned short 	deph[3];
+  struct sfs_map	map;
   int			err = -EIO;
-  unsigned int		blk = 0;
 
   printk("sfs_get_block = %d (create:%d)\n", (int)iblock, (int)create);
 
@@ -28,35 +31,59 @@ int sfs_get_block
       return err;
     }
 
-  //Error when searching?
-  if((err = sfs_find_block(inode, &iblock, deph, &blk)) < 0)
-    goto err;
-  //Block found
-  if (blk)
-    goto map;
-
-  //Generate new block
-  if((err = sfs_alloc_block(inode, &iblock, deph, &blk) < 0))
-    goto err;
-
-  //Map block into bh
- map:
-  printk(" gblock map : %d\n", blk);
-  map_bh(bh_result, inode->i_sb, blk);
+  map.m_lblk = iblock;
+  map.m_len = bh_result->b_size >> inode->i_blkbits;
+  if (!map.m_len)
+    map.m_len = 1;
+  if ((err = sfs_map_blocks(inode, &map, create)))
+    return err;
+  //Compressed clusters have no block to map (see compress.c)
+  if (map.m_flags & SFS_MAP_COMPRESSED)
+    return -EIO;
+
+  //Hole or unwritten : let the caller fill with zeros
+  if (!map.m_pblk || (map.m_flags & SFS_MAP_UNWRITTEN))
+    return 0;
+
+  //Map the whole run into bh
+  printk(" gblock map : %u (%u)\n", map.m_pblk, map.m_len);
+  map_bh(bh_result, inode->i_sb, map.m_pblk);
+  bh_result->b_size = map.m_len << inode->i_blkbits;
+  if (map.m_flags & SFS_MAP_NEW)
+    set_buffer_new(bh_result);
   //All it's ok, update i_blocks
   inode->i_blocks = sfs_count_blocks(inode);
   return 0;
-
- err:
-  return err;
 }
 
-//Read page with sfs_get_block
+//Read page with sfs_get_block (no buffer_head if the page is contiguous)
 static int sfs_readpage
 (struct file *file, struct page *page)
 {
   printk(KERN_DEBUG "sfs_readpage\n");
-  return block_read_full_page(page, sfs_get_block);
+  if (sfs_inline(page->mapping->host))
+    return sfs_inline_readpage(page);
+  if (sfs_ext_compressed(page->mapping->host))
+    return sfs_compr_readpage(page);
+  return mpage_readpage(page, sfs_get_block);
+}
+
+//Read ahead filler for files in i_data or holding compressed clusters
+static int sfs_readpage_filler(void *data, struct page *page)
+{
+  return sfs_readpage(NULL, page);
+}
+
+//Read ahead pages, one bio per extent
+static int sfs_readpages
+(struct file *file, struct address_space *mapping,
+ struct list_head *pages, unsigned nr_pages)
+{
+  printk(KERN_DEBUG "sfs_readpages\n");
+  //Clusters are read whole, page by page, and i_data has no block
+  if (sfs_inline(mapping->host) || sfs_ext_compressed(mapping->host))
+    return read_cache_pages(mapping, pages, sfs_readpage_filler, NULL);
+  return mpage_readpages(mapping, pages, nr_pages, sfs_get_block);
 }
 
 //Write page with sfs_get_block
@@ -64,9 +91,25 @@ static int sfs_writepage
 (struct page *page, struct writeback_control *wbc)
 {
   printk(KERN_DEBUG "sfs_writepage\n");
+  if (sfs_inline(page->mapping->host))
+    return sfs_inline_writepage(page, wbc);
+  if (sfs_compr_inode(page->mapping->host))
+    return sfs_compr_writepage(page, wbc);
   return block_write_full_page(page, sfs_get_block, wbc);
 }
 
+//Write dirty pages with sfs_get_block, contiguous pages share one bio
+//Clusters are written by sfs_compr_writepage, one page at a time, and
+//so are files in i_data.
+static int sfs_writepages
+(struct address_space *mapping, struct writeback_control *wbc)
+{
+  printk(KERN_DEBUG "sfs_writepages\n");
+  if (sfs_inline(mapping->host) || sfs_compr_inode(mapping->host))
+    return generic_writepages(mapping, wbc);
+  return mpage_writepages(mapping, wbc, sfs_get_block);
+}
+
 //Prepare Write page
 int __sfs_write_begin
 (struct file *file, struct address_space *mapping,
@@ -77,34 +120,154 @@ int __sfs_write_begin
   return block_write_begin(file, mapping, pos, len, flags, pagep, fsdata, sfs_get_block);
 }
 
+/**
+ * sfs_cow_page - Give the buffers of [@from, @to) in @page blocks of
+ * their own if they are shared with other files
+ * @inode inode we are working on
+ * @page locked page, with buffers mapped
+ * @from first byte in the page
+ * @to first byte after the range
+ *
+ * The buffers are mapped on new blocks and dirtied, so that the data
+ * already read from the shared blocks is written on the new ones.
+ * Returns 0 or an error code
+ */
+int
+sfs_cow_page(struct inode *inode, struct page *page, unsigned from,
+	     unsigned to)
+{
+  const unsigned int	bits = inode->i_blkbits;
+  struct buffer_head	*head;
+  struct buffer_head	*bh;
+  sector_t		lblk;
+  unsigned int		start = 0;
+  int			blk;
+
+  if (!SBI_PTR(inode->i_sb)->s_refc_blocks || !page_has_buffers(page))
+    return 0;
+
+  lblk = (sector_t)page->index << (PAGE_CACHE_SHIFT - bits);
+  head = bh = page_buffers(page);
+  do
+    {
+      if (start + bh->b_size > from && start < to && buffer_mapped(bh))
+	{
+	  if ((blk = sfs_ext_cow(inode, lblk)) < 0)
+	    return blk;
+	  if (blk)
+	    {
+	      map_bh(bh, inode->i_sb, blk);
+	      unmap_underlying_metadata(bh->b_bdev, bh->b_blocknr);
+	      if (PageUptodate(page))
+		set_buffer_uptodate(bh);
+	      if (buffer_uptodate(bh))
+		mark_buffer_dirty(bh);
+	    }
+	}
+      start += bh->b_size;
+      lblk++;
+    }
+  while ((bh = bh->b_this_page) != head);
+  return 0;
+}
+
 //Prepare Write page with sfs_get_block
 static int sfs_write_begin
 (struct file *file, struct address_space *mapping,
  loff_t pos, unsigned len, unsigned flags,
  struct page **pagep, void **fsdata)
 {
+  unsigned	from = pos & (PAGE_CACHE_SIZE - 1);
+  int		err;
+
   printk(KERN_DEBUG "sfs_write_begin\n");
   //Called by kernel, *pagep can be uninitialised!
   *pagep = NULL;
-  return block_write_begin(file, mapping, pos, len, flags, pagep, fsdata, sfs_get_block);
+  //Small files go to i_data (see inline.c)
+  if (S_ISREG(mapping->host->i_mode)
+      && (err = sfs_inline_prepare(mapping->host, pos, len)))
+    {
+      if (err < 0)
+	return err;
+      return sfs_inline_write_begin(file, mapping, pos, len, flags, pagep,
+				    fsdata);
+    }
+  //Blocks of clusters are allocated at writeback
+  if (sfs_compr_inode(mapping->host))
+    return sfs_compr_write_begin(file, mapping, pos, len, flags, pagep,
+				 fsdata);
+  err = block_write_begin(file, mapping, pos, len, flags, pagep, fsdata, sfs_get_block);
+  if (err)
+    return err;
+  //Shared blocks are copied before they are written
+  if ((err = sfs_cow_page(mapping->host, *pagep, from, from + len)))
+    {
+      unlock_page(*pagep);
+      page_cache_release(*pagep);
+      *pagep = NULL;
+    }
+  return err;
+}
+
+//End Write page : pages of clusters and of files in i_data have no buffers
+static int sfs_write_end
+(struct file *file, struct address_space *mapping,
+ loff_t pos, unsigned len, unsigned copied,
+ struct page *page, void *fsdata)
+{
+  printk(KERN_DEBUG "sfs_write_end\n");
+  if (sfs_inline(mapping->host))
+    return sfs_inline_write_end(file, mapping, pos, len, copied, page,
+				fsdata);
+  if (page_has_buffers(page))
+    return generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+  return sfs_compr_write_end(file, mapping, pos, len, copied, page, fsdata);
 }
 
 //BMAP with sfs_get_block
 static sector_t sfs_bmap(struct address_space *mapping, sector_t block)
 {
   printk(KERN_DEBUG "sfs_bmap\n");
+  if (sfs_inline(mapping->host))
+    return 0;
   return generic_block_bmap(mapping, block, sfs_get_block);
 }
 
+//Direct I/O : blocks are mapped one extent at a time, and each extent
+//goes in its own bio. Already allocated blocks only need the extent map.
+//Writes on shared blocks fall back to buffered I/O, and so does all I/O
+//on files written by clusters or stored in i_data.
+static ssize_t sfs_direct_IO
+(int rw, struct kiocb *iocb, const struct iovec *iov,
+ loff_t offset, unsigned long nr_segs)
+{
+  struct inode	*inode = iocb->ki_filp->f_mapping->host;
+
+  printk(KERN_DEBUG "sfs_direct_IO\n");
+  if (sfs_inline(inode) || sfs_compr_inode(inode))
+    return 0;
+  //Shared blocks are copied by the buffered write path
+  if ((rw & WRITE)
+      && sfs_ext_shared(inode, offset >> inode->i_blkbits,
+			(offset + iov_length(iov, nr_segs)
+			 + (1 << inode->i_blkbits) - 1) >> inode->i_blkbits))
+    return 0;
+  return blockdev_direct_IO(rw, iocb, inode, inode->i_sb->s_bdev, iov,
+			    offset, nr_segs, sfs_get_block, NULL);
+}
+
 //Maping virtual connex memory of a file into physical blocks
 struct address_space_operations sfs_address_space_ops =
   {
     .readpage = sfs_readpage,
+    .readpages = sfs_readpages,
     .writepage = sfs_writepage,
+    .writepages = sfs_writepages,
     .sync_page = block_sync_page,
     .write_begin = sfs_write_begin,
-    .write_end = generic_write_end,
+    .write_end = sfs_write_end,
     .bmap = sfs_bmap,
+    .direct_IO = sfs_direct_IO,
   };
 
 //Release page
@@ -133,3 +296,93 @@ sfs_get_page(struct inode *inode, unsigned long index)
     }
   return page;
 }
+
+/**
+ * sfs_unshare_block - Copy the block holding @pos if it is shared
+ * @inode inode we are working on
+ * @pos new size of the file
+ *
+ * Truncate zeroes the end of the last block in place : it must not be
+ * shared. The byte before @pos is written again through the page cache,
+ * which copies the block.
+ * Returns 0 or an error code
+ */
+int
+sfs_unshare_block(struct inode *inode, loff_t pos)
+{
+  struct address_space	*mapping = inode->i_mapping;
+  const sector_t	lblk = pos >> inode->i_blkbits;
+  struct page		*page;
+  void			*fsdata;
+  int			err;
+
+  if (!(pos & ((1 << inode->i_blkbits) - 1)))
+    return 0;
+  if ((err = sfs_ext_shared(inode, lblk, lblk + 1)) <= 0)
+    return err;
+
+  err = pagecache_write_begin(NULL, mapping, pos - 1, 1,
+			      AOP_FLAG_UNINTERRUPTIBLE, &page, &fsdata);
+  if (err)
+    return err;
+  err = pagecache_write_end(NULL, mapping, pos - 1, 1, 1, page, fsdata);
+  return (err < 0) ? err : 0;
+}
+
+/**
+ * sfs_dirty_seek - Find the first dirty page, or the first page not
+ * dirty, of [@start, @end)
+ * @mapping address space of the file
+ * @start first byte
+ * @end first byte after the range
+ * @dirty look for a dirty page instead of a page not dirty
+ *
+ * Dirty pages of compressed and zoned files get their blocks at
+ * writeback : over a hole of the map, they are data already.
+ * Returns the position found, or @end
+ */
+loff_t
+sfs_dirty_seek(struct address_space *mapping, loff_t start, loff_t end,
+	       int dirty)
+{
+  struct pagevec	pvec;
+  pgoff_t		index = start >> PAGE_CACHE_SHIFT;
+  pgoff_t		next = index;
+  pgoff_t		last;
+  pgoff_t		idx;
+  loff_t		pos = -1;
+  unsigned int		nr;
+  unsigned int		i;
+  int			done = 0;
+
+  if (start >= end)
+    return end;
+  last = (end - 1) >> PAGE_CACHE_SHIFT;
+
+  //next : first page not seen dirty yet
+  pagevec_init(&pvec, 0);
+  while (!done && index <= last
+	 && (nr = pagevec_lookup_tag(&pvec, mapping, &index,
+				     PAGECACHE_TAG_DIRTY, PAGEVEC_SIZE)))
+    {
+      for (i = 0; !done && i < nr; i++)
+	{
+	  idx = pvec.pages[i]->index;
+	  if (idx > last || (!dirty && idx != next))
+	    done = 1;
+	  else if (dirty)
+	    {
+	      pos = (loff_t)idx << PAGE_CACHE_SHIFT;
+	      done = 1;
+	    }
+	  else
+	    next++;
+	}
+      pagevec_release(&pvec);
+    }
+  if (!dirty)
+    pos = (loff_t)next << PAGE_CACHE_SHIFT;
+  else if (pos < 0)
+    return end;
+  return min(max(pos, start), end);
+}
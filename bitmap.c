@@ -22,6 +22,68 @@
 #define SEL_MAP(sbi, mode)		((mode == BLOCK_BITMAP) ? (sbi)->s_bmap : (sbi)->s_imap)
 //Create map var
 #define MAP(sbi, mode)			struct buffer_head **map = SEL_MAP(sbi, mode)
+//Map block, byte and bit of an id
+#define	bit_page(id)			((id) / BIT_PER_BLOCK)
+#define	bit_idx(id)			(((id) % BIT_PER_BLOCK) >> 3)
+#define	bit_off(id)			((id) & 0x07)
+//Test an id
+#define	map_test(map, id)					\
+  (map_addr(map, bit_page(id), bit_idx(id)) & (1 << bit_off(id)))
+//Blocks handed out by the bitmap allocators : on zoned devices, the
+//sequential zones are only written by the zone allocator (see zone.c)
+#define	data_end(sbi)						\
+  ((sbi)->s_zone_blocks ? (sbi)->s_zone_start : (sbi)->s_nblocks)
+//First block counted by s_free_blocks : the blocks clusters are written
+//to at writeback (see compress.c)
+#define	free_start(sbi)	((sbi)->s_zone_blocks ? (sbi)->s_zone_start : 0)
+
+/*
+** Free blocks (sbi->s_free_blocks) and blocks reserved by dirty pages
+** of files written by clusters (sbi->s_resv_blocks) are counted under
+** sb->s_lock. The bitmap allocators leave reserved blocks alone : a
+** write that got its reservation never fails at writeback for lack of
+** space. On zoned devices, only the sequential zones are counted, and
+** the bitmap allocators don't take blocks there.
+*/
+
+/**
+ * sfs_free_avail - Free blocks the bitmap allocators may take
+ * @sbi SFS super block info
+ *
+ * Must be called with sb->s_lock held.
+ * Returns a number of blocks
+ */
+static unsigned long
+sfs_free_avail(struct sfs_sb_info *sbi)
+{
+  if (sbi->s_zone_blocks)
+    return ULONG_MAX;
+  if (sbi->s_free_blocks <= sbi->s_resv_blocks)
+    return 0;
+  return sbi->s_free_blocks - sbi->s_resv_blocks;
+}
+
+/**
+ * sfs_free_sub - Count @count blocks from @start as used
+ * @sbi SFS super block info
+ * @start first block id
+ * @count number of blocks, just marked used
+ *
+ * Must be called with sb->s_lock held.
+ */
+static void
+sfs_free_sub(struct sfs_sb_info *sbi, unsigned long start,
+	     unsigned long count)
+{
+  if (start + count <= free_start(sbi))
+    return;
+  if (start < free_start(sbi))
+    {
+      count -= free_start(sbi) - start;
+      start = free_start(sbi);
+    }
+  sbi->s_free_blocks -= min(count, sbi->s_free_blocks);
+}
 
 /**
  * sfs_get_bit - Get a bit from block bitmap or inode bitmap.
@@ -39,7 +101,7 @@ sfs_get_bit(struct super_block *sb, int mode)
   int	idx;
   int	off;
   int	lim_blocks = (mode == BLOCK_BITMAP) ? sbi->s_bmap_blocks : sbi->s_imap_blocks;
-  int	lim_id = (mode == BLOCK_BITMAP) ? sbi->s_nblocks : sbi->s_ninodes;
+  int	lim_id = (mode == BLOCK_BITMAP) ? data_end(sbi) : sbi->s_ninodes;
   int	id;
 
   //Lock kernel during search
@@ -68,23 +130,29 @@ sfs_get_bit(struct super_block *sb, int mode)
   while ((1 << off) & map_addr(map, page, idx) && (off) < 8)
     off++;
 
-  //Unlock kernel
-  //unlock_kernel();
-  mutex_unlock(&sb->s_lock);
-
   //Set bit and return inode ID
   if(off < 8)
     {
       //Get inode/block ID by uniting bytes
-      id = (page << SFS_BLOCK_LOG_SIZE | idx << 3 | off);
+      id = page * BIT_PER_BLOCK + (idx << 3 | off);
       //Too Hight!
       printk(" ===>idx:%d off:%d\n", (int)idx, (int)off);
       printk(" ===>id:%d(page:%d) < lim:%d\n", (int)id, (int)page, (int)lim_id);
       if (id >= lim_id)
-	goto nospc;
+	goto nospc_unlock;
+      //Blocks reserved by dirty pages
+      if (mode == BLOCK_BITMAP)
+	{
+	  if (!sfs_free_avail(sbi))
+	    goto nospc_unlock;
+	  sfs_free_sub(sbi, id, 1);
+	}
       //Set bit
       map_addr(map, page, idx) |= 1 << off;
       mark_buffer_dirty(map_bh(page));
+      //Unlock kernel
+      //unlock_kernel();
+      mutex_unlock(&sb->s_lock);
       return id;
     }
 
@@ -93,7 +161,6 @@ sfs_get_bit(struct super_block *sb, int mode)
   //Unlock kernel
   //unlock_kernel();
   mutex_unlock(&sb->s_lock);
- nospc:
   return -ENOSPC;
 }
 
@@ -109,13 +176,13 @@ sfs_get_bit_after(struct super_block *sb, int mode, unsigned long start)
 {
   SBI(sb);
   MAP(sbi, mode);
-  const unsigned int	start_page = start >> SFS_BLOCK_LOG_SIZE;
-  const unsigned int	start_idx = (start & ~(start_page << SFS_BLOCK_LOG_SIZE)) >> 3;
-  unsigned int		off = start & 0x07;
+  const unsigned int	start_page = bit_page(start);
+  const unsigned int	start_idx = bit_idx(start);
+  unsigned int		off = bit_off(start);
   unsigned int		idx = start_idx;
   unsigned int		page;
   int			lim_blocks = (mode == BLOCK_BITMAP) ? sbi->s_bmap_blocks : sbi->s_imap_blocks;
-  int			lim_id = (mode == BLOCK_BITMAP) ? sbi->s_nblocks : sbi->s_ninodes;
+  int			lim_id = (mode == BLOCK_BITMAP) ? data_end(sbi) : sbi->s_ninodes;
   int			id;
 
   //Lock kernel during search
@@ -148,27 +215,36 @@ sfs_get_bit_after(struct super_block *sb, int mode, unsigned long start)
   while ((1 << off) & map_addr(map, page, idx) && (off) < 8)
     off++;
 
-  //Unlock kernel
-  //unlock_kernel();
-  mutex_unlock(&sb->s_lock);
-
   //Set bit and return inode ID
   if(off < 8)
     {
       //Get inode/block ID by uniting bytes
-      id = (page << SFS_BLOCK_LOG_SIZE | idx << 3 | off);
+      id = page * BIT_PER_BLOCK + (idx << 3 | off);
       //Too Hight!
       printk(" ===>idx:%d off:%d\n", (int)idx, (int)off);
       printk(" ===>id:%d(page:%d) < lim:%d\n", (int)id, (int)page, (int)lim_id);
       if (id >= lim_id)
-	goto restart;
+	goto restart_unlock;
+      //Blocks reserved by dirty pages
+      if (mode == BLOCK_BITMAP)
+	{
+	  if (!sfs_free_avail(sbi))
+	    goto restart_unlock;
+	  sfs_free_sub(sbi, id, 1);
+	}
       //Set bit
       map_addr(map, page, idx) |= 1 << off;
       mark_buffer_dirty(map_bh(page));
+      //Unlock kernel
+      //unlock_kernel();
+      mutex_unlock(&sb->s_lock);
       return id;
     }
 
   //Not enought space on disk
+ restart_unlock:
+  //unlock_kernel();
+  mutex_unlock(&sb->s_lock);
  restart:
   return sfs_get_bit(sb, mode);
 }
@@ -195,13 +271,15 @@ int	sfs_put_bit(struct super_block *sb, unsigned long id, int mode)
     return -EINVAL;
 
   //Get page, index and offset
-  page = id >> SFS_BLOCK_LOG_SIZE;
-  off = id & 0x07;
-  idx = (id & ~(page << SFS_BLOCK_LOG_SIZE)) >> 3;
+  page = bit_page(id);
+  off = bit_off(id);
+  idx = bit_idx(id);
 
   //Find offset or return error
+  mutex_lock(&sb->s_lock);
   if (!((1 << off) & map_addr(map, page, idx)))
     {
+      mutex_unlock(&sb->s_lock);
       printk("  already unmaped id:%lu\n", id);
       return -EINVAL;
     }
@@ -209,10 +287,445 @@ int	sfs_put_bit(struct super_block *sb, unsigned long id, int mode)
   //Set bit and return 0
   map_addr(map, page, idx) &= ~(1 << off);
   mark_buffer_dirty(map_bh(page));
+  if (mode == BLOCK_BITMAP && id >= free_start(sbi))
+    sbi->s_free_blocks++;
+  mutex_unlock(&sb->s_lock);
   printk(" ==put_bit==>id:%d(page:%d) < lim:%d\n", (int)id, (int)page, (int)lim_id);
   return 0;
 }
 
+/**
+ * sfs_find_free - Find the first free id in [@id, @lim)
+ * @map bitmap
+ * @id where to start
+ * @lim where to stop
+ *
+ * Returns a free id or @lim
+ */
+static unsigned long
+sfs_find_free(struct buffer_head **map, unsigned long id, unsigned long lim)
+{
+  while (id < lim)
+    {
+      //Skip full bytes
+      if (!bit_off(id)
+	  && (unsigned char)map_addr(map, bit_page(id), bit_idx(id)) == 0xFF)
+	{
+	  id += 8;
+	  continue;
+	}
+      if (!map_test(map, id))
+	return id;
+      id++;
+    }
+  return lim;
+}
+
+/**
+ * sfs_get_bblocks - Get up to @count contiguous free blocks
+ * @sb SFS super block
+ * @goal where to start searching
+ * @count number of blocks wanted
+ * @got where to store how much blocks were taken
+ *
+ * The run starts at the first free block after @goal (or from the
+ * disk start) and stops at the first used block or after @count blocks.
+ * Returns the first block id or %-ENOSPC
+ */
+int	sfs_get_bblocks(struct super_block *sb, unsigned long goal,
+			unsigned int count, unsigned int *got)
+{
+  SBI(sb);
+  MAP(sbi, BLOCK_BITMAP);
+  const unsigned long	lim = data_end(sbi);
+  unsigned long		start;
+  unsigned long		id;
+
+  printk(" ===>blks %lu+%u\n", goal, count);
+
+  mutex_lock(&sb->s_lock);
+
+  if (goal >= lim)
+    goal = 0;
+  start = sfs_find_free(map, goal, lim);
+  if (start >= lim && (start = sfs_find_free(map, 0, goal)) >= goal)
+    {
+      mutex_unlock(&sb->s_lock);
+      return -ENOSPC;
+    }
+
+  //Blocks reserved by dirty pages
+  if (count > sfs_free_avail(sbi))
+    count = sfs_free_avail(sbi);
+  if (!count)
+    {
+      mutex_unlock(&sb->s_lock);
+      return -ENOSPC;
+    }
+
+  //Take blocks until one is used
+  for (id = start; id < lim && id - start < count && !map_test(map, id); id++)
+    {
+      map_addr(map, bit_page(id), bit_idx(id)) |= 1 << bit_off(id);
+      mark_buffer_dirty(map_bh(bit_page(id)));
+    }
+  sfs_free_sub(sbi, start, id - start);
+
+  mutex_unlock(&sb->s_lock);
+  *got = id - start;
+  return start;
+}
+
+/**
+ * sfs_get_brun - Get exactly @count contiguous free blocks
+ * @sb SFS super block
+ * @goal where to start searching
+ * @count number of blocks wanted
+ *
+ * Unlike sfs_get_bblocks, runs shorter than @count are skipped : the
+ * whole disk is searched, from @goal and then from the disk start.
+ * Returns the first block id or %-ENOSPC
+ */
+int	sfs_get_brun(struct super_block *sb, unsigned long goal,
+		     unsigned int count)
+{
+  SBI(sb);
+  MAP(sbi, BLOCK_BITMAP);
+  const unsigned long	lim = data_end(sbi);
+  unsigned long		start;
+  unsigned long		stop;
+  unsigned long		id;
+  int			pass;
+
+  printk(" ===>run %lu+%u\n", goal, count);
+
+  if (!count || count > lim)
+    return -ENOSPC;
+  if (goal >= lim)
+    goal = 0;
+
+  mutex_lock(&sb->s_lock);
+  //Blocks reserved by dirty pages
+  if (count > sfs_free_avail(sbi))
+    {
+      mutex_unlock(&sb->s_lock);
+      return -ENOSPC;
+    }
+  for (pass = 0; pass < 2; pass++)
+    {
+      //From goal to the end, then from the start to goal
+      start = pass ? 0 : goal;
+      stop = pass ? min(goal + count, lim) : lim;
+      while ((start = sfs_find_free(map, start, stop)) < stop)
+	{
+	  for (id = start; id < lim && id - start < count && !map_test(map, id);
+	       id++);
+	  if (id - start == count)
+	    goto found;
+	  start = id;
+	}
+    }
+  mutex_unlock(&sb->s_lock);
+  return -ENOSPC;
+
+ found:
+  for (id = start; id < start + count; id++)
+    {
+      map_addr(map, bit_page(id), bit_idx(id)) |= 1 << bit_off(id);
+      mark_buffer_dirty(map_bh(bit_page(id)));
+    }
+  sfs_free_sub(sbi, start, count);
+  mutex_unlock(&sb->s_lock);
+  return start;
+}
+
+/*
+** Reference counts (SFS_FEAT_REFLINK) : the table after the inode table
+** holds one byte per block, the number of files sharing the block
+** minus one. It is updated under sb->s_lock, like the block bitmap.
+*/
+//Table block and byte of a block id
+#define	refc_block(sbi, id)		((sbi)->s_refc_start + (id) / REFC_PER_BLOCK)
+#define	refc_idx(id)			((id) % REFC_PER_BLOCK)
+
+/**
+ * sfs_refc_scan - Walk the reference counts from @id
+ * @sb SFS super block
+ * @id first block id
+ * @end last block id + 1
+ * @shared walk shared blocks, dropping a reference on each (with
+ *         sb->s_lock held), instead of blocks not shared
+ *
+ * An unreadable table tells nothing : the blocks may be shared.
+ * Returns the first block id not walked or %-EIO
+ */
+static long
+sfs_refc_scan(struct super_block *sb, unsigned long id, unsigned long end,
+	      int shared)
+{
+  SBI(sb);
+  struct buffer_head	*bh = NULL;
+  __u8			*refc;
+
+  for (; id < end; id++)
+    {
+      if (!bh || !refc_idx(id))
+	{
+	  brelse(bh);
+	  if (!(bh = sb_bread(sb, refc_block(sbi, id))))
+	    return -EIO;
+	}
+      refc = (__u8*)bh->b_data + refc_idx(id);
+      if (!*refc == !!shared)
+	break;
+      if (shared)
+	{
+	  (*refc)--;
+	  mark_buffer_dirty(bh);
+	}
+    }
+  brelse(bh);
+  return id;
+}
+
+/**
+ * sfs_refc_test - Tell if blocks are shared with other files
+ * @sb SFS super block
+ * @start first block id
+ * @count number of blocks
+ *
+ * The table is read without sb->s_lock : a block of a file can only
+ * become shared under the file's i_mutex.
+ * Returns 1 if one of the blocks is shared, 0 otherwise, or %-EIO
+ * if the table can't be read
+ */
+int	sfs_refc_test(struct super_block *sb, unsigned long start,
+		      unsigned long count)
+{
+  long	id;
+
+  if (!SBI_PTR(sb)->s_refc_blocks)
+    return 0;
+  if ((id = sfs_refc_scan(sb, start, start + count, 0)) < 0)
+    return id;
+  return id < start + count;
+}
+
+/**
+ * sfs_refc_get - Take one more reference on @count blocks from @start
+ * @sb SFS super block
+ * @start first block id
+ * @count number of blocks
+ *
+ * Nothing is changed if one of the blocks can't take one more.
+ * Returns 0, %-EOPNOTSUPP, %-EINVAL, %-EMLINK or %-EIO
+ */
+int	sfs_refc_get(struct super_block *sb, unsigned long start,
+		     unsigned long count)
+{
+  SBI(sb);
+  struct buffer_head	*bh = NULL;
+  __u8			*refc;
+  unsigned long		id;
+  int			pass;
+  int			err = 0;
+
+  printk(" ===>refs %lu+%lu\n", start, count);
+
+  if (!sbi->s_refc_blocks)
+    return -EOPNOTSUPP;
+  if (start + count > sbi->s_nblocks || start + count < start)
+    return -EINVAL;
+
+  mutex_lock(&sb->s_lock);
+  //Check all blocks, then count the new references
+  for (pass = 0; pass < 2 && !err; pass++)
+    for (id = start; id < start + count; id++)
+      {
+	if (!bh || !refc_idx(id))
+	  {
+	    brelse(bh);
+	    if (!(bh = sb_bread(sb, refc_block(sbi, id))))
+	      {
+		err = -EIO;
+		break;
+	      }
+	  }
+	refc = (__u8*)bh->b_data + refc_idx(id);
+	if (!pass && *refc == SFS_REFC_MAX)
+	  {
+	    err = -EMLINK;
+	    break;
+	  }
+	if (pass)
+	  {
+	    (*refc)++;
+	    mark_buffer_dirty(bh);
+	  }
+      }
+  brelse(bh);
+  mutex_unlock(&sb->s_lock);
+  return err;
+}
+
+/**
+ * sfs_clear_bits - Clear the bits of [@id, @end) in the block bitmap
+ * @map block bitmap
+ * @id first block id
+ * @end last block id + 1
+ *
+ * Whole bytes of the bitmap are cleared at once, and each bitmap block
+ * is marked dirty once.
+ * Must be called with sb->s_lock held.
+ */
+static void
+sfs_clear_bits(struct buffer_head **map, unsigned long id, unsigned long end)
+{
+  unsigned long		stop;
+
+  while (id < end)
+    {
+      //Up to the end of this bitmap block
+      stop = min(end, (bit_page(id) + 1) * (unsigned long)BIT_PER_BLOCK);
+      mark_buffer_dirty(map_bh(bit_page(id)));
+      //Leading bits
+      for (; id < stop && bit_off(id); id++)
+	map_addr(map, bit_page(id), bit_idx(id)) &= ~(1 << bit_off(id));
+      //Whole bytes
+      if (stop - id >= 8)
+	{
+	  memset(&map_addr(map, bit_page(id), bit_idx(id)), 0,
+		 (stop - id) >> 3);
+	  id += (stop - id) & ~7UL;
+	}
+      //Trailing bits
+      for (; id < stop; id++)
+	map_addr(map, bit_page(id), bit_idx(id)) &= ~(1 << bit_off(id));
+    }
+}
+
+/**
+ * sfs_take_bblocks - Mark @count blocks from @start used
+ * @sb SFS super block
+ * @start first block id
+ * @count number of blocks
+ *
+ * The caller already knows they are free (zone allocator).
+ * Must be called with sb->s_lock held.
+ */
+void	sfs_take_bblocks(struct super_block *sb, unsigned long start,
+			 unsigned long count)
+{
+  SBI(sb);
+  MAP(sbi, BLOCK_BITMAP);
+  unsigned long		id;
+
+  for (id = start; id < start + count; id++)
+    {
+      map_addr(map, bit_page(id), bit_idx(id)) |= 1 << bit_off(id);
+      if (id == start || !(id % BIT_PER_BLOCK))
+	mark_buffer_dirty(map_bh(bit_page(id)));
+    }
+  sfs_free_sub(sbi, start, count);
+}
+
+/**
+ * sfs_count_bblocks - Count the used blocks of [@start, @start + @count)
+ * @sb SFS super block
+ * @start first block id
+ * @count number of blocks
+ *
+ * Returns the number of used blocks
+ */
+unsigned long	sfs_count_bblocks(struct super_block *sb, unsigned long start,
+				  unsigned long count)
+{
+  SBI(sb);
+  MAP(sbi, BLOCK_BITMAP);
+  unsigned long		used = 0;
+  unsigned long		id = start;
+
+  while (id < start + count)
+    {
+      //Whole bytes at once
+      if (!bit_off(id) && start + count - id >= 8)
+	{
+	  used += hweight8(map_addr(map, bit_page(id), bit_idx(id)));
+	  id += 8;
+	  continue;
+	}
+      if (map_test(map, id))
+	used++;
+      id++;
+    }
+  return used;
+}
+
+/**
+ * sfs_put_bblocks - Free @count blocks from @start
+ * @sb SFS super block
+ * @start first block id
+ * @count number of blocks
+ *
+ * Blocks shared with other files only lose a reference. If the
+ * reference counts can't be read, the blocks are kept : leaking them
+ * is better than freeing blocks another file still uses.
+ * Returns 0, %-EINVAL or %-EIO
+ */
+int	sfs_put_bblocks(struct super_block *sb, unsigned long start,
+			unsigned long count)
+{
+  SBI(sb);
+  MAP(sbi, BLOCK_BITMAP);
+  const unsigned long	end = start + count;
+  struct buffer_head	*bh;
+  unsigned long		first;
+  long			id;
+  long			next;
+  int			err = 0;
+
+  printk(" __=>blks %lu+%lu\n", start, count);
+
+  if (end > sbi->s_nblocks || end < start)
+    return -EINVAL;
+
+  mutex_lock(&sb->s_lock);
+  //Read the whole table of the range before changing anything
+  if (sbi->s_refc_blocks && count)
+    for (id = refc_block(sbi, start); id <= refc_block(sbi, end - 1); id++)
+      {
+	if (!(bh = sb_bread(sb, id)))
+	  {
+	    err = -EIO;
+	    goto out;
+	  }
+	brelse(bh);
+      }
+  for (id = start; id < end; id = next)
+    {
+      next = end;
+      if (sbi->s_refc_blocks
+	  && ((id = sfs_refc_scan(sb, id, end, 1)) < 0
+	      || (next = sfs_refc_scan(sb, id, end, 0)) < 0))
+	{
+	  err = -EIO;
+	  goto out;
+	}
+      //Counted free again
+      first = max_t(unsigned long, id, free_start(sbi));
+      if (next > first)
+	sbi->s_free_blocks += sfs_count_bblocks(sb, first, next - first);
+      sfs_clear_bits(map, id, next);
+    }
+
+ out:
+  mutex_unlock(&sb->s_lock);
+  if (err)
+    printk(KERN_WARNING "SFS: can't read the reference counts of blocks"
+	   " %lu+%lu, not freed\n", start, count);
+  return err;
+}
+
 /**
  * sfs_get_binode - Get a free inode and set bit in bitmap
  * @sb SFS super block
@@ -225,6 +738,23 @@ int	sfs_get_binode(struct super_block *sb)
   return sfs_get_bit(sb, INODE_BITMAP);
 }
 
+/**
+ * sfs_test_binode - Tell if an inode is used
+ * @sb SFS super block
+ * @ino inode id
+ *
+ * Returns non zero if the inode is used
+ */
+int	sfs_test_binode(struct super_block *sb, unsigned long ino)
+{
+  SBI(sb);
+  MAP(sbi, INODE_BITMAP);
+
+  if (ino >= sbi->s_ninodes)
+    return 0;
+  return map_test(map, ino);
+}
+
 /**
  * sfs_get_bblock - Get a free block and set bit in bitmap
  * @sb SFS super block
@@ -272,3 +802,54 @@ int	sfs_put_bblock(struct super_block *sb, unsigned long blk)
   printk(" __=>blk\n");
   return sfs_put_bit(sb, blk, BLOCK_BITMAP);
 }
+
+/**
+ * sfs_resv_init - Count the free blocks
+ * @sb SFS super block, with its bitmaps read
+ */
+void	sfs_resv_init(struct super_block *sb)
+{
+  SBI(sb);
+  const unsigned long	count = sbi->s_nblocks - free_start(sbi);
+
+  sbi->s_free_blocks = count - sfs_count_bblocks(sb, free_start(sbi), count);
+  sbi->s_resv_blocks = 0;
+}
+
+/**
+ * sfs_resv_get - Reserve blocks for a page dirtied without blocks
+ * @sb SFS super block
+ * @count number of blocks
+ * @force reserve them even without room (a page dirty already)
+ *
+ * On zoned devices, SFS_ZONE_RESERVE zones are left to the cleaner.
+ * Returns 0 or %-ENOSPC
+ */
+int	sfs_resv_get(struct super_block *sb, unsigned long count, int force)
+{
+  SBI(sb);
+  const unsigned long	keep = sbi->s_zone_blocks * SFS_ZONE_RESERVE;
+  int			err = 0;
+
+  mutex_lock(&sb->s_lock);
+  if (!force && sbi->s_free_blocks < sbi->s_resv_blocks + keep + count)
+    err = -ENOSPC;
+  else
+    sbi->s_resv_blocks += count;
+  mutex_unlock(&sb->s_lock);
+  return err;
+}
+
+/**
+ * sfs_resv_put - Give back blocks reserved by sfs_resv_get
+ * @sb SFS super block
+ * @count number of blocks
+ */
+void	sfs_resv_put(struct super_block *sb, unsigned long count)
+{
+  SBI(sb);
+
+  mutex_lock(&sb->s_lock);
+  sbi->s_resv_blocks -= min(count, sbi->s_resv_blocks);
+  mutex_unlock(&sb->s_lock);
+}
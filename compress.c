@@ -0,0 +1,909 @@
+/*
+ * sfs/compress.c for SFS
+ *
+ * Copyright (C) 2009, Jeremy Cochoy
+ */
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include <linux/buffer_head.h>
+#include <linux/mpage.h>
+#include <linux/writeback.h>
+#include <linux/vmalloc.h>
+#include <linux/lzo.h>
+#include <linux/pagevec.h>
+#include "sfs_fs.h"
+#include "sfs.h"
+
+/*
+** With -o compress, regular files are written by clusters of
+** SFS_CLUSTER_BLOCKS blocks. At writeback the whole cluster is
+** compressed with LZO. If it saves at least one block, it is stored as
+** one SFS_EXT_COMPRESSED extent whose first block starts with a
+** sfs_cluster_hdr, else as plain blocks. Either way it goes to a new
+** run, through the buffer cache, and the old blocks are freed once
+** the inode is written.
+**
+** On zoned devices, all regular files are written this way, so that
+** their data goes to the zone write pointer (see zone.c). Clusters are
+** only compressed with -o compress there.
+**
+** Pages of these files have no buffers. A page of a compressed cluster
+** is read by decompressing the whole cluster, which fills the other
+** pages of the cluster on the way. Files holding compressed clusters
+** keep being written this way, even without -o compress.
+**
+** Blocks are only taken at writeback, so a page gets a reservation of
+** its blocks when it is written to (write_begin, page_mkwrite) : no
+** space left fails the write there. PageChecked marks the pages holding
+** one, under the page lock. Writeback turns it into blocks, and pages
+** dropped from the cache give it back (sfs_compr_drop_pages).
+** A new run may need more blocks than the dirty pages reserved, and
+** the old blocks only go once it is mapped. When no run is left, the
+** dirty pages of a cluster of plain blocks are written where they are,
+** as for other files : that never takes more than the reservations.
+**
+** The buffers are shared by the file system, under sbi->s_compr_lock.
+*/
+
+//Pages of a cluster
+#define	SFS_CLUSTER_PAGES	(SFS_CLUSTER_SIZE >> PAGE_CACHE_SHIFT)
+//Blocks reserved by a dirty page
+#define	SFS_PAGE_BLOCKS(inode)	(1UL << (PAGE_CACHE_SHIFT - (inode)->i_blkbits))
+//Room for a compressed cluster
+#define	SFS_COMPR_BUF_SIZE						\
+  (sizeof(struct sfs_cluster_hdr) + lzo1x_worst_compress(SFS_CLUSTER_SIZE))
+
+/*
+** ***********
+** * BUFFERS *
+** ***********
+*/
+
+/**
+ * sfs_compr_alloc - Allocate the compression buffers
+ * @sbi SFS super block info
+ *
+ * Must be called with sbi->s_compr_lock held.
+ * Returns 0 or %-ENOMEM
+ */
+static int
+sfs_compr_alloc(struct sfs_sb_info *sbi)
+{
+  //A page never holds more than a cluster
+  BUILD_BUG_ON(PAGE_CACHE_SIZE > SFS_CLUSTER_SIZE);
+
+  if (sbi->s_compr_raw && sbi->s_compr_buf && sbi->s_compr_wrk)
+    return 0;
+  if (!sbi->s_compr_raw)
+    sbi->s_compr_raw = vmalloc(SFS_CLUSTER_SIZE);
+  if (!sbi->s_compr_buf)
+    sbi->s_compr_buf = vmalloc(SFS_COMPR_BUF_SIZE);
+  if (!sbi->s_compr_wrk)
+    sbi->s_compr_wrk = vmalloc(LZO1X_1_MEM_COMPRESS);
+  if (sbi->s_compr_raw && sbi->s_compr_buf && sbi->s_compr_wrk)
+    return 0;
+  return -ENOMEM;
+}
+
+/**
+ * sfs_compr_release - Free the compression buffers
+ * @sb SFS super block
+ */
+void
+sfs_compr_release(struct super_block *sb)
+{
+  SBI(sb);
+
+  vfree(sbi->s_compr_raw);
+  vfree(sbi->s_compr_buf);
+  vfree(sbi->s_compr_wrk);
+  sbi->s_compr_raw = NULL;
+  sbi->s_compr_buf = NULL;
+  sbi->s_compr_wrk = NULL;
+}
+
+/**
+ * sfs_compr_inode - Tell if writes to @inode go through clusters
+ * @inode inode we are working on
+ *
+ * Returns 1 for regular files of a -o compress mount or a zoned device,
+ * and files holding compressed clusters, 0 otherwise
+ */
+int
+sfs_compr_inode(struct inode *inode)
+{
+  struct sfs_sb_info	*sbi = SBI_PTR(inode->i_sb);
+
+  if (!S_ISREG(inode->i_mode))
+    return 0;
+  return (sbi->s_mount_opt & SFS_MOUNT_COMPRESS) || sbi->s_zone_blocks
+    || sfs_ext_compressed(inode);
+}
+
+/*
+** ****************
+** * RESERVATIONS *
+** ****************
+*/
+
+/**
+ * sfs_compr_reserve - Reserve the blocks of a page about to be dirtied
+ * @page locked page
+ *
+ * Returns 0 or %-ENOSPC
+ */
+int
+sfs_compr_reserve(struct page *page)
+{
+  struct inode	*inode = page->mapping->host;
+  int		err;
+
+  if (PageChecked(page))
+    return 0;
+  if ((err = sfs_resv_get(inode->i_sb, SFS_PAGE_BLOCKS(inode), 0)))
+    return err;
+  SetPageChecked(page);
+  return 0;
+}
+
+/**
+ * sfs_compr_unreserve - Give back the reservation of a page
+ * @page locked page
+ */
+static void
+sfs_compr_unreserve(struct page *page)
+{
+  struct inode	*inode = page->mapping->host;
+
+  if (!PageChecked(page))
+    return;
+  ClearPageChecked(page);
+  sfs_resv_put(inode->i_sb, SFS_PAGE_BLOCKS(inode));
+}
+
+/**
+ * sfs_compr_drop_pages - Remove the pages of a range from the cache
+ * @mapping address space of the file
+ * @start first byte
+ * @end last byte, as for truncate_inode_pages_range
+ *
+ * Dirty pages of files written by clusters give back their reservation
+ * before they go.
+ */
+void
+sfs_compr_drop_pages(struct address_space *mapping, loff_t start, loff_t end)
+{
+  struct pagevec	pvec;
+  struct page		*page;
+  pgoff_t		index = (start + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+  const pgoff_t		last = (pgoff_t)(end >> PAGE_CACHE_SHIFT);
+  unsigned int		i;
+  int			done = !sfs_compr_inode(mapping->host);
+
+  pagevec_init(&pvec, 0);
+  while (!done && index <= last
+	 && pagevec_lookup(&pvec, mapping, index,
+			   min_t(pgoff_t, last - index, PAGEVEC_SIZE - 1) + 1))
+    {
+      for (i = 0; i < pagevec_count(&pvec); i++)
+	{
+	  page = pvec.pages[i];
+	  if (page->index > last)
+	    {
+	      done = 1;
+	      break;
+	    }
+	  index = page->index + 1;
+	  lock_page(page);
+	  if (page->mapping == mapping)
+	    sfs_compr_unreserve(page);
+	  unlock_page(page);
+	}
+      pagevec_release(&pvec);
+      cond_resched();
+    }
+  truncate_inode_pages_range(mapping, start, end);
+}
+
+/*
+** ********
+** * DISK *
+** ********
+*/
+
+/**
+ * sfs_compr_unpack - Decompress a cluster
+ * @sb SFS super block
+ * @map the cluster, as answered by sfs_map_blocks
+ * @raw where to decompress (%SFS_CLUSTER_SIZE bytes)
+ * @buf room for the compressed blocks
+ *
+ * All blocks of the cluster are read at once.
+ * Returns 0 or %-EIO
+ */
+static int
+sfs_compr_unpack(struct super_block *sb, struct sfs_map *map, u8 *raw,
+		 u8 *buf)
+{
+  const unsigned int	bits = sb->s_blocksize_bits;
+  struct sfs_cluster_hdr	*hdr = (void*)buf;
+  struct buffer_head	*bhs[SFS_CLUSTER_BLOCKS];
+  size_t		len = SFS_CLUSTER_SIZE;
+  unsigned int		count;
+  unsigned int		i;
+  int			err = 0;
+
+  //A compressed cluster saves at least one block
+  if (!map->m_plen || map->m_plen >= SFS_CLUSTER_BLOCKS)
+    return -EIO;
+
+  for (count = 0; count < map->m_plen; count++)
+    if (!(bhs[count] = sb_getblk(sb, map->m_pblk + count)))
+      {
+	err = -EIO;
+	break;
+      }
+  ll_rw_block(READ, count, bhs);
+  for (i = 0; i < count; i++)
+    {
+      wait_on_buffer(bhs[i]);
+      if (!buffer_uptodate(bhs[i]))
+	err = -EIO;
+      else
+	memcpy(buf + (i << bits), bhs[i]->b_data, 1 << bits);
+      brelse(bhs[i]);
+    }
+  if (err)
+    return err;
+
+  if (hdr->c_clen > (map->m_plen << bits) - sizeof(*hdr)
+      || hdr->c_rlen > SFS_CLUSTER_SIZE)
+    return -EIO;
+  if (lzo1x_decompress_safe(buf + sizeof(*hdr), hdr->c_clen, raw, &len)
+      != LZO_E_OK || len != hdr->c_rlen)
+    return -EIO;
+  memset(raw + len, 0, SFS_CLUSTER_SIZE - len);
+  return 0;
+}
+
+/**
+ * sfs_compr_read_cluster - Read a cluster as it is on disk
+ * @inode inode we are working on
+ * @first first logical block of the cluster
+ * @raw where to read it (%SFS_CLUSTER_SIZE bytes)
+ * @buf room for compressed blocks
+ *
+ * Holes and unwritten blocks read as zeros.
+ * Returns 0 or an error code
+ */
+static int
+sfs_compr_read_cluster(struct inode *inode, sector_t first, u8 *raw,
+		       u8 *buf)
+{
+  struct super_block	*sb = inode->i_sb;
+  const unsigned int	bits = inode->i_blkbits;
+  struct buffer_head	*bh;
+  struct sfs_map	map;
+  unsigned int		b;
+  unsigned int		i;
+  int			err;
+
+  for (b = 0; b < SFS_CLUSTER_BLOCKS; b += map.m_len)
+    {
+      map.m_lblk = first + b;
+      map.m_len = SFS_CLUSTER_BLOCKS - b;
+      if ((err = sfs_map_blocks(inode, &map, 0)))
+	return err;
+
+      if (!map.m_pblk || (map.m_flags & SFS_MAP_UNWRITTEN))
+	memset(raw + (b << bits), 0, map.m_len << bits);
+      else if (map.m_flags & SFS_MAP_COMPRESSED)
+	{
+	  //Compressed extents start their cluster
+	  if (b)
+	    return -EIO;
+	  if ((err = sfs_compr_unpack(sb, &map, raw, buf)))
+	    return err;
+	}
+      else
+	for (i = 0; i < map.m_len; i++)
+	  {
+	    if (!(bh = sb_bread(sb, map.m_pblk + i)))
+	      return -EIO;
+	    memcpy(raw + ((b + i) << bits), bh->b_data, 1 << bits);
+	    brelse(bh);
+	  }
+    }
+  return 0;
+}
+
+/*
+** *********
+** * PAGES *
+** *********
+*/
+
+/**
+ * sfs_compr_readpage - Read a page of a file written by clusters
+ * @page locked page
+ *
+ * Plain blocks are read by mpage. A compressed cluster is decompressed,
+ * and the pages of the cluster not cached yet are filled too.
+ * Returns 0 or an error code
+ */
+int
+sfs_compr_readpage(struct page *page)
+{
+  struct address_space	*mapping = page->mapping;
+  struct inode		*inode = mapping->host;
+  SBI(inode->i_sb);
+  const unsigned int	bits = inode->i_blkbits;
+  const loff_t		size = i_size_read(inode);
+  struct sfs_map	map;
+  struct page		*p;
+  sector_t		first;
+  pgoff_t		start;
+  pgoff_t		idx;
+  u8			*data;
+  int			err;
+
+  printk(KERN_DEBUG "sfs_compr_readpage %lu\n", page->index);
+
+  map.m_lblk = (sector_t)page->index << (PAGE_CACHE_SHIFT - bits);
+  map.m_len = 1;
+  if ((err = sfs_map_blocks(inode, &map, 0)))
+    goto out;
+  if (!(map.m_flags & SFS_MAP_COMPRESSED))
+    return mpage_readpage(page, sfs_get_block);
+
+  start = page->index & ~(pgoff_t)(SFS_CLUSTER_PAGES - 1);
+  first = (sector_t)start << (PAGE_CACHE_SHIFT - bits);
+  mutex_lock(&sbi->s_compr_lock);
+  if ((err = sfs_compr_alloc(sbi))
+      || (err = sfs_compr_read_cluster(inode, first, sbi->s_compr_raw,
+					sbi->s_compr_buf)))
+    goto out_unlock;
+
+  for (idx = start; idx < start + SFS_CLUSTER_PAGES; idx++)
+    {
+      if (idx == page->index)
+	p = page;
+      //Never wait for the other pages
+      else if (((loff_t)idx << PAGE_CACHE_SHIFT) >= size
+	       || !(p = grab_cache_page_nowait(mapping, idx)))
+	continue;
+      if (!PageUptodate(p))
+	{
+	  data = kmap_atomic(p, KM_USER0);
+	  memcpy(data, sbi->s_compr_raw + ((idx - start) << PAGE_CACHE_SHIFT),
+		 PAGE_CACHE_SIZE);
+	  kunmap_atomic(data, KM_USER0);
+	  flush_dcache_page(p);
+	  SetPageUptodate(p);
+	}
+      if (p != page)
+	{
+	  unlock_page(p);
+	  page_cache_release(p);
+	}
+    }
+
+ out_unlock:
+  mutex_unlock(&sbi->s_compr_lock);
+ out:
+  if (err)
+    SetPageError(page);
+  unlock_page(page);
+  return err;
+}
+
+/**
+ * sfs_compr_strip - Drop the buffers of a page written by clusters
+ * @page locked page
+ *
+ * They may still be mapped on the old blocks of the cluster.
+ */
+static void
+sfs_compr_strip(struct page *page)
+{
+  struct buffer_head	*head;
+  struct buffer_head	*bh;
+
+  if (!page_has_buffers(page))
+    return;
+  head = bh = page_buffers(page);
+  do
+    clear_buffer_dirty(bh);
+  while ((bh = bh->b_this_page) != head);
+  try_to_free_buffers(page);
+}
+
+/**
+ * sfs_compr_put_run - Write a run through the buffer cache
+ * @sb SFS super block
+ * @pblk first block of the run
+ * @count blocks of the run
+ * @data what to write
+ * @sync wait for each block to reach the disk
+ *
+ * Returns 0 or an error code
+ */
+static int
+sfs_compr_put_run(struct super_block *sb, u32 pblk, unsigned int count,
+		  u8 *data, int sync)
+{
+  const unsigned int	bits = sb->s_blocksize_bits;
+  struct buffer_head	*bh;
+  unsigned int		i;
+  int			err = 0;
+
+  for (i = 0; !err && i < count; i++)
+    {
+      if (!(bh = sb_getblk(sb, pblk + i)))
+	return -EIO;
+      lock_buffer(bh);
+      memcpy(bh->b_data, data + (i << bits), 1 << bits);
+      set_buffer_uptodate(bh);
+      unlock_buffer(bh);
+      mark_buffer_dirty(bh);
+      if (sync)
+	err = sync_dirty_buffer(bh);
+      brelse(bh);
+    }
+  return err;
+}
+
+/**
+ * sfs_compr_write_place - Write the dirty pages of a cluster where they
+ * are mapped
+ * @inode inode we are working on
+ * @first first logical block of the cluster
+ * @nblocks logical blocks of the cluster
+ * @dirty dirty pages of the cluster, one bit each
+ * @data the cluster
+ * @sync wait for the blocks to reach the disk
+ *
+ * Used when no run is left for the cluster. As for any file, written
+ * blocks are overwritten, and holes and unwritten blocks of the pages
+ * get blocks, covered by the pages' reservations. The old blocks can't
+ * be shared nor compressed : those need new ones.
+ * Must be called with sbi->s_compr_lock held.
+ * Returns 0, %-ENOSPC or an error code
+ */
+static int
+sfs_compr_write_place(struct inode *inode, sector_t first,
+		      unsigned int nblocks, u32 dirty, u8 *data, int sync)
+{
+  const unsigned int	shift = PAGE_CACHE_SHIFT - inode->i_blkbits;
+  const sector_t	end = first + nblocks;
+  struct sfs_map	map;
+  sector_t		lblk;
+  unsigned int		i;
+  int			err;
+
+  map.m_lblk = first;
+  map.m_len = nblocks;
+  if ((err = sfs_map_blocks(inode, &map, 0)))
+    return err;
+  if ((map.m_flags & SFS_MAP_COMPRESSED)
+      || (err = sfs_ext_shared(inode, first, end)))
+    return err < 0 ? err : -ENOSPC;
+
+  for (i = 0; i < SFS_CLUSTER_PAGES; i++)
+    {
+      if (!(dirty & (1 << i)))
+	continue;
+      for (lblk = first + (i << shift);
+	   lblk < min_t(sector_t, first + ((i + 1) << shift), end);
+	   lblk += map.m_len)
+	{
+	  map.m_lblk = lblk;
+	  map.m_len = min_t(sector_t, first + ((i + 1) << shift), end) - lblk;
+	  if ((err = sfs_map_blocks(inode, &map, 1))
+	      || (err = sfs_compr_put_run(inode->i_sb, map.m_pblk, map.m_len,
+					  data + ((lblk - first)
+						  << inode->i_blkbits),
+					  sync)))
+	    return err;
+	}
+    }
+  return 0;
+}
+
+/**
+ * sfs_compr_writepage - Write the cluster of a page
+ * @page locked page, with its dirty bit cleared
+ * @wbc writeback control
+ *
+ * The other cached pages of the cluster are written along, and marked
+ * clean. If one of them is locked, the page is left dirty for later :
+ * we never wait for a page lock with one held.
+ * Returns 0 or an error code
+ */
+int
+sfs_compr_writepage(struct page *page, struct writeback_control *wbc)
+{
+  struct address_space	*mapping = page->mapping;
+  struct inode		*inode = mapping->host;
+  struct super_block	*sb = inode->i_sb;
+  SBI(sb);
+  const unsigned int	bits = inode->i_blkbits;
+  const loff_t		size = i_size_read(inode);
+  struct sfs_cluster_hdr	*hdr;
+  struct page		*pages[SFS_CLUSTER_PAGES];
+  struct sfs_extent	old[SFS_CLUSTER_BLOCKS];
+  struct sfs_map	map;
+  sector_t		first;
+  pgoff_t		start;
+  size_t		rlen;
+  size_t		clen;
+  unsigned int		nblocks;
+  unsigned int		plen;
+  unsigned int		i;
+  u32			flags = 0;
+  u32			resv = 0;
+  u32			dirty;
+  u8			*data;
+  int			count;
+  int			pblk;
+  int			err = 0;
+
+  printk(KERN_DEBUG "sfs_compr_writepage %lu\n", page->index);
+
+  //Truncated meanwhile
+  if (page_offset(page) >= size)
+    {
+      sfs_compr_unreserve(page);
+      unlock_page(page);
+      return 0;
+    }
+
+  start = page->index & ~(pgoff_t)(SFS_CLUSTER_PAGES - 1);
+  first = (sector_t)start << (PAGE_CACHE_SHIFT - bits);
+  rlen = min_t(loff_t, size - ((loff_t)first << bits), SFS_CLUSTER_SIZE);
+  nblocks = (rlen + (1 << bits) - 1) >> bits;
+
+  //The other cached pages of the cluster
+  memset(pages, 0, sizeof(pages));
+  for (i = 0; i < SFS_CLUSTER_PAGES; i++)
+    {
+      if (start + i == page->index)
+	{
+	  pages[i] = page;
+	  continue;
+	}
+      if (((loff_t)(start + i) << PAGE_CACHE_SHIFT) >= size
+	  || !(pages[i] = find_get_page(mapping, start + i)))
+	continue;
+      if (!trylock_page(pages[i]))
+	{
+	  page_cache_release(pages[i]);
+	  pages[i] = NULL;
+	  err = -EAGAIN;
+	  goto out_pages;
+	}
+      //Not read : the disk has its data
+      if (!PageUptodate(pages[i]) || pages[i]->mapping != mapping)
+	{
+	  unlock_page(pages[i]);
+	  page_cache_release(pages[i]);
+	  pages[i] = NULL;
+	  continue;
+	}
+      wait_on_page_writeback(pages[i]);
+    }
+
+  mutex_lock(&sbi->s_compr_lock);
+  if ((err = sfs_compr_alloc(sbi)))
+    goto out_unlock;
+  //What isn't cached comes from the disk
+  for (i = 0; i << PAGE_CACHE_SHIFT < rlen && pages[i]; i++)
+    ;
+  if (i << PAGE_CACHE_SHIFT < rlen
+      && (err = sfs_compr_read_cluster(inode, first, sbi->s_compr_raw,
+				       sbi->s_compr_buf)))
+    goto out_unlock;
+  for (i = 0; i < SFS_CLUSTER_PAGES; i++)
+    if (pages[i])
+      {
+	data = kmap_atomic(pages[i], KM_USER0);
+	memcpy(sbi->s_compr_raw + (i << PAGE_CACHE_SHIFT), data,
+	       PAGE_CACHE_SIZE);
+	kunmap_atomic(data, KM_USER0);
+      }
+  memset(sbi->s_compr_raw + rlen, 0, SFS_CLUSTER_SIZE - rlen);
+
+  //Kept compressed only if it saves a block
+  hdr = (void*)sbi->s_compr_buf;
+  clen = SFS_COMPR_BUF_SIZE - sizeof(*hdr);
+  data = sbi->s_compr_raw;
+  plen = nblocks;
+  if (((sbi->s_mount_opt & SFS_MOUNT_COMPRESS) || sfs_ext_compressed(inode))
+      && lzo1x_1_compress(sbi->s_compr_raw, rlen, sbi->s_compr_buf
+		       + sizeof(*hdr), &clen, sbi->s_compr_wrk) == LZO_E_OK
+      && ((sizeof(*hdr) + clen + (1 << bits) - 1) >> bits) < nblocks)
+    {
+      plen = (sizeof(*hdr) + clen + (1 << bits) - 1) >> bits;
+      hdr->c_clen = clen;
+      hdr->c_rlen = rlen;
+      memset(sbi->s_compr_buf + sizeof(*hdr) + clen, 0,
+	     (plen << bits) - sizeof(*hdr) - clen);
+      data = sbi->s_compr_buf;
+      flags = SFS_EXT_COMPRESSED | (plen << SFS_EXT_PLEN_SHIFT);
+    }
+
+  //The reservations of the pages become blocks (taken back on failure)
+  for (i = 0; i < SFS_CLUSTER_PAGES; i++)
+    if (pages[i] && PageChecked(pages[i]))
+      {
+	ClearPageChecked(pages[i]);
+	resv |= 1 << i;
+      }
+  if (resv)
+    sfs_resv_put(sb, hweight32(resv) * SFS_PAGE_BLOCKS(inode));
+
+  //A new run, near the old one or at the zone write pointer
+  map.m_lblk = first;
+  map.m_len = 1;
+  if (sfs_map_blocks(inode, &map, 0) || !map.m_pblk)
+    map.m_pblk = sbi->s_firstdatablock;
+  if (sbi->s_zone_blocks)
+    pblk = sfs_zone_get_brun(sb, plen);
+  else
+    pblk = sfs_get_brun(sb, map.m_pblk, plen);
+  //No run left (full or fragmented) : the pages go where they are
+  if (pblk == -ENOSPC && !sbi->s_zone_blocks)
+    {
+      for (i = 0, dirty = 0; i < SFS_CLUSTER_PAGES; i++)
+	if (pages[i] && (pages[i] == page || PageDirty(pages[i])))
+	  dirty |= 1 << i;
+      if ((err = sfs_compr_write_place(inode, first, nblocks, dirty,
+				       sbi->s_compr_raw,
+				       wbc->sync_mode == WB_SYNC_ALL)))
+	goto out_unlock;
+      mutex_unlock(&sbi->s_compr_lock);
+      count = 0;
+      goto done;
+    }
+  if (pblk < 0)
+    {
+      err = pblk;
+      goto out_unlock;
+    }
+  //Zones are written in order
+  if ((err = sfs_compr_put_run(sb, pblk, plen, data,
+			       wbc->sync_mode == WB_SYNC_ALL
+			       || sbi->s_zone_blocks)))
+    goto out_put;
+  mutex_unlock(&sbi->s_compr_lock);
+
+  if ((count = sfs_ext_cluster(inode, first, pblk, nblocks, flags, old)) < 0)
+    {
+      err = count;
+      sfs_put_bblocks(sb, pblk, plen);
+      goto out_pages;
+    }
+
+ done:
+  //All pages of the cluster are on disk
+  for (i = 0; i < SFS_CLUSTER_PAGES; i++)
+    if (pages[i])
+      {
+	sfs_compr_strip(pages[i]);
+	if (pages[i] != page)
+	  {
+	    clear_page_dirty_for_io(pages[i]);
+	    unlock_page(pages[i]);
+	    page_cache_release(pages[i]);
+	  }
+      }
+  //The old blocks go once the new map is on disk. If it can't be
+  //written, they stay allocated rather than risk being reused.
+  if (count && (err = sfs_write_inode(inode, 1)))
+    mapping_set_error(mapping, err);
+  else
+    for (i = 0; i < count; i++)
+      sfs_put_bblocks(sb, old[i].e_pblk, old[i].e_len);
+  set_page_writeback(page);
+  unlock_page(page);
+  end_page_writeback(page);
+  return 0;
+
+ out_put:
+  sfs_put_bblocks(sb, pblk, plen);
+ out_unlock:
+  mutex_unlock(&sbi->s_compr_lock);
+ out_pages:
+  //The pages stay dirty, with their reservations
+  if (resv)
+    {
+      sfs_resv_get(sb, hweight32(resv) * SFS_PAGE_BLOCKS(inode), 1);
+      for (i = 0; i < SFS_CLUSTER_PAGES; i++)
+	if (resv & (1 << i))
+	  SetPageChecked(pages[i]);
+    }
+  for (i = 0; i < SFS_CLUSTER_PAGES; i++)
+    if (pages[i] && pages[i] != page)
+      {
+	unlock_page(pages[i]);
+	page_cache_release(pages[i]);
+      }
+  //Busy cluster or no memory : try again later. No space left : the
+  //data stays in the cache, and fsync reports it.
+  if (err == -EAGAIN || err == -ENOMEM || err == -ENOSPC)
+    {
+      if (err == -ENOSPC)
+	{
+	  printk("SFS-fs warning: no space to write inode %lu\n",
+		 inode->i_ino);
+	  mapping_set_error(mapping, err);
+	}
+      redirty_page_for_writepage(wbc, page);
+      err = 0;
+    }
+  else
+    {
+      SetPageError(page);
+      mapping_set_error(mapping, err);
+    }
+  unlock_page(page);
+  return err;
+}
+
+/**
+ * sfs_compr_write_begin - Prepare a write without buffers
+ * @file opened file
+ * @mapping address space of the file
+ * @pos where the write starts
+ * @len bytes written in the page
+ * @flags AOP_FLAG_*
+ * @pagep where to return the page
+ * @fsdata unused
+ *
+ * The page is read first, unless it is fully written or past the end
+ * of the file. Blocks are only allocated at writeback, but reserved now.
+ * Returns 0, %-ENOSPC or an error code
+ */
+int
+sfs_compr_write_begin(struct file *file, struct address_space *mapping,
+		      loff_t pos, unsigned len, unsigned flags,
+		      struct page **pagep, void **fsdata)
+{
+  struct page	*page;
+  unsigned	from = pos & (PAGE_CACHE_SIZE - 1);
+  int		err;
+
+  printk(KERN_DEBUG "sfs_compr_write_begin\n");
+
+  if ((err = sfs_zone_wait(mapping->host->i_sb)))
+    return err;
+  if (!(page = grab_cache_page_write_begin(mapping, pos >> PAGE_CACHE_SHIFT,
+					   flags)))
+    return -ENOMEM;
+  *pagep = page;
+  if ((err = sfs_compr_reserve(page)))
+    {
+      unlock_page(page);
+      goto out_release;
+    }
+  if (PageUptodate(page) || (!from && len == PAGE_CACHE_SIZE)
+      || page_offset(page) >= i_size_read(mapping->host))
+    return 0;
+
+  //Partial write : the rest of the page is needed
+  err = sfs_compr_readpage(page);
+  lock_page(page);
+  if (!err && PageUptodate(page) && page->mapping == mapping)
+    return 0;
+  if (!err)
+    err = -EIO;
+  if (page->mapping == mapping && !PageDirty(page))
+    sfs_compr_unreserve(page);
+  unlock_page(page);
+ out_release:
+  page_cache_release(page);
+  *pagep = NULL;
+  return err;
+}
+
+/**
+ * sfs_compr_write_end - End a write started by sfs_compr_write_begin
+ * @file opened file
+ * @mapping address space of the file
+ * @pos where the write started
+ * @len bytes to write in the page
+ * @copied bytes written
+ * @page locked page
+ * @fsdata unused
+ *
+ * A page that wasn't read is zeroed around the write. A short copy in
+ * it writes nothing, so that the caller tries again.
+ * Returns the bytes written
+ */
+int
+sfs_compr_write_end(struct file *file, struct address_space *mapping,
+		    loff_t pos, unsigned len, unsigned copied,
+		    struct page *page, void *fsdata)
+{
+  struct inode	*inode = mapping->host;
+  unsigned	from = pos & (PAGE_CACHE_SIZE - 1);
+
+  if (!PageUptodate(page))
+    {
+      if (copied < len)
+	copied = 0;
+      else
+	{
+	  zero_user_segments(page, 0, from, from + len, PAGE_CACHE_SIZE);
+	  SetPageUptodate(page);
+	}
+    }
+  if (copied)
+    {
+      if (pos + copied > inode->i_size)
+	i_size_write(inode, pos + copied);
+      set_page_dirty(page);
+    }
+  else if (!PageDirty(page))
+    sfs_compr_unreserve(page);
+  unlock_page(page);
+  page_cache_release(page);
+  return copied;
+}
+
+/**
+ * sfs_compr_truncate_page - Zero the end of the last page of a file
+ * @inode inode we are working on
+ * @size new size of the file
+ *
+ * Zeroes reach the disk with the next write of the cluster. A page
+ * over a hole is zeroed too when cached : it may hold dirty data that
+ * has no blocks yet.
+ * Returns 0 or an error code
+ */
+int
+sfs_compr_truncate_page(struct inode *inode, loff_t size)
+{
+  struct address_space	*mapping = inode->i_mapping;
+  unsigned		off = size & (PAGE_CACHE_SIZE - 1);
+  struct sfs_map	map;
+  struct page		*page;
+  int			hole;
+  int			err;
+
+  if (!off)
+    return 0;
+  map.m_lblk = size >> inode->i_blkbits;
+  map.m_len = 1;
+  if ((err = sfs_map_blocks(inode, &map, 0)))
+    return err;
+  //Nothing on disk to zero : only the cached page. It is dirty
+  //already if it holds data, and left clean (with no reservation)
+  //otherwise.
+  if ((hole = !map.m_pblk || (map.m_flags & SFS_MAP_UNWRITTEN)))
+    {
+      if (!(page = find_lock_page(mapping, size >> PAGE_CACHE_SHIFT)))
+	return 0;
+    }
+  else
+    {
+      page = read_mapping_page(mapping, size >> PAGE_CACHE_SHIFT, NULL);
+      if (IS_ERR(page))
+	return PTR_ERR(page);
+      lock_page(page);
+    }
+  if (page->mapping == mapping)
+    {
+      zero_user(page, off, PAGE_CACHE_SIZE - off);
+      if (!hole)
+	set_page_dirty(page);
+    }
+  unlock_page(page);
+  page_cache_release(page);
+  return 0;
+}
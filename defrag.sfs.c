@@ -0,0 +1,262 @@
+#define _XOPEN_SOURCE 500
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/types.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include "sfs_fs.h"
+
+/////////
+//DEFINES
+/////////
+#define	EXIT_USAGE	4
+#define	EXIT_DIE	16
+#define	EXIT_DONE	0
+//Blocks moved by one SFS_IOC_DEFRAG call
+#define	DEF_STEP	4096
+//Max open file descriptors used by nftw
+#define	FTW_FDS		16
+
+//A file to defragment
+struct	file_ent
+{
+  char	*path;
+  __u32	extents;
+};
+
+/////////
+//GLOBALS
+/////////
+//program name
+char			*defrag_name = 0;
+//blocks moved by ioctl
+__u64			step = DEF_STEP;
+//rate limit in MB/s (0 : none)
+__u64			rate = 0;
+//only report fragmentation
+char			dry_run = 0;
+//files found
+struct file_ent		*files = 0;
+unsigned int		count_files = 0;
+unsigned int		max_files = 0;
+//bytes moved since start
+__u64			moved = 0;
+//start time
+struct timeval		start_time;
+
+///////
+//TOOLS
+///////
+//Usage message
+void	usage(void)
+{
+  printf("%s [-n] [-rMB/s] [-sBLOCKS] path...\n", defrag_name);
+  exit(EXIT_USAGE);
+}
+
+//Output warnings
+void	warn(const char *path, const char *msg)
+{
+  printf("%s: Warning: %s: %s\n", defrag_name, path, msg);
+}
+
+//Output errors
+void	die(const char *msg)
+{
+  printf("%s: %s\n", defrag_name, msg);
+  exit(EXIT_DIE);
+}
+
+////
+//Count extents with FIEMAP
+////
+int	count_extents(const char *path, __u32 *extents)
+{
+  struct fiemap	fm;
+  int		fd;
+
+  if ((fd = open(path, O_RDONLY)) == -1)
+    return -1;
+  //No extent array : only count them
+  memset(&fm, 0, sizeof(fm));
+  fm.fm_length = FIEMAP_MAX_OFFSET;
+  fm.fm_flags = FIEMAP_FLAG_SYNC;
+  if (ioctl(fd, FS_IOC_FIEMAP, &fm) == -1)
+    {
+      close(fd);
+      return -1;
+    }
+  close(fd);
+  *extents = fm.fm_mapped_extents;
+  return 0;
+}
+
+////
+//Collect fragmented files
+////
+int	collect(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+  __u32	extents;
+
+  if (flag != FTW_F || !S_ISREG(st->st_mode))
+    return 0;
+  if (count_extents(path, &extents) == -1)
+    {
+      warn(path, strerror(errno));
+      return 0;
+    }
+  if (extents <= 1)
+    return 0;
+
+  if (count_files == max_files)
+    {
+      max_files = max_files ? max_files * 2 : 64;
+      if (!(files = realloc(files, max_files * sizeof(*files))))
+	die("Out of memory");
+    }
+  if (!(files[count_files].path = strdup(path)))
+    die("Out of memory");
+  files[count_files].extents = extents;
+  count_files++;
+  return 0;
+}
+
+//Most fragmented first
+int	cmp_files(const void *a, const void *b)
+{
+  const struct file_ent	*fa = a;
+  const struct file_ent	*fb = b;
+
+  if (fa->extents != fb->extents)
+    return (fa->extents < fb->extents) ? 1 : -1;
+  return strcmp(fa->path, fb->path);
+}
+
+////
+//Sleep until we are back under the rate limit
+////
+void	throttle(void)
+{
+  struct timeval	now;
+  double		elapsed;
+  double		wanted;
+
+  if (!rate)
+    return;
+  gettimeofday(&now, 0);
+  elapsed = (now.tv_sec - start_time.tv_sec)
+    + (now.tv_usec - start_time.tv_usec) / 1000000.;
+  wanted = (double)moved / (rate << 20);
+  if (wanted > elapsed)
+    usleep((wanted - elapsed) * 1000000);
+}
+
+////
+//Defragment one file, step by step
+////
+void	defrag_file(struct file_ent *ent)
+{
+  struct sfs_defrag	arg;
+  struct stat		st;
+  __u64			blocks;
+  __u64			done = 0;
+  __u32			extents;
+  int			fd;
+
+  if ((fd = open(ent->path, O_RDWR)) == -1 || fstat(fd, &st) == -1)
+    {
+      warn(ent->path, strerror(errno));
+      if (fd != -1)
+	close(fd);
+      return;
+    }
+  blocks = (st.st_size + SFS_BLOCK_SIZE - 1) >> SFS_BLOCK_LOG_SIZE;
+
+  for (arg.d_start = 0; arg.d_start < blocks; arg.d_start += arg.d_len)
+    {
+      arg.d_len = step;
+      arg.d_moved = 0;
+      if (ioctl(fd, SFS_IOC_DEFRAG, &arg) == -1)
+	{
+	  warn(ent->path, strerror(errno));
+	  break;
+	}
+      done += arg.d_moved;
+      moved += arg.d_moved << SFS_BLOCK_LOG_SIZE;
+      throttle();
+    }
+  close(fd);
+
+  if (count_extents(ent->path, &extents) == -1)
+    extents = 0;
+  printf("%s: %u -> %u extents (%llu blocks moved)\n", ent->path,
+	 ent->extents, extents, (unsigned long long)done);
+}
+
+//DEFRAG.SFS ENTRY POINT
+int	main(int ac, char *av[])
+{
+  int		c;
+  char		*err;
+  unsigned int	i;
+
+  //Remember program name
+  defrag_name = av[0];
+
+  //Check opts
+  opterr = 0;
+  while((c = getopt(ac, av, "nr:s:")) != -1)
+    {
+      switch(c)
+	{
+	case 'n':
+	  dry_run = 1;
+	  break;
+	case 'r':
+	  rate = strtoull(optarg, &err, 0);
+	  if (*err)
+	    die("Invalid rate");
+	  break;
+	case 's':
+	  step = strtoull(optarg, &err, 0);
+	  if (*err || !step)
+	    die("Invalid step");
+	  break;
+	default :
+	  usage();
+	}
+    }
+  ac -= optind;
+  av += optind;
+
+  if (ac < 1)
+    usage();
+
+  //Find fragmented files, on this file system only
+  for (i = 0; i < ac; i++)
+    if (nftw(av[i], collect, FTW_FDS, FTW_PHYS | FTW_MOUNT) == -1)
+      warn(av[i], strerror(errno));
+  qsort(files, count_files, sizeof(*files), cmp_files);
+
+  gettimeofday(&start_time, 0);
+  for (i = 0; i < count_files; i++)
+    {
+      if (dry_run)
+	printf("%s: %u extents\n", files[i].path, files[i].extents);
+      else
+	defrag_file(&files[i]);
+      free(files[i].path);
+    }
+  free(files);
+
+  return EXIT_DONE;
+}
@@ -32,6 +32,8 @@ static int	sfs_readdir
   char				*kaddr;
   //Len name
   int	len;
+  //Directory bytes in the page
+  unsigned int	limit;
 
   printk(KERN_DEBUG " sfs_readdir\n");
 
@@ -56,28 +58,34 @@ static int	sfs_readdir
 
       printk(KERN_DEBUG "  #page = %lu(lim:%lu) off=%lu\n", pidx, cnt_pages, offset);
 
-      //End is ino = 0 (An entry can't be broken into 2 pages!)
+      //On each block of the page, end is ino = 0
+      //(An entry can't be broken into 2 blocks!)
       kaddr = (void*)page_address(page);
-      dent = (void*)kaddr + offset;
-      while (dent->d_ino)
-  	{
-  	  len = strlen(dent->d_name);
-  	  offset = (char*)dent - kaddr;
-  	  printk("      -> walk on ino:%u id %lu\n", dent->d_ino,
-  		 (unsigned long)(((pidx << PAGE_CACHE_SHIFT) | offset)));
-  	  //Fill file (unknow type, fs will know by checking inode latter)
-  	  if (filldir(dirent, dent->d_name, len,
-  		      file->f_pos = ((pidx << PAGE_CACHE_SHIFT) | offset),
-  		      dent->d_ino, DT_UNKNOWN))
-  	    {
-  	      //Unlock the page
-  	      unlock_page(page);
-  	      //filldir error
-  	      sfs_put_page(page);
-  	      goto out;
-  	    }
-  	  dent = sfs_next_dentry(dent, len);
-  	}
+      limit = sfs_page_bytes(inode, pidx);
+      for (; offset < limit;
+	   offset = (offset & ~(SFS_DIR_CHUNK - 1)) + SFS_DIR_CHUNK)
+	{
+	  dent = (void*)kaddr + offset;
+	  while (dent->d_ino)
+	    {
+	      len = strlen(dent->d_name);
+	      offset = (char*)dent - kaddr;
+	      printk("      -> walk on ino:%u id %lu\n", dent->d_ino,
+		     (unsigned long)(((pidx << PAGE_CACHE_SHIFT) | offset)));
+	      //Fill file (unknow type, fs will know by checking inode latter)
+	      if (filldir(dirent, dent->d_name, len,
+			  file->f_pos = ((pidx << PAGE_CACHE_SHIFT) | offset),
+			  dent->d_ino, DT_UNKNOWN))
+		{
+		  //Unlock the page
+		  unlock_page(page);
+		  //filldir error
+		  sfs_put_page(page);
+		  goto out;
+		}
+	      dent = sfs_next_dentry(dent, len);
+	    }
+	}
       printk(KERN_DEBUG "  #finwhile\n");
 
       //Unlock and put page
@@ -86,15 +94,13 @@ static int	sfs_readdir
       offset = 0;
     }
 
-  //. and .. are special directory
+  //. and .. are special directory, right after the last block
   //the inode value can be anything > 0 (So, we can't use the real inode, cause iroot->i_ino = 0)
-  if (offset == 0 && filldir(dirent, ".", 1,
-			     file->f_pos = ((pidx << PAGE_CACHE_SHIFT) | offset),
-			     inode->i_ino, DT_DIR))
+  if (file->f_pos <= inode->i_size
+      && filldir(dirent, ".", 1, file->f_pos = inode->i_size,
+		 inode->i_ino, DT_DIR))
     goto out;
-  offset = 1;
-  filldir(dirent, "..", 2,
-	  file->f_pos = ((pidx << PAGE_CACHE_SHIFT) | offset),
+  filldir(dirent, "..", 2, file->f_pos = inode->i_size + 1,
 	  parent->i_ino, DT_DIR);
 
   //Finish, . .. and other writed.
@@ -126,6 +132,9 @@ sfs_empty_dir
   struct sfs_dirent*	dent;
   //Page index
   unsigned long		pidx;
+  //Block offset and limit in the page
+  unsigned int		off;
+  unsigned int		limit;
 
   printk(KERN_DEBUG " sfs_emptydir\n");
 
@@ -140,10 +149,14 @@ sfs_empty_dir
       //Lock page
       lock_page(page);
 
-      //End is ino = 0
-      dent  = (void*)page_address(page);
-      if (dent->d_ino)
-	goto no_empty;
+      //End is ino = 0, on each block
+      limit = sfs_page_bytes(inode, pidx);
+      for (off = 0; off < limit; off += SFS_DIR_CHUNK)
+	{
+	  dent = (void*)page_address(page) + off;
+	  if (dent->d_ino)
+	    goto no_empty;
+	}
 
       //Unlock and put page
       unlock_page(page);
@@ -177,9 +190,11 @@ sfs_add_link(struct dentry *dentry, struct inode *inode)
   struct sfs_dirent	*dent;
   struct page		*page;
   char			*kaddr;
-  int			pidx ;
+  unsigned long		pidx;
+  unsigned int		off;
+  unsigned int		limit;
   int			lspace;
-  int			pos;
+  loff_t		pos;
   int			err = 0;
   int			wrlen;
 
@@ -190,8 +205,8 @@ sfs_add_link(struct dentry *dentry, struct inode *inode)
   if(sbi->s_namelen && len >= sbi->s_namelen)
     goto inval;
 
-  //Check dent size (name+ino must be smaller than block_size - sizeof(dent)!)
-  if(PAGE_CACHE_SIZE - sizeof(dent) < dsize)
+  //Check dent size (name+ino+end ino must fit in a block!)
+  if(SFS_DIR_CHUNK - sizeof(dent->d_ino) < dsize + 1)
     goto nospc;
 
   //Search first free space
@@ -208,16 +223,21 @@ sfs_add_link(struct dentry *dentry, struct inode *inode)
       kaddr = page_address(page);
       printk(KERN_DEBUG " %%%%pidx%lu\n", (unsigned long)pidx);
 
-      //Goto page end
-      for(dent = (void*)kaddr;
-	  dent->d_ino;
-	  dent = sfs_next_dentry(dent, strlen(dent->d_name)));
-
-      //Check space available
-      lspace = (char*)dent - kaddr;
-      printk(KERN_DEBUG " %%%%lspace%lu\n", (unsigned long)lspace);
-      if (lspace + sizeof(dent) + dsize < BLOCK_SIZE)
-	goto add_dent;
+      //On each block of the page
+      limit = sfs_page_bytes(dir, pidx);
+      for (off = 0; off < limit; off += SFS_DIR_CHUNK)
+	{
+	  //Goto block end
+	  for(dent = (void*)(kaddr + off);
+	      dent->d_ino;
+	      dent = sfs_next_dentry(dent, strlen(dent->d_name)));
+
+	  //Check space available
+	  lspace = (char*)dent - (kaddr + off);
+	  printk(KERN_DEBUG " %%%%lspace%lu\n", (unsigned long)lspace);
+	  if (lspace + dsize + 1 + sizeof(dent->d_ino) <= SFS_DIR_CHUNK)
+	    goto add_dent;
+	}
 
       //Unlock and put page
       unlock_page(page);
@@ -227,21 +247,22 @@ sfs_add_link(struct dentry *dentry, struct inode *inode)
     }
 
   ////
-  //Expend : add a new page
+  //Expend : add a new block
   ////
   printk(KERN_DEBUG " %%%%exp\n");
-  //Add a page in file size
-  i_size_write(dir, dir->i_size + PAGE_CACHE_SIZE);
-  cnt_pages++;
+  //The block goes at the end, in the last page or in a new one
+  pidx = dir->i_size >> PAGE_CACHE_SHIFT;
+  off = dir->i_size & ~PAGE_CACHE_MASK;
+  i_size_write(dir, dir->i_size + SFS_DIR_CHUNK);
   //Get page
-  //  pidx is already at the great value
   page = sfs_get_page(dir, pidx);
   if(IS_ERR(page))
     goto inv_page;
   lock_page(page);
   //Get dent
   kaddr = page_address(page);
-  dent = (void*)kaddr;
+  memset(kaddr + off, 0, SFS_DIR_CHUNK);
+  dent = (void*)(kaddr + off);
   goto add_dent;
 
  inv_page:
@@ -251,7 +272,7 @@ sfs_add_link(struct dentry *dentry, struct inode *inode)
   return -EINVAL;
 
  add_dent:
-  printk(" %%%% father:%lu child:%lu [page:%d]\n", dir->i_ino, inode->i_ino, pidx);
+  printk(" %%%% father:%lu child:%lu [page:%lu]\n", dir->i_ino, inode->i_ino, pidx);
   //Get position
   pos = page_offset(page) + ((char*)dent - kaddr);
   //Set ino
@@ -262,9 +283,9 @@ sfs_add_link(struct dentry *dentry, struct inode *inode)
   dent = sfs_next_dentry(dent, len);
   dent->d_ino = 0;
 
-  //Write full page on disk
-  wrlen = dsize + sizeof(dent->d_ino);
-  printk(" %%%% pos:%d wrlen:%d\n", pos, wrlen);
+  //Write the entry and the end on disk
+  wrlen = dsize + 1 + sizeof(dent->d_ino);
+  printk(" %%%% pos:%lld wrlen:%d\n", (long long)pos, wrlen);
   err = __sfs_write_begin(NULL, page->mapping, pos, wrlen,
 			  AOP_FLAG_UNINTERRUPTIBLE, &page, NULL);
   if(err)
@@ -298,17 +319,17 @@ sfs_delete_entry(struct sfs_dirent *dent, struct page *page)
   struct inode		*inode = page->mapping->host;
   const int		lname = strlen(dent->d_name);
   struct sfs_dirent	*next_dent = sfs_next_dentry(dent, lname);
-  int			memlen = PAGE_CACHE_SIZE;
   char			*kaddr = page_address(page);
-  int			pos;
+  //Offset of the entry, and of its block's end, in the page
+  const unsigned int	off = (char*)dent - kaddr;
+  const unsigned int	end = (off & ~(SFS_DIR_CHUNK - 1)) + SFS_DIR_CHUNK;
+  const unsigned int	memlen = end - off;
+  const loff_t		pos = page_offset(page) + off;
   int			err = 0;
 
   printk(" sfs_delete_entry\n");
-  //Memory to re-write
-  pos = (char*)dent - kaddr;
-  memlen -= sizeof(dent) + lname + pos;
-  //Erase dentry and move others dentries
-  memcpy(dent, next_dent, memlen);
+  //Erase dentry and move the next ones of the block
+  memmove(dent, next_dent, end - ((char*)next_dent - kaddr));
 
   //Write on disk
   err = __sfs_write_begin(NULL, page->mapping,
@@ -320,7 +341,7 @@ sfs_delete_entry(struct sfs_dirent *dent, struct page *page)
       goto unlock;
     }
 
-  printk(KERN_DEBUG "   --delentry pos:%d len:%d\n", pos, memlen);
+  printk(KERN_DEBUG "   --delentry pos:%lld len:%u\n", (long long)pos, memlen);
 
   if(block_write_end(NULL, page->mapping, pos, memlen,
 		     memlen, page, NULL) != memlen)
@@ -4,6 +4,12 @@
  * Copyright (C) 2009, Jeremy Cochoy
  */
 #include <linux/buffer_head.h>
+#include <linux/falloc.h>
+#include <linux/file.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/uio.h>
+#include <linux/xattr.h>
 #include "sfs_fs.h"
 #include "sfs.h"
 
@@ -22,19 +28,522 @@ sfs_getattr(struct vfsmount *mnt, struct dentry *dentry, struct kstat *stat)
   return 0;
 }
 
+//fallocate modes newer than this kernel's headers
+#ifndef FALLOC_FL_PUNCH_HOLE
+# define	FALLOC_FL_PUNCH_HOLE		0x02
+#endif
+#ifndef FALLOC_FL_COLLAPSE_RANGE
+# define	FALLOC_FL_COLLAPSE_RANGE	0x08
+#endif
+#ifndef FALLOC_FL_ZERO_RANGE
+# define	FALLOC_FL_ZERO_RANGE		0x10
+#endif
+
+/**
+ * sfs_zero_partial - Write zeros through the page cache
+ * @inode File's inode
+ * @from Start of the range
+ * @len Length of the range (inside one block)
+ *
+ * Holes and unwritten blocks are already zeros on disk, and left alone
+ * unless the page is cached : compressed and zoned files only get
+ * blocks at writeback, so it may hold dirty data.
+ * Returns 0 or an error code
+ */
+static int
+sfs_zero_partial(struct inode *inode, loff_t from, unsigned len)
+{
+  struct address_space	*mapping = inode->i_mapping;
+  struct sfs_map	map;
+  struct page		*page;
+  void			*fsdata;
+  int			err;
+
+  if (from >= inode->i_size)
+    return 0;
+  if (from + len > inode->i_size)
+    len = inode->i_size - from;
+  if (!len)
+    return 0;
+
+  map.m_lblk = from >> inode->i_blkbits;
+  map.m_len = 1;
+  if ((err = sfs_map_blocks(inode, &map, 0)))
+    return err;
+  if (!map.m_pblk || (map.m_flags & SFS_MAP_UNWRITTEN))
+    {
+      if (!(page = find_get_page(mapping, from >> PAGE_CACHE_SHIFT)))
+	return 0;
+      page_cache_release(page);
+    }
+
+  err = pagecache_write_begin(NULL, mapping, from, len,
+			      AOP_FLAG_UNINTERRUPTIBLE, &page, &fsdata);
+  if (err)
+    return err;
+  zero_user(page, from & ~PAGE_CACHE_MASK, len);
+  err = pagecache_write_end(NULL, mapping, from, len, len, page, fsdata);
+  return (err < 0) ? err : 0;
+}
+
+/**
+ * sfs_setattr - Change the attributes of a file
+ * @dentry File's dentry
+ * @attr New attributes
+ *
+ * Pages cut by a truncate give back their reservation first (see
+ * compress.c).
+ * Returns 0 or an error code
+ */
+static int
+sfs_setattr(struct dentry *dentry, struct iattr *attr)
+{
+  struct inode	*inode = dentry->d_inode;
+  int		err;
+
+  if ((err = inode_change_ok(inode, attr)))
+    return err;
+  if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size < i_size_read(inode))
+    sfs_compr_drop_pages(inode->i_mapping, attr->ia_size, (loff_t)-1);
+  return inode_setattr(inode, attr);
+}
+
+/**
+ * sfs_punch - Punch a hole, or zero a range
+ * @inode File's inode
+ * @mode %FALLOC_FL_PUNCH_HOLE or %FALLOC_FL_ZERO_RANGE
+ * @offset Start of the range
+ * @len Length of the range
+ *
+ * Partial blocks are zeroed in the page cache. Whole blocks are dropped
+ * from the page cache and freed by extents. They become a hole, or
+ * unwritten blocks for %FALLOC_FL_ZERO_RANGE. On files holding
+ * compressed clusters, whole blocks must cover whole clusters.
+ * Returns 0 or an error code (%-EOPNOTSUPP for a partial cluster)
+ */
+static int
+sfs_punch(struct inode *inode, int mode, loff_t offset, loff_t len)
+{
+  struct address_space	*mapping = inode->i_mapping;
+  const unsigned int	bits = inode->i_blkbits;
+  const loff_t		end = offset + len;
+  //First and last+1 blocks fully inside the range
+  const sector_t	first = (offset + (1 << bits) - 1) >> bits;
+  const sector_t	last = end >> bits;
+  int			err;
+
+  printk(KERN_DEBUG "sfs_punch\n");
+
+  //Inside one block
+  if (first > last)
+    return sfs_zero_partial(inode, offset, len);
+  //Compressed clusters can't be split : whole clusters only, or up to
+  //the end of the file. Checked before the page cache is touched.
+  if (first < last && sfs_ext_compressed(inode)
+      && ((first & (SFS_CLUSTER_BLOCKS - 1))
+	  || ((last & (SFS_CLUSTER_BLOCKS - 1))
+	      && ((loff_t)last << bits) < i_size_read(inode))))
+    return -EOPNOTSUPP;
+
+  if ((err = sfs_zero_partial(inode, offset, ((loff_t)first << bits) - offset))
+      || (err = sfs_zero_partial(inode, (loff_t)last << bits,
+				 end - ((loff_t)last << bits))))
+    return err;
+  if (first == last)
+    return 0;
+
+  //No cached page may be written back on freed blocks
+  unmap_mapping_range(mapping, (loff_t)first << bits,
+		      (loff_t)(last - first) << bits, 1);
+  sfs_compr_drop_pages(mapping, (loff_t)first << bits,
+		       ((loff_t)last << bits) - 1);
+
+  //Zoned devices : unwritten blocks would sit in conventional zones
+  if ((mode & FALLOC_FL_ZERO_RANGE) && !SBI_PTR(inode->i_sb)->s_zone_blocks)
+    return sfs_ext_zero(inode, first, last);
+  return sfs_ext_punch(inode, first, last);
+}
+
+/**
+ * sfs_collapse - Remove a range from a file
+ * @inode File's inode
+ * @offset Start of the range (block aligned)
+ * @len Length of the range (block aligned)
+ *
+ * Data after the range moves down, and the file shrinks by @len.
+ * Returns 0 or an error code
+ */
+static int
+sfs_collapse(struct inode *inode, loff_t offset, loff_t len)
+{
+  struct address_space	*mapping = inode->i_mapping;
+  const unsigned int	bits = inode->i_blkbits;
+  int			err;
+
+  printk(KERN_DEBUG "sfs_collapse\n");
+
+  if ((offset | len) & ((1 << bits) - 1))
+    return -EINVAL;
+  if (offset + len >= inode->i_size)
+    return -EINVAL;
+
+  //All pages after offset change of position
+  if ((err = filemap_write_and_wait_range(mapping, offset, LLONG_MAX)))
+    return err;
+  unmap_mapping_range(mapping, offset, 0, 1);
+  sfs_compr_drop_pages(mapping, offset, (loff_t)-1);
+
+  err = sfs_ext_collapse(inode, offset >> bits, (offset + len) >> bits);
+  if (!err)
+    i_size_write(inode, inode->i_size - len);
+  return err;
+}
+
+/**
+ * sfs_fallocate - Preallocate, punch, zero or collapse a range of a file
+ * @inode File's inode
+ * @mode 0, %FALLOC_FL_KEEP_SIZE, %FALLOC_FL_PUNCH_HOLE,
+ *       %FALLOC_FL_ZERO_RANGE or %FALLOC_FL_COLLAPSE_RANGE
+ * @offset Start of the range
+ * @len Length of the range
+ *
+ * Blocks are allocated in contiguous runs and marked unwritten : they
+ * read as zeros and nothing is written until the application does.
+ * Blocks released go back to the bitmap by whole extents. Zoned devices
+ * can't preallocate, and zero ranges with holes.
+ * This kernel's fallocate refuses modes without %FALLOC_FL_KEEP_SIZE :
+ * collapsing, and zeroing past the end, go through SFS_IOC_FALLOCATE.
+ * Returns 0 or an error code
+ */
+long
+sfs_fallocate(struct inode *inode, int mode, loff_t offset, loff_t len)
+{
+  struct super_block	*sb = inode->i_sb;
+  sector_t		end;
+  int			err;
+
+  printk(KERN_DEBUG "sfs_fallocate\n");
+
+  if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE
+	       | FALLOC_FL_ZERO_RANGE | FALLOC_FL_COLLAPSE_RANGE))
+    return -EOPNOTSUPP;
+  if (!S_ISREG(inode->i_mode))
+    return -ENODEV;
+
+  mutex_lock(&inode->i_mutex);
+  //Blocks only go to files out of i_data
+  if ((err = sfs_inline_convert(inode)))
+    goto out;
+
+  //Punch hole : size never changes
+  if (mode & FALLOC_FL_PUNCH_HOLE)
+    {
+      err = -EOPNOTSUPP;
+      if (mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE))
+	err = sfs_punch(inode, mode, offset, len);
+      goto out;
+    }
+
+  //Collapse range : comes alone
+  if (mode & FALLOC_FL_COLLAPSE_RANGE)
+    {
+      err = -EINVAL;
+      if (mode == FALLOC_FL_COLLAPSE_RANGE)
+	err = sfs_collapse(inode, offset, len);
+      goto out;
+    }
+
+  //Zero range or preallocation
+  if (mode & FALLOC_FL_ZERO_RANGE)
+    err = sfs_punch(inode, mode, offset, len);
+  //Zoned devices : blocks are only allocated at writeback
+  else if (SBI_PTR(sb)->s_zone_blocks)
+    err = -EOPNOTSUPP;
+  else
+    {
+      end = (offset + len + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
+      err = sfs_ext_prealloc(inode, offset >> sb->s_blocksize_bits, end);
+    }
+  if (!err && !(mode & FALLOC_FL_KEEP_SIZE) && offset + len > inode->i_size)
+    i_size_write(inode, offset + len);
+
+ out:
+  //Refused or failed requests leave the times alone
+  if (!err)
+    {
+      inode->i_mtime = inode->i_ctime = CURRENT_TIME_SEC;
+      mark_inode_dirty(inode);
+    }
+  mutex_unlock(&inode->i_mutex);
+
+  return err;
+}
+
+/**
+ * sfs_range_cached - Tell if a read can be served from the page cache
+ * @inode File's inode
+ * @pos Start of the read
+ * @len Length of the read
+ *
+ * The extent map must be loaded too : readahead triggered by the read
+ * would read index blocks otherwise.
+ * Returns 1 if all pages are cached and uptodate, 0 otherwise
+ */
+static int
+sfs_range_cached(struct inode *inode, loff_t pos, size_t len)
+{
+  const loff_t	size = i_size_read(inode);
+  struct page	*page;
+  pgoff_t	index;
+  pgoff_t	last;
+  int		uptodate;
+
+  //Data in i_data : never a block to read
+  if (sfs_inline(inode))
+    return 1;
+  if (!sfs_i(inode)->i_ext_loaded)
+    return 0;
+  if (pos >= size || !len)
+    return 1;
+  if (len > size - pos)
+    len = size - pos;
+
+  last = (pos + len - 1) >> PAGE_CACHE_SHIFT;
+  for (index = pos >> PAGE_CACHE_SHIFT; index <= last; index++)
+    {
+      if (!(page = find_get_page(inode->i_mapping, index)))
+	return 0;
+      uptodate = PageUptodate(page);
+      page_cache_release(page);
+      if (!uptodate)
+	return 0;
+    }
+  return 1;
+}
+
+//Readahead started by a non blocking read that missed the cache
+struct	sfs_nbread_work	{
+  struct work_struct	r_work;
+  struct file		*r_file;
+  pgoff_t		r_index;
+  unsigned long		r_count;
+};
+
+/**
+ * sfs_nbread_worker - Load the extent map and read pages ahead
+ * @work sfs_nbread_work->r_work
+ *
+ * Runs in sfs_read_wq : loading the map may wait for index blocks.
+ */
+static void
+sfs_nbread_worker(struct work_struct *work)
+{
+  struct sfs_nbread_work	*rw = container_of(work, struct sfs_nbread_work,
+						   r_work);
+  struct file			*filp = rw->r_file;
+  struct inode			*inode = filp->f_mapping->host;
+  struct sfs_inode_info		*ii = sfs_i(inode);
+
+  printk(KERN_DEBUG "  sfs_nbread_worker %lu+%lu\n", rw->r_index,
+	 rw->r_count);
+
+  down_write(&ii->i_ext_lock);
+  sfs_ext_load(inode);
+  up_write(&ii->i_ext_lock);
+  if (!sfs_inline(inode))
+    page_cache_sync_readahead(filp->f_mapping, &filp->f_ra, filp,
+			      rw->r_index, rw->r_count);
+
+  clear_bit(SFS_I_NBREAD, &ii->i_state);
+  fput(filp);
+  kfree(rw);
+}
+
+/**
+ * sfs_nbread_start - Have the pages of a read brought in the background
+ * @filp opened file
+ * @pos where the read starts
+ * @len bytes read
+ *
+ * One request per inode at a time : a reader retrying in a loop doesn't
+ * queue more. Without memory, the next retry tries again.
+ */
+static void
+sfs_nbread_start(struct file *filp, loff_t pos, size_t len)
+{
+  struct inode			*inode = filp->f_mapping->host;
+  struct sfs_inode_info		*ii = sfs_i(inode);
+  struct sfs_nbread_work	*rw;
+
+  sfs_ext_readahead(inode);
+  if (test_and_set_bit(SFS_I_NBREAD, &ii->i_state))
+    return;
+  if (!(rw = kmalloc(sizeof(*rw), GFP_NOFS)))
+    {
+      clear_bit(SFS_I_NBREAD, &ii->i_state);
+      return;
+    }
+  INIT_WORK(&rw->r_work, sfs_nbread_worker);
+  get_file(filp);
+  rw->r_file = filp;
+  rw->r_index = pos >> PAGE_CACHE_SHIFT;
+  rw->r_count = ((pos + max_t(size_t, len, 1) - 1) >> PAGE_CACHE_SHIFT)
+    - rw->r_index + 1;
+  queue_work(sfs_read_wq, &rw->r_work);
+}
+
+/**
+ * sfs_file_aio_read - Read from a file
+ * @iocb I/O control block
+ * @iov Buffers
+ * @nr_segs Number of buffers
+ * @pos Where to read
+ *
+ * With the "nbread" mount option, buffered reads of files opened with
+ * %O_NONBLOCK never wait for the disk : they are served from the page
+ * cache, or fail with %-EAGAIN so that the caller can retry from a
+ * context allowed to block. The extent map and the pages are read in
+ * the background then, so that a retry finds them.
+ * Without the option, %O_NONBLOCK doesn't change reads of regular files.
+ * Returns bytes read or an error code
+ */
+static ssize_t
+sfs_file_aio_read(struct kiocb *iocb, const struct iovec *iov,
+		  unsigned long nr_segs, loff_t pos)
+{
+  struct file	*filp = iocb->ki_filp;
+  struct inode	*inode = filp->f_mapping->host;
+  const size_t	len = iov_length(iov, nr_segs);
+
+  if ((SBI_PTR(inode->i_sb)->s_mount_opt & SFS_MOUNT_NBREAD)
+      && (filp->f_flags & O_NONBLOCK) && !(filp->f_flags & O_DIRECT)
+      && !sfs_range_cached(inode, pos, len))
+    {
+      sfs_nbread_start(filp, pos, len);
+      return -EAGAIN;
+    }
+  return generic_file_aio_read(iocb, iov, nr_segs, pos);
+}
+
+/**
+ * sfs_page_mkwrite - A shared mapping is about to write into a page
+ * @vma Mapping
+ * @vmf Fault
+ *
+ * Blocks of the page are allocated (or converted from unwritten) now,
+ * with the extent allocator, instead of at writeback, and blocks shared
+ * with other files are copied. No space left gives a SIGBUS to the
+ * writer. Files written by clusters only reserve blocks, allocated at
+ * writeback, and files in i_data get the page back at writeback.
+ * Returns 0 or a VM_FAULT_* code
+ */
+static int
+sfs_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+  struct page	*page = vmf->page;
+  struct inode	*inode = vma->vm_file->f_path.dentry->d_inode;
+  loff_t	size;
+  unsigned	end;
+  int		err;
+
+  printk(KERN_DEBUG "sfs_page_mkwrite\n");
+
+  //Zoned devices : writeback must find a zone (see zone.c)
+  if (sfs_compr_inode(inode) && (err = sfs_zone_wait(inode->i_sb)))
+    return (err == -EINTR) ? VM_FAULT_NOPAGE : VM_FAULT_SIGBUS;
+  lock_page(page);
+  size = i_size_read(inode);
+  //Truncated or invalidated meanwhile
+  if (page->mapping != inode->i_mapping || page_offset(page) >= size)
+    {
+      unlock_page(page);
+      return VM_FAULT_NOPAGE;
+    }
+  if (((loff_t)(page->index + 1) << PAGE_CACHE_SHIFT) > size)
+    end = size & ~PAGE_CACHE_MASK;
+  else
+    end = PAGE_CACHE_SIZE;
+
+  //Clusters get their blocks at writeback (see compress.c), and i_data
+  //gets the page (see inline.c)
+  if (sfs_inline(inode))
+    err = 0;
+  else if (sfs_compr_inode(inode))
+    err = sfs_compr_reserve(page);
+  else if (!(err = block_prepare_write(page, 0, end, sfs_get_block))
+	   && !(err = sfs_cow_page(inode, page, 0, end)))
+    err = block_commit_write(page, 0, end);
+  unlock_page(page);
+
+  if (err == -ENOMEM)
+    return VM_FAULT_OOM;
+  if (err)
+    return VM_FAULT_SIGBUS;
+  return 0;
+}
+
+static struct vm_operations_struct sfs_file_vm_ops =
+  {
+    .fault		= filemap_fault,
+    .page_mkwrite	= sfs_page_mkwrite,
+  };
+
+/**
+ * sfs_file_mmap - Map a file
+ * @file File to map
+ * @vma Mapping
+ *
+ * Returns 0
+ */
+static int
+sfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+  file_accessed(file);
+  vma->vm_ops = &sfs_file_vm_ops;
+  vma->vm_flags |= VM_CAN_NONLINEAR;
+  return 0;
+}
+
+/**
+ * sfs_file_open - Open a file
+ * @inode File's inode
+ * @filp File being opened
+ *
+ * Index blocks of files opened for reading are read ahead, so that
+ * the first reads don't wait for them one after the other.
+ * Returns 0 or an error code
+ */
+static int
+sfs_file_open(struct inode *inode, struct file *filp)
+{
+  if (filp->f_mode & FMODE_READ)
+    sfs_ext_readahead(inode);
+  return generic_file_open(inode, filp);
+}
+
 struct file_operations sfs_file_ops =
   {
+    .open		= sfs_file_open,
     .llseek		= generic_file_llseek,
     .read		= do_sync_read,
-    .aio_read		= generic_file_aio_read,
+    .aio_read		= sfs_file_aio_read,
     .write		= do_sync_write,
     .aio_write		= generic_file_aio_write,
-    .mmap		= generic_file_mmap,
+    .mmap		= sfs_file_mmap,
     .splice_read	= generic_file_splice_read,
+    .splice_write	= generic_file_splice_write,
+    .unlocked_ioctl	= sfs_ioctl,
   };
 
 struct inode_operations sfs_file_iops =
   {
     .truncate		= sfs_truncate,
+    .setattr		= sfs_setattr,
     .getattr		= sfs_getattr,
+    .fallocate		= sfs_fallocate,
+    .fiemap		= sfs_ext_fiemap,
+    .setxattr		= generic_setxattr,
+    .getxattr		= generic_getxattr,
+    .listxattr		= sfs_listxattr,
+    .removexattr	= generic_removexattr,
   };
@@ -0,0 +1,304 @@
+/*
+ * sfs/inline.c for SFS
+ *
+ * Copyright (C) 2009, Jeremy Cochoy
+ */
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include <linux/buffer_head.h>
+#include <linux/writeback.h>
+#include "sfs_fs.h"
+#include "sfs.h"
+
+/*
+** A regular file of at most SFS_INLINE_DATA bytes keeps its data in
+** ii->i_data, in place of the extent map, like a short symlink target.
+** i_data[SFS_DBINDIRECT] holds SFS_INLINE_MARK then, and the map is
+** empty : the data goes to disk with the inode, and reading it costs
+** no block read.
+**
+** An empty file goes inline on its first write, if the write fits.
+** Page 0 is filled from i_data when it is read, and written to i_data
+** at write_end, so the page itself is never dirtied. A write or a
+** truncate past SFS_INLINE_DATA moves the data to page 0, dirty, and
+** drops the mark : writeback gives it a block as for any page.
+**
+** i_data is copied under ii->i_ext_lock, like the extent map, and the
+** inline state only changes with i_mutex held.
+**
+** Directories aren't stored inline : their entries go by blocks
+** (SFS_DIR_CHUNK), much bigger than i_data.
+*/
+
+/**
+ * sfs_inline_fill - Fill a page of an inline file from i_data
+ * @page locked page
+ *
+ * Only page 0 holds data, the rest of the file is zeros.
+ */
+static void
+sfs_inline_fill(struct page *page)
+{
+  struct inode		*inode = page->mapping->host;
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  size_t		len = 0;
+  u8			*data;
+
+  down_read(&ii->i_ext_lock);
+  data = kmap_atomic(page, KM_USER0);
+  if (!page->index)
+    {
+      len = min_t(loff_t, i_size_read(inode), SFS_INLINE_DATA);
+      memcpy(data, ii->i_data, len);
+    }
+  memset(data + len, 0, PAGE_CACHE_SIZE - len);
+  kunmap_atomic(data, KM_USER0);
+  up_read(&ii->i_ext_lock);
+  flush_dcache_page(page);
+  SetPageUptodate(page);
+}
+
+/**
+ * sfs_inline_readpage - Read a page of an inline file
+ * @page locked page
+ *
+ * Returns 0
+ */
+int
+sfs_inline_readpage(struct page *page)
+{
+  printk(KERN_DEBUG "sfs_inline_readpage %lu\n", page->index);
+
+  sfs_inline_fill(page);
+  unlock_page(page);
+  return 0;
+}
+
+/**
+ * sfs_inline_writepage - Copy a dirty page of an inline file to i_data
+ * @page locked page, with its dirty bit cleared
+ * @wbc writeback control
+ *
+ * Only shared mappings dirty these pages. What is past i_size isn't
+ * file data.
+ * Returns 0
+ */
+int
+sfs_inline_writepage(struct page *page, struct writeback_control *wbc)
+{
+  struct inode		*inode = page->mapping->host;
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  size_t		len;
+  u8			*data;
+
+  printk(KERN_DEBUG "sfs_inline_writepage %lu\n", page->index);
+
+  if (!page->index)
+    {
+      len = min_t(loff_t, i_size_read(inode), SFS_INLINE_DATA);
+      down_write(&ii->i_ext_lock);
+      data = kmap_atomic(page, KM_USER0);
+      memcpy(ii->i_data, data, len);
+      kunmap_atomic(data, KM_USER0);
+      up_write(&ii->i_ext_lock);
+      mark_inode_dirty(inode);
+    }
+  unlock_page(page);
+  return 0;
+}
+
+/**
+ * sfs_inline_start - Store the data of an empty file in i_data
+ * @inode inode we are working on
+ *
+ * Files with blocks, even preallocated past i_size, stay as they are.
+ * Returns 1 if @inode is inline now, 0 if not, or an error code
+ */
+static int
+sfs_inline_start(struct inode *inode)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  int			err;
+
+  down_write(&ii->i_ext_lock);
+  if (!(err = sfs_ext_load(inode)) && !ii->i_ext_count
+      && !ii->i_data[SFS_INDIRECT] && !ii->i_data[SFS_DBINDIRECT])
+    {
+      memset(ii->i_data, 0, sizeof(ii->i_data));
+      memset(ii->i_tail, 0, SBI_PTR(inode->i_sb)->s_inode_exts
+	     * sizeof(struct sfs_block_idx));
+      ii->i_data[SFS_DBINDIRECT] = SFS_INLINE_MARK;
+      err = 1;
+    }
+  up_write(&ii->i_ext_lock);
+
+  if (err > 0)
+    {
+      printk(KERN_DEBUG "  sfs_inline_start %lu\n", inode->i_ino);
+      sfs_set_feature(inode->i_sb, SFS_FEAT_INLINE_DATA);
+      mark_inode_dirty(inode);
+    }
+  return err;
+}
+
+/**
+ * sfs_inline_convert - Move the data of an inline file to the page cache
+ * @inode inode we are working on, with i_mutex held
+ *
+ * Page 0 gets the data and is dirtied, i_data gets an empty extent map.
+ * Nothing is done if @inode isn't inline.
+ * Returns 0 or an error code
+ */
+int
+sfs_inline_convert(struct inode *inode)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  struct page		*page;
+
+  if (!S_ISREG(inode->i_mode) || !sfs_inline(inode))
+    return 0;
+
+  printk(KERN_DEBUG "  sfs_inline_convert %lu\n", inode->i_ino);
+
+  if (!(page = find_or_create_page(inode->i_mapping, 0, GFP_NOFS)))
+    return -ENOMEM;
+  wait_on_page_writeback(page);
+  if (!PageUptodate(page))
+    sfs_inline_fill(page);
+
+  down_write(&ii->i_ext_lock);
+  memset(ii->i_data, 0, sizeof(ii->i_data));
+  ii->i_ext_count = 0;
+  ii->i_ext_loaded = 1;
+  up_write(&ii->i_ext_lock);
+
+  if (i_size_read(inode))
+    set_page_dirty(page);
+  mark_inode_dirty(inode);
+  unlock_page(page);
+  page_cache_release(page);
+  return 0;
+}
+
+/**
+ * sfs_inline_prepare - Choose how a write to a regular file is stored
+ * @inode inode we are working on, with i_mutex held
+ * @pos where the write starts
+ * @len bytes written
+ *
+ * The file goes inline, or out of i_data, as the write needs.
+ * Returns 1 if the write goes to i_data, 0 if it goes to blocks, or an
+ * error code
+ */
+int
+sfs_inline_prepare(struct inode *inode, loff_t pos, unsigned len)
+{
+  const int	fits = (pos + len <= SFS_INLINE_DATA);
+
+  if (sfs_inline(inode))
+    return fits ? 1 : sfs_inline_convert(inode);
+  if (fits && !i_size_read(inode))
+    return sfs_inline_start(inode);
+  return 0;
+}
+
+/**
+ * sfs_inline_write_begin - Prepare a write to i_data
+ * @file opened file
+ * @mapping address space of the file
+ * @pos where the write starts
+ * @len bytes written (inside SFS_INLINE_DATA)
+ * @flags AOP_FLAG_*
+ * @pagep where to return the page
+ * @fsdata unused
+ *
+ * Returns 0 or an error code
+ */
+int
+sfs_inline_write_begin(struct file *file, struct address_space *mapping,
+		       loff_t pos, unsigned len, unsigned flags,
+		       struct page **pagep, void **fsdata)
+{
+  struct page	*page;
+
+  printk(KERN_DEBUG "sfs_inline_write_begin\n");
+
+  if (!(page = grab_cache_page_write_begin(mapping, 0, flags)))
+    return -ENOMEM;
+  wait_on_page_writeback(page);
+  if (!PageUptodate(page))
+    sfs_inline_fill(page);
+  *pagep = page;
+  return 0;
+}
+
+/**
+ * sfs_inline_write_end - Copy a write to i_data
+ * @file opened file
+ * @mapping address space of the file
+ * @pos where the write started
+ * @len bytes to write in the page
+ * @copied bytes written
+ * @page locked page
+ * @fsdata unused
+ *
+ * The page is uptodate : a short copy is kept.
+ * Returns the bytes written
+ */
+int
+sfs_inline_write_end(struct file *file, struct address_space *mapping,
+		     loff_t pos, unsigned len, unsigned copied,
+		     struct page *page, void *fsdata)
+{
+  struct inode		*inode = mapping->host;
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  u8			*data;
+
+  printk(KERN_DEBUG "sfs_inline_write_end\n");
+
+  down_write(&ii->i_ext_lock);
+  data = kmap_atomic(page, KM_USER0);
+  memcpy((u8*)ii->i_data + pos, data + pos, copied);
+  kunmap_atomic(data, KM_USER0);
+  up_write(&ii->i_ext_lock);
+
+  if (pos + copied > inode->i_size)
+    i_size_write(inode, pos + copied);
+  mark_inode_dirty(inode);
+  unlock_page(page);
+  page_cache_release(page);
+  return copied;
+}
+
+/**
+ * sfs_inline_truncate - Zero the data of an inline file after i_size
+ * @inode inode we are working on, inline, and not bigger than
+ * SFS_INLINE_DATA
+ *
+ * i_data and the cached page 0 get zeros, so that the file can grow
+ * again.
+ */
+void
+sfs_inline_truncate(struct inode *inode)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  const loff_t		size = i_size_read(inode);
+  struct page		*page;
+
+  printk(KERN_DEBUG "  sfs_inline_truncate %lld\n", (long long)size);
+
+  down_write(&ii->i_ext_lock);
+  memset((u8*)ii->i_data + size, 0, SFS_INLINE_DATA - size);
+  up_write(&ii->i_ext_lock);
+  mark_inode_dirty(inode);
+
+  if ((page = find_lock_page(inode->i_mapping, 0)))
+    {
+      zero_user_segment(page, size, PAGE_CACHE_SIZE);
+      unlock_page(page);
+      page_cache_release(page);
+    }
+}
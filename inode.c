@@ -12,10 +12,39 @@
 #include "sfs_fs.h"
 #include "sfs.h"
 
+/**
+ * sfs_ichunk_block - Look up an inode chunk in the chunk index
+ * @sb SFS super block
+ * @n chunk number
+ *
+ * The top block lists the second level blocks, which list the chunks.
+ * Entries are only set, never cleared : no lock to read them.
+ * Returns the first block of the chunk, 0 if it isn't allocated, or
+ * %-EIO
+ */
+static long
+sfs_ichunk_block(struct super_block *sb, unsigned long n)
+{
+  struct buffer_head	*bh;
+  long			block;
+  SBI(sb);
+
+  block = ((__u32*)sbi->s_ichunk_bh->b_data)[n / SFS_ICHUNK_PER_BLOCK];
+  if (!block)
+    return 0;
+  if (!(bh = sb_bread(sb, block)))
+    return -EIO;
+  block = ((__u32*)bh->b_data)[n % SFS_ICHUNK_PER_BLOCK];
+  brelse(bh);
+  return block;
+}
+
 struct sfs_inode*
 sfs_raw_inode(struct super_block *sb, ino_t ino, struct buffer_head **bh)
 {
   struct sfs_inode	*iraw;
+  unsigned long		block;
+  long			chunk;
   SBI(sb);
 
   printk(KERN_DEBUG " sfs_raw_inode %d\n", (int)ino);
@@ -26,8 +55,19 @@ sfs_raw_inode(struct super_block *sb, ino_t ino, struct buffer_head **bh)
       printk("SFS-fs warning: inode %ld out of range\n", ino);
       return NULL;
     }
-  //Get the block where is located inode
-  *bh = sb_bread(sb, ino / INODE_PER_BLOCK + sbi->s_firstinodeblock);
+  //Get the block where is located inode, in its chunk or in the table
+  if (sbi->s_ichunk_bh)
+    {
+      if ((chunk = sfs_ichunk_block(sb, ino / sbi->s_ichunk_inodes)) <= 0)
+	{
+	  printk("SFS-fs warning: inode %ld has no chunk\n", ino);
+	  return NULL;
+	}
+      block = chunk + (ino % sbi->s_ichunk_inodes) / sbi->s_inode_per_block;
+    }
+  else
+    block = ino / sbi->s_inode_per_block + sbi->s_firstinodeblock;
+  *bh = sb_bread(sb, block);
 
   //Can't read
   if (!*bh)
@@ -36,9 +76,104 @@ sfs_raw_inode(struct super_block *sb, ino_t ino, struct buffer_head **bh)
       return NULL;
     }
 
-  //Return ptr to inode's data
-  iraw = (void*)(*bh)->b_data;
-  return iraw + ino % INODE_PER_BLOCK;
+  //Return ptr to inode's data (inodes are s_inode_size bytes)
+  iraw = (void*)(*bh)->b_data
+    + (ino % sbi->s_inode_per_block) * sbi->s_inode_size;
+  return iraw;
+}
+
+/**
+ * sfs_new_ichunk_block - Take zeroed blocks near the metadata
+ * @sb SFS super block
+ * @count number of contiguous blocks
+ *
+ * Returns the first block or an error code
+ */
+static int
+sfs_new_ichunk_block(struct super_block *sb, unsigned int count)
+{
+  struct buffer_head	*bh;
+  unsigned int		i;
+  int			block;
+
+  if ((block = sfs_get_brun(sb, SBI_PTR(sb)->s_firstdatablock, count)) < 0)
+    return block;
+  //Free inodes and missing chunks are zeros
+  for (i = 0; i < count; i++)
+    {
+      if (!(bh = sb_getblk(sb, block + i)))
+	{
+	  sfs_put_bblocks(sb, block, count);
+	  return -EIO;
+	}
+      lock_buffer(bh);
+      memset(bh->b_data, 0, SFS_BLOCK_SIZE);
+      set_buffer_uptodate(bh);
+      unlock_buffer(bh);
+      mark_buffer_dirty(bh);
+      brelse(bh);
+    }
+  return block;
+}
+
+/**
+ * sfs_ichunk_alloc - Allocate the inode chunk of an inode number
+ * @sb SFS super block
+ * @ino inode number, just taken in the inode bitmap
+ *
+ * With SFS_FEAT_DYN_INODES, inodes live in chunks of SFS_ICHUNK_BLOCKS
+ * blocks, taken from the data blocks the first time one of their inodes
+ * is used. sfs_get_binode gives the lowest free inode, so chunks fill
+ * one after the other. Chunks are never freed : the blocks of inode
+ * numbers still taken would move. The second level index blocks are
+ * taken the same way.
+ * Returns 0 or an error code
+ */
+int
+sfs_ichunk_alloc(struct super_block *sb, ino_t ino)
+{
+  struct buffer_head	*bh = NULL;
+  const unsigned long	n = ino / SBI_PTR(sb)->s_ichunk_inodes;
+  __u32			*top;
+  __u32			*index;
+  int			block;
+  int			err = 0;
+  SBI(sb);
+
+  if (!sbi->s_ichunk_bh)
+    return 0;
+  top = (void*)sbi->s_ichunk_bh->b_data;
+
+  mutex_lock(&sbi->s_ichunk_lock);
+  //Second level block first
+  if (!top[n / SFS_ICHUNK_PER_BLOCK])
+    {
+      if ((err = block = sfs_new_ichunk_block(sb, 1)) < 0)
+	goto out;
+      top[n / SFS_ICHUNK_PER_BLOCK] = block;
+      mark_buffer_dirty(sbi->s_ichunk_bh);
+    }
+  err = -EIO;
+  if (!(bh = sb_bread(sb, top[n / SFS_ICHUNK_PER_BLOCK])))
+    goto out;
+  index = (void*)bh->b_data;
+  err = 0;
+  if (index[n % SFS_ICHUNK_PER_BLOCK])
+    goto out;
+
+  printk(KERN_DEBUG "  sfs_ichunk_alloc %lu\n", n);
+
+  //Contiguous blocks, near the metadata
+  if ((err = block = sfs_new_ichunk_block(sb, SFS_ICHUNK_BLOCKS)) < 0)
+    goto out;
+  index[n % SFS_ICHUNK_PER_BLOCK] = block;
+  mark_buffer_dirty(bh);
+  err = 0;
+
+ out:
+  mutex_unlock(&sbi->s_ichunk_lock);
+  brelse(bh);
+  return err;
 }
 
 /**
@@ -65,10 +200,13 @@ sfs_set_inode_ops(struct inode *inode, dev_t rdev)
       inode->i_mapping->a_ops = &sfs_address_space_ops;
       printk(KERN_DEBUG " - DIR\n");
     }
-  //SymLink
+  //SymLink (target in i_data, or in a block)
   else if (S_ISLNK(inode->i_mode))
     {
-      inode->i_op = &sfs_symlink_iops;
+      if (sfs_inline_symlink(inode))
+	inode->i_op = &sfs_fast_symlink_iops;
+      else
+	inode->i_op = &sfs_symlink_iops;
       inode->i_mapping->a_ops = &sfs_address_space_ops;
     }
   //Special device (ex: mount point)
@@ -88,6 +226,7 @@ sfs_new_inode(struct super_block *sb)
   struct inode		*inode;
   struct sfs_inode_info	*iinode;
   int			ino;
+  int			err;
 
   printk(KERN_DEBUG "sfs_new_inode\n");
 
@@ -95,6 +234,12 @@ sfs_new_inode(struct super_block *sb)
   ino = sfs_get_binode(sb);
   if (IS_ERR(ERR_PTR(ino)))
   return ERR_PTR(ino);
+  //Dynamic inodes : its chunk must be on disk
+  if ((err = sfs_ichunk_alloc(sb, ino)))
+    {
+      sfs_put_binode(sb, ino);
+      return ERR_PTR(err);
+    }
 
   //Alocate it
   inode = new_inode(sb);
@@ -108,6 +253,9 @@ sfs_new_inode(struct super_block *sb)
   inode->i_mtime = inode->i_atime = inode->i_ctime = CURRENT_TIME_SEC;
   iinode = sfs_i(inode);
   memset(iinode->i_data, 0, sizeof(iinode->i_data));
+  memset(iinode->i_tail, 0, sizeof(iinode->i_tail));
+  //Nothing to read on disk
+  iinode->i_ext_loaded = 1;
 
   //Hash and save
   insert_inode_hash(inode);
@@ -117,36 +265,43 @@ sfs_new_inode(struct super_block *sb)
   return inode;
 }
 
+/**
+ * sfs_truncate - Free the blocks after inode->i_size
+ * @inode An inode to truncate
+ */
 void
 sfs_truncate(struct inode *inode)
 {
-  int			i, j;
-  struct sfs_inode_info	*sii = sfs_i(inode);
-
   printk(KERN_DEBUG "  sfs_truncate\n");
 
+  if (!(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode)
+	|| S_ISLNK(inode->i_mode)))
+    return;
+  //No block behind an inline target
+  if (sfs_inline_symlink(inode))
+    return;
+  //Small files keep their data in i_data, bigger ones go to blocks
+  if (sfs_inline(inode))
+    {
+      if (inode->i_size <= SFS_INLINE_DATA)
+	{
+	  sfs_inline_truncate(inode);
+	  return;
+	}
+      if (sfs_inline_convert(inode))
+	return;
+    }
+
+  //The last block is zeroed in place : it can't stay shared
+  sfs_unshare_block(inode, inode->i_size);
   //Truncate page after new inode's size
-  block_truncate_page(inode->i_mapping, inode->i_size, sfs_get_block);
+  if (sfs_compr_inode(inode))
+    sfs_compr_truncate_page(inode, inode->i_size);
+  else
+    block_truncate_page(inode->i_mapping, inode->i_size, sfs_get_block);
 
+  //Release whole extents, and the index blocks left empty
+  sfs_ext_truncate(inode, (inode->i_size + inode->i_sb->s_blocksize - 1)
+		   >> inode->i_sb->s_blocksize_bits);
   inode->i_blocks = sfs_count_blocks(inode);
-  //Can't handle indirect and double indirect
-  if(inode->i_blocks > 7)
-    {
-      //For each direct tuple
-      for (i = inode->i_blocks * 2;
-	   i < 8 * 2;
-	   i += 2)
-	//If there are blocks (block_id and block_count)
-	if (sii->i_data[i] && sii->i_data[i + 1])
-	  {
-	    //Unmap all blocks
-	    for(j = 0;
-		j < sii->i_data[i+1];
-		j++)
-	      sfs_put_bblock(inode->i_sb, sii->i_data[i] + j);
-	    //Remove datas
-	    sii->i_data[i] = 0;
-	    sii->i_data[i+1] = 0;
-	  }
-    }
 }
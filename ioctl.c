@@ -0,0 +1,678 @@
+/*
+ * sfs/ioctl.c for SFS
+ *
+ * Copyright (C) 2009, Jeremy Cochoy
+ */
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/mount.h>
+#include <linux/file.h>
+#include <linux/falloc.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/buffer_head.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include "sfs_fs.h"
+#include "sfs.h"
+
+//Blocks moved (and pages locked) at once by sfs_defrag
+#define	SFS_DEFRAG_CHUNK	256
+
+/**
+ * sfs_defrag_run - Count the written blocks following @lblk
+ * @inode inode we are working on
+ * @lblk first logical block
+ * @max maximum blocks to count
+ *
+ * Returns the number of blocks (0 if @lblk is a hole or unwritten)
+ * or an error code
+ */
+static long
+sfs_defrag_run(struct inode *inode, sector_t lblk, unsigned int max)
+{
+  struct sfs_map	map;
+  unsigned int		count = 0;
+  int			err;
+
+  while (count < max)
+    {
+      map.m_lblk = lblk + count;
+      map.m_len = max - count;
+      if ((err = sfs_map_blocks(inode, &map, 0)))
+	return err;
+      if (!map.m_pblk || (map.m_flags & SFS_MAP_UNWRITTEN))
+	break;
+      count += map.m_len;
+    }
+  return count;
+}
+
+/**
+ * sfs_defrag_chunk - Move the written blocks [@lblk, @lblk + @len)
+ * to the donor run @pblk
+ * @inode inode we are working on
+ * @lblk first logical block
+ * @len number of blocks (at most %SFS_DEFRAG_CHUNK)
+ * @pblk first block of the donor run
+ *
+ * Pages of the range are read and locked, the extents are swapped,
+ * and the pages are written back on the donor run. The old blocks are
+ * only freed once the data and the new map are on disk. A page may
+ * hold several blocks : only the buffers of the range are unmapped, to
+ * be mapped again on the donor run by writeback.
+ * Returns 0 or an error code
+ */
+static int
+sfs_defrag_chunk(struct inode *inode, sector_t lblk, unsigned int len,
+		 u32 pblk)
+{
+  struct address_space	*mapping = inode->i_mapping;
+  const unsigned int	bits = inode->i_blkbits;
+  const unsigned int	shift = PAGE_CACHE_SHIFT - bits;
+  const pgoff_t		first = lblk >> shift;
+  const unsigned int	npages = ((lblk + len - 1) >> shift) - first + 1;
+  struct page		**pages;
+  struct sfs_extent	*old;
+  struct buffer_head	*head;
+  struct buffer_head	*bh;
+  sector_t		blk;
+  unsigned int		locked;
+  unsigned int		i;
+  int			count;
+  int			err = 0;
+
+  printk(KERN_DEBUG "sfs_defrag_chunk %lu+%u\n", (unsigned long)lblk, len);
+
+  if (!(pages = kmalloc(npages * sizeof(*pages), GFP_KERNEL)))
+    return -ENOMEM;
+  if (!(old = kmalloc(len * sizeof(*old), GFP_KERNEL)))
+    {
+      kfree(pages);
+      return -ENOMEM;
+    }
+
+  //Bring the data in the page cache
+  for (locked = 0; locked < npages; locked++)
+    {
+      pages[locked] = read_mapping_page(mapping, first + locked, NULL);
+      if (IS_ERR(pages[locked]))
+	{
+	  err = PTR_ERR(pages[locked]);
+	  goto out_unlock;
+	}
+      lock_page(pages[locked]);
+      wait_on_page_writeback(pages[locked]);
+      if (!PageUptodate(pages[locked]) || pages[locked]->mapping != mapping)
+	{
+	  err = -EIO;
+	  locked++;
+	  goto out_unlock;
+	}
+    }
+  //No write through mmap until the pages are unlocked
+  unmap_mapping_range(mapping, (loff_t)lblk << bits, (loff_t)len << bits, 0);
+
+  //The swap itself
+  if ((count = sfs_ext_move(inode, lblk, len, pblk, old)) < 0)
+    {
+      err = count;
+      goto out_unlock;
+    }
+  for (i = 0; i < npages; i++)
+    {
+      if (page_has_buffers(pages[i]))
+	{
+	  head = bh = page_buffers(pages[i]);
+	  blk = (sector_t)(first + i) << shift;
+	  do
+	    {
+	      if (blk >= lblk && blk < lblk + len)
+		clear_buffer_mapped(bh);
+	      blk++;
+	    }
+	  while ((bh = bh->b_this_page) != head);
+	}
+      set_page_dirty(pages[i]);
+    }
+
+ out_unlock:
+  for (i = 0; i < locked; i++)
+    {
+      unlock_page(pages[i]);
+      page_cache_release(pages[i]);
+    }
+  if (err)
+    goto out;
+
+  //Old blocks are released once the data is on the donor run, and
+  //nothing on disk points to them anymore
+  err = filemap_write_and_wait_range(mapping, (loff_t)lblk << bits,
+				     ((loff_t)(lblk + len) << bits) - 1);
+  if (!err)
+    err = sfs_write_inode(inode, 1);
+  if (!err)
+    for (i = 0; i < count; i++)
+      sfs_put_bblocks(inode->i_sb, old[i].e_pblk, old[i].e_len);
+
+ out:
+  kfree(old);
+  kfree(pages);
+  return err;
+}
+
+/**
+ * sfs_defrag - Move the written blocks of a range to one contiguous run
+ * @inode inode we are working on
+ * @arg range to defragment, d_moved is filled
+ *
+ * The donor run is taken at once from the bitmap. Data moves through
+ * the page cache by chunks, so the file can stay open and used.
+ * Holes and unwritten blocks are left where they are.
+ * Returns 0 or an error code
+ */
+static int
+sfs_defrag(struct inode *inode, struct sfs_defrag *arg)
+{
+  struct super_block	*sb = inode->i_sb;
+  const unsigned int	bits = inode->i_blkbits;
+  struct sfs_map	map;
+  sector_t		lblk;
+  sector_t		end;
+  sector_t		blocks;
+  long			len;
+  u32			donor;
+  u32			pos;
+  int			err;
+
+  printk(KERN_DEBUG "sfs_defrag\n");
+
+  arg->d_moved = 0;
+  if (!S_ISREG(inode->i_mode))
+    return -EINVAL;
+  //Clusters move at each writeback already
+  if (sfs_compr_inode(inode))
+    return -EOPNOTSUPP;
+
+  mutex_lock(&inode->i_mutex);
+  end = (i_size_read(inode) + (1 << bits) - 1) >> bits;
+  if (arg->d_start < end && arg->d_len < end - arg->d_start)
+    end = arg->d_start + arg->d_len;
+  lblk = arg->d_start;
+
+  //Nothing to gain under two extents
+  if ((err = sfs_ext_frag(inode, lblk, end, &blocks)) <= 1)
+    goto out;
+  if (blocks > SFS_EXT_LEN_MASK)
+    {
+      err = -EFBIG;
+      goto out;
+    }
+  //Right after the blocks before the range, so that ranges defragmented
+  //one after the other end up contiguous too
+  map.m_lblk = lblk - 1;
+  map.m_len = 1;
+  if (!lblk || sfs_map_blocks(inode, &map, 0) || !map.m_pblk)
+    map.m_pblk = SBI_PTR(sb)->s_firstdatablock - 1;
+  if ((err = sfs_get_brun(sb, map.m_pblk + 1, blocks)) < 0)
+    goto out;
+  donor = pos = err;
+  err = 0;
+
+  //Dirty pages are mapped before anything moves
+  if ((err = filemap_write_and_wait_range(inode->i_mapping,
+					  (loff_t)lblk << bits,
+					  ((loff_t)end << bits) - 1)))
+    goto out_put;
+
+  while (lblk < end && pos < donor + blocks)
+    {
+      len = sfs_defrag_run(inode, lblk, min_t(sector_t, end - lblk,
+					      SFS_DEFRAG_CHUNK));
+      if (len < 0)
+	{
+	  err = len;
+	  break;
+	}
+      //Skip holes and unwritten blocks
+      if (!len)
+	{
+	  map.m_lblk = lblk;
+	  map.m_len = min_t(sector_t, end - lblk, SFS_EXT_LEN_MASK);
+	  if ((err = sfs_map_blocks(inode, &map, 0)))
+	    break;
+	  lblk += map.m_len;
+	  continue;
+	}
+      len = min_t(long, len, donor + blocks - pos);
+      if ((err = sfs_defrag_chunk(inode, lblk, len, pos)))
+	break;
+      arg->d_moved += len;
+      lblk += len;
+      pos += len;
+    }
+
+ out_put:
+  //Donor blocks left
+  if (pos < donor + blocks)
+    sfs_put_bblocks(sb, pos, donor + blocks - pos);
+ out:
+  mutex_unlock(&inode->i_mutex);
+  return (err < 0) ? err : 0;
+}
+
+/**
+ * sfs_clone - Share blocks of another file (%FICLONE, %FICLONERANGE)
+ * @filp destination file
+ * @arg ranges to share
+ *
+ * Offsets must be block aligned. The length too, unless the range ends
+ * at the source's end and doesn't end before the destination's end.
+ * Pages of the source are written back so that its blocks hold the
+ * data, pages of the destination are dropped.
+ * Returns 0 or an error code
+ */
+static int
+sfs_clone(struct file *filp, struct file_clone_range *arg)
+{
+  struct inode		*dst = filp->f_mapping->host;
+  const unsigned int	bits = dst->i_blkbits;
+  const u64		mask = (1 << bits) - 1;
+  struct file		*sfile;
+  struct inode		*src;
+  loff_t		ssize;
+  u64			len = arg->src_length;
+  int			err;
+
+  printk(KERN_DEBUG "sfs_clone\n");
+
+  if (!(sfile = fget(arg->src_fd)))
+    return -EBADF;
+  src = sfile->f_mapping->host;
+  err = -EXDEV;
+  if (src->i_sb != dst->i_sb)
+    goto out_fput;
+  err = -EOPNOTSUPP;
+  if (!SBI_PTR(dst->i_sb)->s_refc_blocks)
+    goto out_fput;
+  err = -EBADF;
+  if (!(sfile->f_mode & FMODE_READ))
+    goto out_fput;
+  err = -EINVAL;
+  if (!S_ISREG(src->i_mode) || !S_ISREG(dst->i_mode))
+    goto out_fput;
+  //Compressed clusters are never shared
+  err = -EOPNOTSUPP;
+  if (sfs_ext_compressed(src) || sfs_ext_compressed(dst))
+    goto out_fput;
+
+  //Both i_mutex, in address order
+  if (src == dst)
+    mutex_lock(&dst->i_mutex);
+  else if (src < dst)
+    {
+      mutex_lock_nested(&src->i_mutex, I_MUTEX_PARENT);
+      mutex_lock_nested(&dst->i_mutex, I_MUTEX_CHILD);
+    }
+  else
+    {
+      mutex_lock_nested(&dst->i_mutex, I_MUTEX_PARENT);
+      mutex_lock_nested(&src->i_mutex, I_MUTEX_CHILD);
+    }
+
+  //Blocks are shared : none in i_data
+  if ((err = sfs_inline_convert(src)) || (err = sfs_inline_convert(dst)))
+    goto out_unlock;
+
+  ssize = i_size_read(src);
+  err = -EINVAL;
+  if (arg->src_offset > ssize)
+    goto out_unlock;
+  if (!len)
+    len = ssize - arg->src_offset;
+  if (len > ssize - arg->src_offset
+      || ((arg->src_offset | arg->dest_offset) & mask))
+    goto out_unlock;
+  //A partial last block is only shared to become the last one
+  if ((len & mask) && (arg->src_offset + len != ssize
+		       || arg->dest_offset + len < i_size_read(dst)))
+    goto out_unlock;
+  if (src == dst && arg->src_offset < arg->dest_offset + len
+      && arg->dest_offset < arg->src_offset + len)
+    goto out_unlock;
+  err = -EFBIG;
+  if (arg->dest_offset + len > dst->i_sb->s_maxbytes
+      || arg->dest_offset + len < arg->dest_offset)
+    goto out_unlock;
+  err = 0;
+  if (!len)
+    goto out_unlock;
+
+  //Source blocks hold the data, destination pages go away
+  if ((err = filemap_write_and_wait_range(src->i_mapping, arg->src_offset,
+					  arg->src_offset + len - 1)))
+    goto out_unlock;
+  unmap_mapping_range(dst->i_mapping, arg->dest_offset,
+		      (len + mask) & ~mask, 1);
+  sfs_compr_drop_pages(dst->i_mapping, arg->dest_offset,
+		       arg->dest_offset + ((len + mask) & ~mask) - 1);
+
+  err = sfs_ext_clone(src, arg->src_offset >> bits, dst,
+		      arg->dest_offset >> bits, (len + mask) >> bits);
+  if (!err && arg->dest_offset + len > i_size_read(dst))
+    i_size_write(dst, arg->dest_offset + len);
+  dst->i_mtime = dst->i_ctime = CURRENT_TIME_SEC;
+  dst->i_blocks = sfs_count_blocks(dst);
+  mark_inode_dirty(dst);
+
+ out_unlock:
+  mutex_unlock(&dst->i_mutex);
+  if (src != dst)
+    mutex_unlock(&src->i_mutex);
+ out_fput:
+  fput(sfile);
+  return err;
+}
+
+/**
+ * sfs_atomic_info - Atomic write unit limits of @inode
+ * @inode inode we are working on
+ * @info filled with the limits
+ *
+ * Whole pages are written : the page cache is updated in place.
+ */
+static void
+sfs_atomic_info(struct inode *inode, struct sfs_atomic_info *info)
+{
+  info->ai_unit_min = max_t(u32, PAGE_CACHE_SIZE, 1 << inode->i_blkbits);
+  info->ai_unit_max = SFS_ATOMIC_MAX << inode->i_blkbits;
+  //Pages bigger than the largest unit
+  if (info->ai_unit_min > info->ai_unit_max)
+    info->ai_unit_min = info->ai_unit_max = 0;
+}
+
+/**
+ * sfs_atomic_write - Write a range that is never seen half written
+ * @filp opened file
+ * @arg range and data
+ *
+ * The data goes to new blocks first. Once they are on disk, one update
+ * of the extent map swaps them with the old blocks, which are freed
+ * once the inode and its index block are written too : the new mapping
+ * is always on disk on return.
+ * The pages of the range stay locked meanwhile, and get the new data.
+ * Returns 0 or an error code
+ */
+static int
+sfs_atomic_write(struct file *filp, struct sfs_atomic_write *arg)
+{
+  struct address_space	*mapping = filp->f_mapping;
+  struct inode		*inode = mapping->host;
+  struct super_block	*sb = inode->i_sb;
+  const unsigned int	bits = inode->i_blkbits;
+  struct buffer_head	*bhs[SFS_ATOMIC_MAX];
+  struct buffer_head	*head;
+  struct buffer_head	*bh;
+  struct page		*pages[SFS_ATOMIC_MAX];
+  struct sfs_extent	old[SFS_ATOMIC_MAX];
+  struct sfs_atomic_info	info;
+  struct sfs_map	map;
+  unsigned int		nblocks;
+  unsigned int		npages;
+  unsigned int		i;
+  sector_t		lblk;
+  pgoff_t		first;
+  u8			*buf;
+  u8			*data;
+  int			count;
+  int			pblk;
+  int			err;
+
+  printk(KERN_DEBUG "sfs_atomic_write\n");
+
+  sfs_atomic_info(inode, &info);
+  if (!S_ISREG(inode->i_mode) || arg->a_flags & ~SFS_ATOMIC_SYNC
+      || arg->a_len < info.ai_unit_min || arg->a_len > info.ai_unit_max
+      || !is_power_of_2(arg->a_len) || (arg->a_offset & (arg->a_len - 1)))
+    return -EINVAL;
+  if (arg->a_offset + arg->a_len > sb->s_maxbytes)
+    return -EFBIG;
+  //Clusters are rewritten whole at writeback
+  if (sfs_compr_inode(inode))
+    return -EOPNOTSUPP;
+
+  lblk = arg->a_offset >> bits;
+  nblocks = arg->a_len >> bits;
+  npages = arg->a_len >> PAGE_CACHE_SHIFT;
+  first = arg->a_offset >> PAGE_CACHE_SHIFT;
+  if (!(buf = vmalloc(arg->a_len)))
+    return -ENOMEM;
+  //No fault once the pages are locked
+  err = -EFAULT;
+  if (copy_from_user(buf, (void __user*)(unsigned long)arg->a_buf,
+		     arg->a_len))
+    goto out_free;
+
+  mutex_lock(&inode->i_mutex);
+  if ((err = file_remove_suid(filp)))
+    goto out_unlock;
+  //The new blocks replace blocks : none in i_data
+  if ((err = sfs_inline_convert(inode)))
+    goto out_unlock;
+
+  //The pages of the range, none written back meanwhile
+  memset(pages, 0, sizeof(pages));
+  for (i = 0; i < npages; i++)
+    {
+      err = -ENOMEM;
+      if (!(pages[i] = find_or_create_page(mapping, first + i, GFP_NOFS)))
+	goto out_pages;
+      wait_on_page_writeback(pages[i]);
+    }
+  //mmap writers fault again, and wait for the page lock
+  unmap_mapping_range(mapping, arg->a_offset, arg->a_len, 0);
+
+  //New blocks, near the old ones
+  map.m_lblk = lblk;
+  map.m_len = 1;
+  if (sfs_map_blocks(inode, &map, 0) || !map.m_pblk)
+    map.m_pblk = SBI_PTR(sb)->s_firstdatablock;
+  if ((pblk = sfs_get_brun(sb, map.m_pblk, nblocks)) < 0)
+    {
+      err = pblk;
+      goto out_pages;
+    }
+  for (i = 0; i < nblocks; i++)
+    {
+      if (!(bhs[i] = sb_getblk(sb, pblk + i)))
+	{
+	  while (i--)
+	    brelse(bhs[i]);
+	  err = -ENOMEM;
+	  goto out_put;
+	}
+      lock_buffer(bhs[i]);
+      memcpy(bhs[i]->b_data, buf + (i << bits), 1 << bits);
+      set_buffer_uptodate(bhs[i]);
+      unlock_buffer(bhs[i]);
+      mark_buffer_dirty(bhs[i]);
+    }
+  ll_rw_block(SWRITE, nblocks, bhs);
+  err = 0;
+  for (i = 0; i < nblocks; i++)
+    {
+      wait_on_buffer(bhs[i]);
+      if (!buffer_uptodate(bhs[i]))
+	err = -EIO;
+      brelse(bhs[i]);
+    }
+  //The new data is on disk : switch to it
+  if (err || (count = sfs_ext_atomic(inode, lblk, nblocks, pblk, old)) < 0)
+    {
+      err = err ? err : count;
+      goto out_put;
+    }
+  if (arg->a_offset + arg->a_len > i_size_read(inode))
+    i_size_write(inode, arg->a_offset + arg->a_len);
+  inode->i_mtime = inode->i_ctime = CURRENT_TIME_SEC;
+  inode->i_blocks = sfs_count_blocks(inode);
+  //The old blocks can be reused once nothing on disk points to them
+  //(on a write error, they are leaked rather than shared)
+  if (!(err = sfs_write_inode(inode, 1)))
+    for (i = 0; i < count; i++)
+      if (old[i].e_pblk)
+	sfs_put_bblocks(sb, old[i].e_pblk, old[i].e_len);
+
+  //The cache gets the new data, with no buffer left on the old blocks
+  for (i = 0; i < npages; i++)
+    {
+      clear_page_dirty_for_io(pages[i]);
+      if (page_has_buffers(pages[i]))
+	{
+	  head = bh = page_buffers(pages[i]);
+	  do
+	    {
+	      clear_buffer_dirty(bh);
+	      clear_buffer_mapped(bh);
+	    }
+	  while ((bh = bh->b_this_page) != head);
+	  try_to_free_buffers(pages[i]);
+	}
+      data = kmap_atomic(pages[i], KM_USER0);
+      memcpy(data, buf + (i << PAGE_CACHE_SHIFT), PAGE_CACHE_SIZE);
+      kunmap_atomic(data, KM_USER0);
+      flush_dcache_page(pages[i]);
+      SetPageUptodate(pages[i]);
+    }
+  goto out_pages;
+
+ out_put:
+  sfs_put_bblocks(sb, pblk, nblocks);
+ out_pages:
+  for (i = 0; i < npages && pages[i]; i++)
+    {
+      unlock_page(pages[i]);
+      page_cache_release(pages[i]);
+    }
+ out_unlock:
+  mutex_unlock(&inode->i_mutex);
+ out_free:
+  vfree(buf);
+  return err;
+}
+
+/**
+ * sfs_ioctl - SFS specific ioctls
+ * @filp opened file
+ * @cmd %SFS_IOC_DEFRAG, %SFS_IOC_ATOMIC_WRITE, %SFS_IOC_ATOMIC_INFO,
+ *      %SFS_IOC_SEEK, %FICLONE or %FICLONERANGE
+ * @arg user argument
+ *
+ * Returns 0 or an error code
+ */
+long
+sfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+  struct inode		*inode = filp->f_mapping->host;
+  struct sfs_defrag	defrag;
+  struct file_clone_range	clone;
+  struct sfs_atomic_write	atomic;
+  struct sfs_atomic_info	info;
+  struct sfs_seek	seek;
+  struct sfs_falloc	falloc;
+  loff_t		pos;
+  int			err;
+
+  printk(KERN_DEBUG "sfs_ioctl %x\n", cmd);
+
+  switch (cmd)
+    {
+    case SFS_IOC_DEFRAG:
+      if (!(filp->f_mode & FMODE_WRITE))
+	return -EBADF;
+      if (copy_from_user(&defrag, (void __user*)arg, sizeof(defrag)))
+	return -EFAULT;
+      if ((err = mnt_want_write(filp->f_path.mnt)))
+	return err;
+      err = sfs_defrag(inode, &defrag);
+      mnt_drop_write(filp->f_path.mnt);
+      if (copy_to_user((void __user*)arg, &defrag, sizeof(defrag)))
+	return -EFAULT;
+      return err;
+    case SFS_IOC_ATOMIC_WRITE:
+      if (!(filp->f_mode & FMODE_WRITE) || (filp->f_flags & O_APPEND))
+	return -EBADF;
+      if (copy_from_user(&atomic, (void __user*)arg, sizeof(atomic)))
+	return -EFAULT;
+      if ((err = mnt_want_write(filp->f_path.mnt)))
+	return err;
+      err = sfs_atomic_write(filp, &atomic);
+      mnt_drop_write(filp->f_path.mnt);
+      return err;
+    case SFS_IOC_ATOMIC_INFO:
+      sfs_atomic_info(inode, &info);
+      if (copy_to_user((void __user*)arg, &info, sizeof(info)))
+	return -EFAULT;
+      return 0;
+    case SFS_IOC_SEEK:
+      if (copy_from_user(&seek, (void __user*)arg, sizeof(seek)))
+	return -EFAULT;
+      if (!S_ISREG(inode->i_mode) || seek.s_offset > inode->i_sb->s_maxbytes
+	  || (seek.s_whence != SFS_SEEK_DATA
+	      && seek.s_whence != SFS_SEEK_HOLE))
+	return -EINVAL;
+      mutex_lock(&inode->i_mutex);
+      pos = sfs_ext_seek(inode, seek.s_offset,
+			 seek.s_whence == SFS_SEEK_HOLE);
+      mutex_unlock(&inode->i_mutex);
+      if (pos < 0)
+	return pos;
+      seek.s_offset = pos;
+      if (copy_to_user((void __user*)arg, &seek, sizeof(seek)))
+	return -EFAULT;
+      return 0;
+    case SFS_IOC_FALLOCATE:
+      //The checks of fallocate
+      if (!(filp->f_mode & FMODE_WRITE))
+	return -EBADF;
+      if (copy_from_user(&falloc, (void __user*)arg, sizeof(falloc)))
+	return -EFAULT;
+      if ((loff_t)falloc.f_offset < 0 || (loff_t)falloc.f_len <= 0)
+	return -EINVAL;
+      if (falloc.f_offset + falloc.f_len > inode->i_sb->s_maxbytes)
+	return -EFBIG;
+      if (IS_IMMUTABLE(inode)
+	  || (IS_APPEND(inode) && (falloc.f_mode & ~FALLOC_FL_KEEP_SIZE)))
+	return -EPERM;
+      if ((err = mnt_want_write(filp->f_path.mnt)))
+	return err;
+      err = sfs_fallocate(inode, falloc.f_mode, falloc.f_offset,
+			  falloc.f_len);
+      mnt_drop_write(filp->f_path.mnt);
+      return err;
+    case FICLONE:
+    case FICLONERANGE:
+      if (!(filp->f_mode & FMODE_WRITE) || (filp->f_flags & O_APPEND))
+	return -EBADF;
+      if (cmd == FICLONERANGE)
+	{
+	  if (copy_from_user(&clone, (void __user*)arg, sizeof(clone)))
+	    return -EFAULT;
+	}
+      else
+	{
+	  memset(&clone, 0, sizeof(clone));
+	  clone.src_fd = (int)arg;
+	}
+      if ((err = mnt_want_write(filp->f_path.mnt)))
+	return err;
+      err = sfs_clone(filp, &clone);
+      mnt_drop_write(filp->f_path.mnt);
+      return err;
+    default:
+      return -ENOTTY;
+    }
+}
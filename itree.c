@@ -1,5 +1,5 @@
 /*
- * sfs/super.c for SFS
+ * sfs/itree.c for SFS
  *
  * Copyright (C) 2009, Jeremy Cochoy
  */
@@ -8,255 +8,2190 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/vmalloc.h>
+#include <linux/fiemap.h>
+#include <linux/workqueue.h>
 #include "sfs_fs.h"
 #include "sfs.h"
 
+/*
+** The extent map of an inode is a list of sfs_block_idx stored
+**  * in ii->i_data (SFS_DIRECT_EXT entries)
+**  * in ii->i_tail, with big inodes (sbi->s_inode_exts entries)
+**  * in the indirect block (INDIRECT_BY_BLOCK entries)
+**  * in the blocks listed by the double indirect block
+** The list ends with the first entry whose b_count is 0.
+** Entries flagged SFS_EXT_UNWRITTEN are allocated but read as zeros
+** until they are written (SFS_FEAT_UNWRITTEN). Entries whose b_start
+** is 0 are holes (SFS_FEAT_HOLES).
+** Entries flagged SFS_EXT_COMPRESSED are one cluster (see compress.c) :
+** they are never split nor merged, and their blocks on disk are
+** counted apart.
+**
+** The whole list is loaded in ii->i_ext the first time the inode is
+** mapped, with the logical position of each extent, so that a lookup
+** is a binary search. It is written back by sfs_ext_store.
+*/
+
+//Max extents an inode can hold
+#define	SFS_MAX_EXTS(sb)	(SBI_PTR(sb)->s_direct_exts + INDIRECT_BY_BLOCK \
+				 + DBINDIRECT_BY_BLOCK * INDIRECT_BY_BLOCK)
+
+/*
+** **********
+** * MEMORY *
+** **********
+*/
+
 /**
- * See sfs_find_block
- * @data : memory start of the first sfs_block_idx
- * @deph : where to locate (in deph[0]) the last index
- * @iblock : how much we had to walk
- * @blk : block found (or 0)
- * @count : number of sfs_block_idx
+ * sfs_ext_grow - Make room for @count extents in ii->i_ext
+ * @ii inode we are working on
+ * @count extents needed
+ *
+ * Returns 0 or %-ENOMEM
  */
 static int
-sfs_find_direct(struct sfs_block_idx *data, unsigned short *deph,
-		sector_t *iblock, unsigned int *blk, unsigned int count)
+sfs_ext_grow(struct sfs_inode_info *ii, unsigned int count)
 {
-  for (deph[0] = 0; deph[0] < count && data[deph[0]].b_start; deph[0] += 1)
+  struct sfs_extent	*ext;
+  unsigned int		max;
+
+  if (count <= ii->i_ext_max)
+    return 0;
+
+  //Double the table, huge maps go to vmalloc
+  max = ii->i_ext_max ? ii->i_ext_max * 2 : SFS_DIRECT_EXT;
+  while (max < count)
+    max *= 2;
+  if (max * sizeof(*ext) <= PAGE_SIZE)
+    ext = kmalloc(max * sizeof(*ext), GFP_NOFS);
+  else
+    ext = vmalloc(max * sizeof(*ext));
+  if (!ext)
+    return -ENOMEM;
+
+  if (ii->i_ext)
     {
-      //We find a block
-      if (*iblock < data[deph[0]].b_count)
-	{
-	  *blk = *iblock + data[deph[0]].b_start;
-	  return DEPH_DIRECT;
-	}
-      //Next block segment
-      *iblock -= data[deph[0]].b_count;
+      memcpy(ext, ii->i_ext, ii->i_ext_count * sizeof(*ext));
+      sfs_ext_release(ii);
     }
-  return DEPH_NOTFOUND;
+  ii->i_ext = ext;
+  ii->i_ext_max = max;
+  return 0;
+}
+
+/**
+ * sfs_ext_release - Free the in-memory extent map
+ * @ii inode we are working on
+ */
+void
+sfs_ext_release(struct sfs_inode_info *ii)
+{
+  if (is_vmalloc_addr(ii->i_ext))
+    vfree(ii->i_ext);
+  else
+    kfree(ii->i_ext);
+  ii->i_ext = NULL;
+  ii->i_ext_max = 0;
+}
+
+//First logical block after the last extent
+static inline sector_t
+sfs_ext_end(struct sfs_inode_info *ii)
+{
+  struct sfs_extent	*last;
+
+  if (!ii->i_ext_count)
+    return 0;
+  last = &ii->i_ext[ii->i_ext_count - 1];
+  return last->e_lblk + last->e_len;
+}
+
+//Blocks used on disk by an extent
+static inline u32
+sfs_ext_plen(struct sfs_extent *ext)
+{
+  if (ext->e_flags & SFS_EXT_COMPRESSED)
+    return (ext->e_flags & SFS_EXT_PLEN_MASK) >> SFS_EXT_PLEN_SHIFT;
+  return ext->e_len;
 }
 
 /**
- * See sfs_find_block
- * @deph : where to locate (in deph[1]) the last index
- * @iblock : how much we had to walk
- * @blk : block found (or 0)
- * @err : where to store error (might not be %NULL!)
- * @pos : physical indirect block location
- * @sb : filesystem's super_block
+ * sfs_ext_push - Add an extent at the end of the map
+ * @ii inode we are working on
+ * @pblk first physical block
+ * @len number of blocks
+ * @flags extent flags
+ *
+ * Returns 0 or an error code
  */
 static int
-sfs_find_indirect(struct super_block *sb, __u32 pos, unsigned short *deph,
-		  sector_t *iblock, unsigned int *blk, int *err)
+sfs_ext_push(struct sfs_inode_info *ii, u32 pblk, u32 len, u32 flags)
 {
-  struct buffer_head	*bh;
+  struct sfs_extent	*ext;
+  int			err;
+
+  if (ii->i_ext_count >= SFS_MAX_EXTS(ii->vfs_inode.i_sb))
+    return -EFBIG;
+  if ((err = sfs_ext_grow(ii, ii->i_ext_count + 1)))
+    return err;
+
+  ext = &ii->i_ext[ii->i_ext_count];
+  ext->e_lblk = sfs_ext_end(ii);
+  ext->e_pblk = pblk;
+  ext->e_len = len;
+  ext->e_flags = flags;
+  ii->i_ext_count++;
+  if (flags & SFS_EXT_COMPRESSED)
+    ii->i_ext_compr = 1;
+  return 0;
+}
 
-  printk(KERN_DEBUG "  sfs_find_indirect\n");
+/**
+ * sfs_ext_remove - Remove ii->i_ext[@i] from the map
+ * @ii inode we are working on
+ * @i extent index
+ *
+ * Logical positions aren't changed.
+ */
+static void
+sfs_ext_remove(struct sfs_inode_info *ii, unsigned int i)
+{
+  memmove(&ii->i_ext[i], &ii->i_ext[i + 1],
+	  (ii->i_ext_count - i - 1) * sizeof(*ii->i_ext));
+  ii->i_ext_count--;
+}
 
-  //Get block
-  if (!(bh = sb_bread(sb, pos)))
-    return (*err = -EIO);
+//Can @b be appended to @a?
+static inline int
+sfs_ext_mergeable(struct sfs_extent *a, struct sfs_extent *b)
+{
+  if ((a->e_flags | b->e_flags) & SFS_EXT_COMPRESSED)
+    return 0;
+  if (a->e_flags != b->e_flags || a->e_lblk + a->e_len != b->e_lblk
+      || a->e_len + b->e_len > SFS_EXT_LEN_MASK)
+    return 0;
+  //Two holes
+  if (!a->e_pblk || !b->e_pblk)
+    return !a->e_pblk && !b->e_pblk;
+  return a->e_pblk + a->e_len == b->e_pblk;
+}
 
-  //Lock page
-  printk("   locking page %p in find_indirect\n", bh->b_page); //Did it work??
-  lock_page(bh->b_page);
+/**
+ * sfs_ext_search - Find the extent holding @lblk, or the next one
+ * @ii inode we are working on
+ * @lblk logical block
+ *
+ * Returns an index in ii->i_ext (ii->i_ext_count if there is none)
+ */
+static unsigned int
+sfs_ext_search(struct sfs_inode_info *ii, sector_t lblk)
+{
+  unsigned int	lo = 0;
+  unsigned int	hi = ii->i_ext_count;
+  unsigned int	mid;
 
-  if(sfs_find_direct((struct sfs_block_idx*)bh->b_data,
-  		     &deph[1], iblock, blk, INDIRECT_BY_BLOCK) == DEPH_DIRECT)
-    return DEPH_INDIRECT;
+  while (lo < hi)
+    {
+      mid = (lo + hi) / 2;
+      if (ii->i_ext[mid].e_lblk + ii->i_ext[mid].e_len <= lblk)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  return lo;
+}
 
-  //Unlock page
-  unlock_page(bh->b_page);
+/*
+** ********
+** * DISK *
+** ********
+*/
 
-  //Release block
-  mark_buffer_dirty(bh);
-  brelse(bh);
+/**
+ * sfs_ext_load_recs - Append @count on-disk extents to the map
+ *
+ * Returns 1 if all entries were used (the list goes on in the next
+ * level), 0 if the end of the list was found, or an error code.
+ */
+static int
+sfs_ext_load_recs(struct sfs_inode_info *ii, struct sfs_block_idx *rec,
+		  unsigned int count)
+{
+  unsigned int	i;
+  __u32		mask;
+  int		err;
 
-  return DEPH_NOTFOUND;
+  for (i = 0; i < count && rec[i].b_count; i++)
+    {
+      //Flags of a compressed cluster hold its length on disk
+      mask = (rec[i].b_count & SFS_EXT_COMPRESSED)
+	? SFS_EXT_CLEN_MASK : SFS_EXT_LEN_MASK;
+      if ((err = sfs_ext_push(ii, rec[i].b_start, rec[i].b_count & mask,
+			      rec[i].b_count & ~mask)))
+	return err;
+    }
+  return i == count;
 }
 
 /**
- * See sfs_find_block
+ * sfs_ext_load_dbindirect - Append the extents of the blocks listed by
+ * the double indirect block to the map
+ * @inode inode we are working on
+ * @dbh double indirect block
+ *
+ * All the indirect blocks are submitted at once and waited for after :
+ * the whole level costs one round trip to the disk.
+ * Returns 1 if all entries were used, 0 if the end of the list was
+ * found, or an error code.
  */
 static int
-sfs_find_dbindirect(struct super_block *sb, __u32 pos, unsigned short *deph,
-		    sector_t *iblock, unsigned int *blk, int *err)
+sfs_ext_load_dbindirect(struct inode *inode, struct buffer_head *dbh)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  struct super_block	*sb = inode->i_sb;
+  struct buffer_head	**bhs;
+  __u32			*ptr = (__u32*)dbh->b_data;
+  int			count;
+  int			i;
+  int			ret = 1;
+
+  if (!(bhs = kmalloc(DBINDIRECT_BY_BLOCK * sizeof(*bhs), GFP_NOFS)))
+    return -ENOMEM;
+
+  for (count = 0; count < DBINDIRECT_BY_BLOCK && ptr[count]; count++)
+    if (!(bhs[count] = sb_getblk(sb, ptr[count])))
+      {
+	ret = -EIO;
+	break;
+      }
+  //Buffers already read (or being read) are skipped
+  ll_rw_block(READ_META, count, bhs);
+
+  for (i = 0; i < count; i++)
+    {
+      wait_on_buffer(bhs[i]);
+      if (ret > 0 && !buffer_uptodate(bhs[i]))
+	ret = -EIO;
+      if (ret > 0)
+	ret = sfs_ext_load_recs(ii, (struct sfs_block_idx*)bhs[i]->b_data,
+				INDIRECT_BY_BLOCK);
+      brelse(bhs[i]);
+    }
+  kfree(bhs);
+  return ret;
+}
+
+/**
+ * sfs_ext_load - Read the extent map of @inode from disk
+ * @inode inode we are working on
+ *
+ * Must be called with ii->i_ext_lock held for writing.
+ * Returns 0 or an error code
+ */
+int
+sfs_ext_load(struct inode *inode)
 {
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  struct super_block	*sb = inode->i_sb;
   struct buffer_head	*bh;
-  int			ind_pos;
-  int			res;
+  struct buffer_head	*dbh;
+  int			ret;
 
-  printk(KERN_DEBUG "  sfs_find_indirect\n");
+  if (ii->i_ext_loaded)
+    return 0;
 
-  //Get block
-  if (!(bh = sb_bread(sb, pos)))
-    return (*err = -EIO);
+  printk(KERN_DEBUG "  sfs_ext_load %lu\n", inode->i_ino);
 
-  //Lock page
-  printk("   locking page %p in find_indirect\n", bh->b_page); //Did it work??
-  lock_page(bh->b_page);
+  /// DIRECT
+  ii->i_ext_count = 0;
+  //Data in i_data : no extent
+  if (sfs_inline(inode))
+    {
+      ret = 0;
+      goto done;
+    }
+  ret = sfs_ext_load_recs(ii, (struct sfs_block_idx*)ii->i_data,
+			  SFS_DIRECT_EXT);
+  //Big inodes go on after struct sfs_inode
+  if (ret > 0 && SBI_PTR(sb)->s_inode_exts)
+    ret = sfs_ext_load_recs(ii, (struct sfs_block_idx*)ii->i_tail,
+			    SBI_PTR(sb)->s_inode_exts);
+  if (ret <= 0 || !ii->i_data[SFS_INDIRECT])
+    goto done;
 
-  for(deph[1] = 0; deph[1] < DBINDIRECT_BY_BLOCK; deph[1]++)
+  /// INDIRECT
+  //The double indirect block is read along
+  if (ii->i_data[SFS_DBINDIRECT])
+    sb_breadahead(sb, ii->i_data[SFS_DBINDIRECT]);
+  if (!(bh = sb_bread(sb, ii->i_data[SFS_INDIRECT])))
     {
-      ind_pos = ((__u32*)bh->b_data)[deph[1]];
-      res = sfs_find_dbdirect(sb, ind_pos, &deph[1], iblock, blk, err);
-      if (res == DEPH_DIRECT)
-	return DEPH_INDIRECT;
-      if (deph[2] < INDIRECT_BY_BLOCK)
-	return DEPH_NOTFOUND;
+      ret = -EIO;
+      goto done;
     }
+  ret = sfs_ext_load_recs(ii, (struct sfs_block_idx*)bh->b_data,
+			  INDIRECT_BY_BLOCK);
+  brelse(bh);
+  if (ret <= 0 || !ii->i_data[SFS_DBINDIRECT])
+    goto done;
 
-  //Unlock page
-  unlock_page(bh->b_page);
+  /// DBINDIRECT
+  if (!(dbh = sb_bread(sb, ii->i_data[SFS_DBINDIRECT])))
+    {
+      ret = -EIO;
+      goto done;
+    }
+  ret = sfs_ext_load_dbindirect(inode, dbh);
+  brelse(dbh);
 
-  //Release block
-  mark_buffer_dirty(bh);
-  brelse(bh);
+ done:
+  if (ret < 0)
+    {
+      printk("SFS-fs warning: can't read extents of inode %lu\n",
+	     inode->i_ino);
+      ii->i_ext_count = 0;
+      return ret;
+    }
+  ii->i_ext_loaded = 1;
+  return 0;
+}
+
+/**
+ * sfs_ext_readahead - Start reading the index blocks of @inode
+ * @inode inode we are working on
+ *
+ * Nothing is waited for : sfs_ext_load will find the blocks in the
+ * buffer cache. The blocks listed by the double indirect block can
+ * only be read ahead once it is there.
+ */
+void
+sfs_ext_readahead(struct inode *inode)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  struct super_block	*sb = inode->i_sb;
+  struct buffer_head	*dbh;
+  __u32			*ptr;
+  int			i;
 
-  return DEPH_NOTFOUND;
+  if (ii->i_ext_loaded || sfs_inline(inode) || !ii->i_data[SFS_INDIRECT])
+    return;
+
+  printk(KERN_DEBUG "  sfs_ext_readahead %lu\n", inode->i_ino);
+
+  sb_breadahead(sb, ii->i_data[SFS_INDIRECT]);
+  if (!ii->i_data[SFS_DBINDIRECT])
+    return;
+  sb_breadahead(sb, ii->i_data[SFS_DBINDIRECT]);
+
+  dbh = sb_find_get_block(sb, ii->i_data[SFS_DBINDIRECT]);
+  if (!dbh)
+    return;
+  if (buffer_uptodate(dbh))
+    {
+      ptr = (__u32*)dbh->b_data;
+      for (i = 0; i < DBINDIRECT_BY_BLOCK && ptr[i]; i++)
+	sb_breadahead(sb, ptr[i]);
+    }
+  brelse(dbh);
 }
 
 /**
- * Find a block @iblock for an inode @inode, and store foudn position in deph.
+ * sfs_ext_store_recs - Copy extents from @first into an on-disk table
  *
- * Store physical block in blk and return %DEPH_DIRECT, %DEPH_INDIRECT
- * or %DEPH_DBINDIRECT as the last deph searching.
- * if blk couldn't be found, set @blk to 0 and return %DEPH_NOTFOUND
+ * Holes and unwritten extents record their feature the first time one
+ * reaches the disk.
+ * Returns 1 if the table was modified, 0 otherwise
+ */
+static int
+sfs_ext_store_recs(struct sfs_inode_info *ii, unsigned int first,
+		   struct sfs_block_idx *rec, unsigned int count)
+{
+  struct super_block	*sb = ii->vfs_inode.i_sb;
+  struct sfs_block_idx	r;
+  unsigned int		i;
+  int			changed = 0;
+
+  for (i = 0; i < count; i++)
+    {
+      r.b_start = 0;
+      r.b_count = 0;
+      if (first + i < ii->i_ext_count)
+	{
+	  r.b_start = ii->i_ext[first + i].e_pblk;
+	  r.b_count = ii->i_ext[first + i].e_len | ii->i_ext[first + i].e_flags;
+	  if (!r.b_start)
+	    sfs_set_feature(sb, SFS_FEAT_HOLES);
+	  if (r.b_count & SFS_EXT_UNWRITTEN)
+	    sfs_set_feature(sb, SFS_FEAT_UNWRITTEN);
+	}
+      if (rec[i].b_start != r.b_start || rec[i].b_count != r.b_count)
+	{
+	  rec[i] = r;
+	  changed = 1;
+	}
+    }
+  return changed;
+}
+
+/**
+ * sfs_ext_store_bh - Dirty an index block if @changed, and write it
+ * now if @sync
  *
- * deph[0] store the position in ii->i_data tab.
- * deph[1] store :
- *                 * the index of sfs_block_idx from the start of the page
- *                 * if deph[2] is set; it's the location of the __u32
- *                   corresponding to the page where is located the sfs_block_idx
- * deph[2] store the position of sfs_block_idx in case of an dbindirect
+ * Returns 0 or %-EIO
+ */
+static int
+sfs_ext_store_bh(struct buffer_head *bh, int changed, int sync)
+{
+  if (changed)
+    mark_buffer_dirty(bh);
+  if (sync && sync_dirty_buffer(bh))
+    return -EIO;
+  return 0;
+}
+
+/**
+ * sfs_ext_store - Write the extent map of @inode into ii->i_data
+ * and the index blocks
+ * @inode inode we are working on
+ * @sync wait for the index blocks to be on disk
  *
- * @inode the inode we are working on
- * @iblock the block number we search
- * @deph 3tab tab to localise direct/indirect/dbindirect position
- * @blk where to store the block found or 0
- * return the code coresponding to the event appened
+ * Index blocks must have been allocated by sfs_ext_fit_index.
+ * Must be called with ii->i_ext_lock held for writing.
+ * Returns 0 or an error code
  */
-int	sfs_find_block(struct inode *inode, sector_t *iblock,
-		       unsigned short *deph, unsigned int *blk)
+int
+sfs_ext_store(struct inode *inode, int sync)
 {
-  int	err = 0;
-  struct sfs_inode_info *ii = sfs_i(inode);
-  int	ret;
-  //  const struct super_block *sb = inode->i_sb;
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  struct super_block	*sb = inode->i_sb;
+  const unsigned int	direct = SBI_PTR(sb)->s_direct_exts;
+  struct buffer_head	*bh;
+  struct buffer_head	*dbh;
+  __u32			pos;
+  int			changed;
+  int			i;
+  int			err;
+
+  if (!ii->i_ext_loaded)
+    return 0;
+
+  /// DIRECT
+  sfs_ext_store_recs(ii, 0, (struct sfs_block_idx*)ii->i_data, SFS_DIRECT_EXT);
+  sfs_ext_store_recs(ii, SFS_DIRECT_EXT, (struct sfs_block_idx*)ii->i_tail,
+		     direct - SFS_DIRECT_EXT);
+
+  /// INDIRECT
+  if (ii->i_data[SFS_INDIRECT])
+    {
+      if (!(bh = sb_bread(sb, ii->i_data[SFS_INDIRECT])))
+	return -EIO;
+      changed = sfs_ext_store_recs(ii, direct,
+				   (struct sfs_block_idx*)bh->b_data,
+				   INDIRECT_BY_BLOCK);
+      err = sfs_ext_store_bh(bh, changed, sync);
+      brelse(bh);
+      if (err)
+	return err;
+    }
 
+  /// DBINDIRECT
+  if (!ii->i_data[SFS_DBINDIRECT])
+    return 0;
+  if (!(dbh = sb_bread(sb, ii->i_data[SFS_DBINDIRECT])))
+    return -EIO;
+  err = sfs_ext_store_bh(dbh, 0, sync);
+  for (i = 0; !err && i < DBINDIRECT_BY_BLOCK; i++)
+    {
+      if (!(pos = ((__u32*)dbh->b_data)[i]))
+	continue;
+      if (!(bh = sb_bread(sb, pos)))
+	{
+	  err = -EIO;
+	  break;
+	}
+      changed = sfs_ext_store_recs(ii, direct + INDIRECT_BY_BLOCK
+				   + i * INDIRECT_BY_BLOCK,
+				   (struct sfs_block_idx*)bh->b_data,
+				   INDIRECT_BY_BLOCK);
+      err = sfs_ext_store_bh(bh, changed, sync);
+      brelse(bh);
+    }
+  brelse(dbh);
+  return err;
+}
 
-  printk("sfs_find_block\n");
+/**
+ * sfs_new_index_block - Allocate a zeroed index block
+ * @sb SFS super block
+ * @pos where to store the block id
+ *
+ * Returns 0 or an error code
+ */
+static int
+sfs_new_index_block(struct super_block *sb, __u32 *pos)
+{
+  struct buffer_head	*bh;
+  int			blk;
 
-  /// DIRECT BLOCK
-  //We search in the first 4 field of ii->i_data
-  if(sfs_find_direct((struct sfs_block_idx*)ii->i_data,
-		     deph, iblock, blk, 4) == DEPH_DIRECT)
-    return DEPH_DIRECT;
-  deph[0] *= 2;
-  //Don't exist
-  if (deph[0] < 7)
+  if ((blk = sfs_get_bblock(sb)) < 0)
+    return blk;
+  if (!(bh = sb_getblk(sb, blk)))
     {
-      //Store the last direct paire not empty
-      deph[0] = (deph[0] > 0) ? deph[0] - 2 : 0;
-      goto no_blk;
+      sfs_put_bblock(sb, blk);
+      return -EIO;
     }
+  lock_buffer(bh);
+  memset(bh->b_data, 0, sb->s_blocksize);
+  set_buffer_uptodate(bh);
+  unlock_buffer(bh);
+  mark_buffer_dirty(bh);
+  brelse(bh);
+
+  *pos = blk;
+  return 0;
+}
+
+/**
+ * sfs_free_index_block - Release an index block
+ * @sb SFS super block
+ * @pos where the block id is stored (set to 0)
+ */
+static void
+sfs_free_index_block(struct super_block *sb, __u32 *pos)
+{
+  //Don't let a dirty copy overwrite the block once reused
+  bforget(sb_find_get_block(sb, *pos));
+  sfs_put_bblock(sb, *pos);
+  *pos = 0;
+}
+
+/**
+ * sfs_ext_fit_index - Allocate or free index blocks so that they
+ * can hold exactly ii->i_ext_count extents
+ * @inode inode we are working on
+ *
+ * Must be called with ii->i_ext_lock held for writing.
+ * Returns 0 or an error code
+ */
+static int
+sfs_ext_fit_index(struct inode *inode)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  struct super_block	*sb = inode->i_sb;
+  const unsigned int	count = ii->i_ext_count;
+  const unsigned int	direct = SBI_PTR(sb)->s_direct_exts;
+  unsigned int		dbcount = 0;
+  struct buffer_head	*dbh;
+  __u32			*ptr;
+  int			i;
+  int			err = 0;
+
+  //Indirect blocks needed behind the double indirect block
+  if (count > direct + INDIRECT_BY_BLOCK)
+    dbcount = DIV_ROUND_UP(count - direct - INDIRECT_BY_BLOCK,
+			   INDIRECT_BY_BLOCK);
 
   /// INDIRECT
-  if(!ii->i_data)
-    goto no_blk;
-  if (sfs_find_indirect(inode->i_sb, ii->i_data[deph[0]], &deph[1],
-			iblock, blk, &err))
-    return DEPH_INDIRECT;
+  if (count > direct && !ii->i_data[SFS_INDIRECT])
+    err = sfs_new_index_block(sb, &ii->i_data[SFS_INDIRECT]);
+  else if (count <= direct && ii->i_data[SFS_INDIRECT])
+    sfs_free_index_block(sb, &ii->i_data[SFS_INDIRECT]);
   if (err)
     return err;
-  if (deph[1] < INDIRECT_BY_BLOCK)
-    return DEPH_NOTFOUND;
-  deph[0]++;
 
   /// DBINDIRECT
-  if (!ii->i_data[deph[0]])
-    goto no_blk;
-  if ((ret = sfs_find_dbindirect(inode->i_sb, ii->i_data[deph[0]], &deph[1],
-				 iblock, blk, &err)))
-    return DEPH_DBINDIRECT;
-  if (ret == DEPH_NOTFOUND)
-    return DEPH_NOTFOUND;
-  if (err)
+  if (dbcount && !ii->i_data[SFS_DBINDIRECT])
+    if ((err = sfs_new_index_block(sb, &ii->i_data[SFS_DBINDIRECT])))
+      return err;
+  if (!ii->i_data[SFS_DBINDIRECT])
+    return 0;
+
+  if (!(dbh = sb_bread(sb, ii->i_data[SFS_DBINDIRECT])))
+    return -EIO;
+  ptr = (__u32*)dbh->b_data;
+  for (i = 0; i < DBINDIRECT_BY_BLOCK && !err; i++)
+    {
+      if (i < dbcount && !ptr[i])
+	err = sfs_new_index_block(sb, &ptr[i]);
+      else if (i >= dbcount && ptr[i])
+	sfs_free_index_block(sb, &ptr[i]);
+      else
+	continue;
+      mark_buffer_dirty(dbh);
+    }
+  brelse(dbh);
+
+  if (!dbcount && !err)
+    sfs_free_index_block(sb, &ii->i_data[SFS_DBINDIRECT]);
+  return err;
+}
+
+/*
+** ***********
+** * MAPPING *
+** ***********
+*/
+
+/**
+ * sfs_ext_read_lock - Take ii->i_ext_lock for reading, with the map
+ * loaded
+ * @inode inode we are working on
+ *
+ * The map is loaded under the write lock the first time, and the lock
+ * is downgraded after.
+ * Returns 0 (lock held) or an error code (lock not held)
+ */
+static int
+sfs_ext_read_lock(struct inode *inode)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  int			err;
+
+  down_read(&ii->i_ext_lock);
+  if (ii->i_ext_loaded)
+    return 0;
+  up_read(&ii->i_ext_lock);
+
+  down_write(&ii->i_ext_lock);
+  if ((err = sfs_ext_load(inode)))
+    {
+      up_write(&ii->i_ext_lock);
+      return err;
+    }
+  downgrade_write(&ii->i_ext_lock);
+  return 0;
+}
+
+/**
+ * sfs_ext_merge - Merge ii->i_ext[@i] with its neighbours if they are
+ * contiguous on disk and have the same flags
+ * @inode inode we are working on
+ * @i extent index
+ */
+static void
+sfs_ext_merge(struct inode *inode, unsigned int i)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+
+  //With the next one
+  if (i + 1 < ii->i_ext_count
+      && sfs_ext_mergeable(&ii->i_ext[i], &ii->i_ext[i + 1]))
+    {
+      ii->i_ext[i].e_len += ii->i_ext[i + 1].e_len;
+      sfs_ext_remove(ii, i + 1);
+    }
+  //With the previous one
+  if (i > 0 && sfs_ext_mergeable(&ii->i_ext[i - 1], &ii->i_ext[i]))
+    {
+      ii->i_ext[i - 1].e_len += ii->i_ext[i].e_len;
+      sfs_ext_remove(ii, i);
+    }
+  //Can only release index blocks
+  sfs_ext_fit_index(inode);
+}
+
+/**
+ * sfs_ext_split - Split ii->i_ext[@i] so that an extent starts at @lblk
+ * @inode inode we are working on
+ * @i extent index
+ * @lblk logical block, nothing is done if it isn't inside the extent
+ *
+ * Returns 0 or an error code
+ */
+static int
+sfs_ext_split(struct inode *inode, unsigned int i, sector_t lblk)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  struct sfs_extent	*ext;
+  u32			off;
+  int			err;
+
+  //Past the map's end
+  if (i >= ii->i_ext_count)
+    return 0;
+  ext = &ii->i_ext[i];
+  if (lblk <= ext->e_lblk || lblk >= ext->e_lblk + ext->e_len)
+    return 0;
+  //A cluster is compressed as a whole
+  if (ext->e_flags & SFS_EXT_COMPRESSED)
+    return -EOPNOTSUPP;
+  if (ii->i_ext_count >= SFS_MAX_EXTS(inode->i_sb))
+    return -EFBIG;
+  if ((err = sfs_ext_grow(ii, ii->i_ext_count + 1)))
     return err;
 
-  return -ENOSPC;
+  //Duplicate the extent and cut both parts
+  memmove(&ii->i_ext[i + 1], &ii->i_ext[i],
+	  (ii->i_ext_count - i) * sizeof(*ii->i_ext));
+  ii->i_ext_count++;
+  off = lblk - ii->i_ext[i].e_lblk;
+  ii->i_ext[i].e_len = off;
+  ii->i_ext[i + 1].e_lblk = lblk;
+  if (ii->i_ext[i + 1].e_pblk)
+    ii->i_ext[i + 1].e_pblk += off;
+  ii->i_ext[i + 1].e_len -= off;
 
- direct_blk:
-  //Store block id
-  return DEPH_DIRECT;
+  if ((err = sfs_ext_fit_index(inode)))
+    {
+      ii->i_ext[i].e_len += ii->i_ext[i + 1].e_len;
+      sfs_ext_remove(ii, i + 1);
+    }
+  return err;
+}
+
+/**
+ * sfs_ext_goal - Where to allocate blocks for ii->i_ext[@i]
+ * @inode inode we are working on
+ * @i extent index
+ *
+ * Returns the block following the last allocated block before @i
+ */
+static u32
+sfs_ext_goal(struct inode *inode, unsigned int i)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
 
- no_blk:
-  *blk = 0;
-  return DEPH_NOTFOUND;
+  while (i-- > 0)
+    if (ii->i_ext[i].e_pblk)
+      return ii->i_ext[i].e_pblk + ii->i_ext[i].e_len;
+  return SBI_PTR(inode->i_sb)->s_firstdatablock;
 }
 
-int
-sfs_alloc_block(struct inode *inode,  sector_t *iblock,
-		unsigned short *deph, unsigned int *blk)
-{
-  struct sfs_inode_info *ii = sfs_i(inode);
-  int			err = -EIO;
-
-  printk("sfs_alloc_block\n");
-
-  //INDIRECT
-  *blk = 0;
-  printk("deph[0]:%d iblock:%lu\n", deph[0], (long unsigned int)*iblock);
-  //While we had to add a block and it's still a direct
-  for (;deph[0] < 7 && *iblock != (sector_t)-1; *iblock -= 1)
-    {
-      //Get the next free block (If deph[0] is empty, it's not a
-      //      *blk = sfs_get_bblock_after(inode->i_sb, ii->i_data[deph[0]] + *iblock);
-      *blk = sfs_get_bblock(inode->i_sb);
-      printk("new_block_named :%u\n", *blk);
-      //If dont exist, no spc
-      if (*blk < 0)
-      	{
-	  err = -ENOSPC;
-	  goto err;
-      	}
-
-      //blk is the next block after the inode's end : we merge it!
-      if (*blk == ii->i_data[deph[0]] + ii->i_data[deph[0] + 1])
+/**
+ * sfs_ext_compact - Merge all mergeable extents and drop the trailing
+ * hole (the end of the map is already a hole)
+ * @inode inode we are working on
+ */
+static void
+sfs_ext_compact(struct inode *inode)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  struct sfs_extent	*ext = ii->i_ext;
+  unsigned int		i;
+  unsigned int		j;
+
+  for (i = 0, j = 1; j < ii->i_ext_count; j++)
+    {
+      if (sfs_ext_mergeable(&ext[i], &ext[j]))
+	ext[i].e_len += ext[j].e_len;
+      else
+	ext[++i] = ext[j];
+    }
+  if (ii->i_ext_count)
+    ii->i_ext_count = i + 1;
+  while (ii->i_ext_count && !ext[ii->i_ext_count - 1].e_pblk)
+    ii->i_ext_count--;
+  //Can only release index blocks
+  sfs_ext_fit_index(inode);
+}
+
+/**
+ * sfs_ext_fill - Allocate blocks in the hole ii->i_ext[@i]
+ * @inode inode we are working on
+ * @i index of the hole holding map->m_lblk
+ * @map blocks wanted, filled with the blocks allocated
+ * @flags flags of the new extent
+ *
+ * Must be called with ii->i_ext_lock held for writing.
+ * Returns 0 or an error code
+ */
+static int
+sfs_ext_fill(struct inode *inode, unsigned int i, struct sfs_map *map,
+	     u32 flags)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  struct super_block	*sb = inode->i_sb;
+  struct sfs_extent	*ext = &ii->i_ext[i];
+  unsigned int		got;
+  int			blk;
+  int			err;
+
+  printk(KERN_DEBUG "  sfs_ext_fill %lu+%u\n",
+	 (unsigned long)map->m_lblk, map->m_len);
+
+  blk = sfs_get_bblocks(sb, sfs_ext_goal(inode, i),
+			min_t(sector_t, ext->e_lblk + ext->e_len - map->m_lblk,
+			      map->m_len), &got);
+  if (blk < 0)
+    return blk;
+
+  //Cut [m_lblk, m_lblk + got) out of the hole
+  if ((err = sfs_ext_split(inode, i, map->m_lblk)))
+    goto err_put;
+  i = sfs_ext_search(ii, map->m_lblk);
+  if ((err = sfs_ext_split(inode, i, map->m_lblk + got)))
+    goto err_put;
+
+  ii->i_ext[i].e_pblk = blk;
+  ii->i_ext[i].e_flags = flags;
+  map->m_pblk = blk;
+  map->m_len = got;
+  map->m_flags = SFS_MAP_NEW;
+  sfs_ext_merge(inode, i);
+  mark_inode_dirty(inode);
+  return 0;
+
+ err_put:
+  sfs_put_bblocks(sb, blk, got);
+  return err;
+}
+
+/**
+ * sfs_ext_alloc - Allocate blocks at the end of the map
+ * @inode inode we are working on
+ * @end first logical block not to allocate
+ * @flags flags of the new extents
+ * @once stop after the first run of free blocks
+ *
+ * Blocks are taken right after the last extent when possible so that
+ * it just grows.
+ * Must be called with ii->i_ext_lock held for writing.
+ * Returns 0 or an error code
+ */
+static int
+sfs_ext_alloc(struct inode *inode, sector_t end, u32 flags, int once)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  struct super_block	*sb = inode->i_sb;
+  struct sfs_extent	*last;
+  sector_t		cur;
+  unsigned int		got;
+  u32			goal;
+  int			blk;
+  int			err = 0;
+
+  while ((cur = sfs_ext_end(ii)) < end)
+    {
+      last = ii->i_ext_count ? &ii->i_ext[ii->i_ext_count - 1] : NULL;
+      goal = sfs_ext_goal(inode, ii->i_ext_count);
+      blk = sfs_get_bblocks(sb, goal,
+			    min_t(sector_t, end - cur, SFS_EXT_LEN_MASK), &got);
+      if (blk < 0)
+	return blk;
+
+      //The run is right after the file's end : we merge it!
+      if (last && last->e_pblk && last->e_flags == flags && blk == goal
+	  && last->e_len + got <= SFS_EXT_LEN_MASK)
+	last->e_len += got;
+      //Fragmented file! we go to the next entry!
+      else if ((err = sfs_ext_push(ii, blk, got, flags)))
+	goto err_put;
+      else if ((err = sfs_ext_fit_index(inode)))
 	{
-	  printk("              = merge:%d\n", (int)ii->i_data[deph[0]]);
-	  ii->i_data[deph[0] + 1]++;
-	  continue;
+	  ii->i_ext_count--;
+	  goto err_put;
 	}
+      if (once)
+	break;
+    }
+  return 0;
 
-      //No block stored
-      if (ii->i_data[deph[0]] == 0)
-  	goto add_new_direct;
+ err_put:
+  sfs_put_bblocks(sb, blk, got);
+  return err;
+}
 
-      //fragmented file! we go to the next entry!
-      deph[0] += 2;
-      //end of direct table [TODO : goto indirect!]
-      if (deph[0] >= 8)
-  	goto indirect;
+/**
+ * sfs_ext_hole - Extend the map with a hole up to @end
+ * @inode inode we are working on
+ * @end first logical block after the hole
+ *
+ * Gaps longer than one extent take several hole extents.
+ * Must be called with ii->i_ext_lock held for writing.
+ * Returns 0 or an error code
+ */
+static int
+sfs_ext_hole(struct inode *inode, sector_t end)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  const unsigned int	count = ii->i_ext_count;
+  sector_t		last = sfs_ext_end(ii);
+  u32			len;
+  int			err = 0;
 
-      //add new inode
-    add_new_direct:
-      printk("              = add:%d\n", (int)*blk);
-      ii->i_data[deph[0]] = *blk;
-      ii->i_data[deph[0] + 1] = 1;
-      continue;
+  //One extent holds SFS_EXT_LEN_MASK blocks at most
+  while (!err && last < end)
+    {
+      len = min_t(sector_t, end - last, SFS_EXT_LEN_MASK);
+      err = sfs_ext_push(ii, 0, len, 0);
+      last += len;
     }
+  if (!err && ii->i_ext_count != count)
+    err = sfs_ext_fit_index(inode);
+  if (err)
+    ii->i_ext_count = count;
+  return err;
+}
 
-  //Block(s) added!
-  if (*iblock == (sector_t)-1)
-    return 0;
+/**
+ * sfs_ext_append - Allocate blocks from the end of the map up to
+ * map->m_lblk
+ * @inode inode we are working on
+ * @map mapping request, filled with the new blocks
+ *
+ * Blocks between the old end and map->m_lblk are left as a hole, so
+ * that they read as zeros and use no space. Up to map->m_len
+ * contiguous blocks are then allocated for map->m_lblk.
+ * Must be called with ii->i_ext_lock held for writing.
+ * Returns 0 or an error code
+ */
+static int
+sfs_ext_append(struct inode *inode, struct sfs_map *map)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  struct sfs_extent	*ext;
+  int			err;
+
+  printk("sfs_ext_append %lu -> %lu\n", (unsigned long)sfs_ext_end(ii),
+	 (unsigned long)map->m_lblk);
 
- indirect:
-  goto err;
+  if ((err = sfs_ext_hole(inode, map->m_lblk)))
+    goto out;
+  //Only one run, so that all new blocks are returned
+  if ((err = sfs_ext_alloc(inode, map->m_lblk + map->m_len, 0, 1)))
+    goto out;
 
-  //return error code
- err:
-  printk("sfs_alloc_block err:%d\n", err);
+  ext = &ii->i_ext[sfs_ext_search(ii, map->m_lblk)];
+  map->m_pblk = ext->e_pblk + (map->m_lblk - ext->e_lblk);
+  map->m_len = ext->e_lblk + ext->e_len - map->m_lblk;
+  map->m_flags = SFS_MAP_NEW;
+
+ out:
+  mark_inode_dirty(inode);
   return err;
 }
+
+/**
+ * sfs_ext_convert - Mark unwritten blocks as written
+ * @inode inode we are working on
+ * @i index of the extent holding map->m_lblk
+ * @map blocks to convert (inside ii->i_ext[@i])
+ *
+ * The extent is split so that only the blocks being written change.
+ * Must be called with ii->i_ext_lock held for writing.
+ * Returns 0 or an error code
+ */
+static int
+sfs_ext_convert(struct inode *inode, unsigned int i, struct sfs_map *map)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  int			err;
+
+  printk(KERN_DEBUG "  sfs_ext_convert %lu+%u\n",
+	 (unsigned long)map->m_lblk, map->m_len);
+
+  //Isolate [m_lblk, m_lblk + m_len) in its own extent
+  if ((err = sfs_ext_split(inode, i, map->m_lblk)))
+    return err;
+  i = sfs_ext_search(ii, map->m_lblk);
+  if ((err = sfs_ext_split(inode, i, map->m_lblk + map->m_len)))
+    return err;
+
+  ii->i_ext[i].e_flags &= ~SFS_EXT_UNWRITTEN;
+  map->m_flags = SFS_MAP_NEW;
+  sfs_ext_merge(inode, i);
+  mark_inode_dirty(inode);
+  return 0;
+}
+
+/**
+ * __sfs_map_blocks - Map logical blocks of an inode to physical blocks
+ * @inode inode we are working on
+ * @map see sfs_map_blocks
+ * @create allocate (or convert) blocks if map->m_lblk isn't written
+ *
+ * Must be called with ii->i_ext_lock held (for writing if @create) and
+ * the map loaded.
+ * Returns 0 or an error code
+ */
+static int
+__sfs_map_blocks(struct inode *inode, struct sfs_map *map, int create)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  struct sfs_extent	*ext;
+  unsigned int		i;
+  sector_t		off;
+
+  map->m_flags = 0;
+  i = sfs_ext_search(ii, map->m_lblk);
+  ext = (i < ii->i_ext_count) ? &ii->i_ext[i] : NULL;
+
+  //In a hole
+  if (ext && ext->e_lblk <= map->m_lblk && !ext->e_pblk)
+    {
+      if (create)
+	return sfs_ext_fill(inode, i, map, 0);
+      map->m_pblk = 0;
+      map->m_len = min_t(sector_t, ext->e_lblk + ext->e_len - map->m_lblk,
+			 map->m_len);
+      return 0;
+    }
+
+  //In a compressed cluster : the caller decompresses it
+  if (ext && ext->e_lblk <= map->m_lblk
+      && (ext->e_flags & SFS_EXT_COMPRESSED))
+    {
+      map->m_pblk = ext->e_pblk;
+      map->m_len = min_t(sector_t, ext->e_lblk + ext->e_len - map->m_lblk,
+			 map->m_len);
+      map->m_plen = sfs_ext_plen(ext);
+      map->m_flags = SFS_MAP_COMPRESSED;
+      return 0;
+    }
+
+  //Mapped
+  if (ext && ext->e_lblk <= map->m_lblk)
+    {
+      off = map->m_lblk - ext->e_lblk;
+      map->m_pblk = ext->e_pblk + off;
+      map->m_len = min_t(sector_t, ext->e_len - off, map->m_len);
+      if (!(ext->e_flags & SFS_EXT_UNWRITTEN))
+	return 0;
+      //First write on a preallocated block
+      if (create)
+	return sfs_ext_convert(inode, i, map);
+      map->m_flags = SFS_MAP_UNWRITTEN;
+      return 0;
+    }
+
+  //Not mapped, tell how far
+  if (!create)
+    {
+      map->m_pblk = 0;
+      if (ext)
+	map->m_len = min_t(sector_t, ext->e_lblk - map->m_lblk, map->m_len);
+      return 0;
+    }
+
+  return sfs_ext_append(inode, map);
+}
+
+/**
+ * sfs_map_blocks - Map logical blocks of an inode to physical blocks
+ * @inode inode we are working on
+ * @map map->m_lblk and map->m_len (max blocks) are the request.
+ *      On success, map->m_pblk is the first physical block (0 for a
+ *      hole), map->m_len how much blocks are mapped from it and
+ *      map->m_flags tells if blocks were allocated or are unwritten.
+ * @create allocate (or convert) blocks if map->m_lblk isn't written
+ *
+ * This is the only way the data path look at the extent map : a
+ * whole extent is answered at once. Lookups share ii->i_ext_lock, it
+ * is only taken for writing when blocks must be allocated or converted.
+ * Returns 0 or an error code
+ */
+int
+sfs_map_blocks(struct inode *inode, struct sfs_map *map, int create)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  const unsigned int	len = map->m_len;
+  int			err;
+
+  if ((err = sfs_ext_read_lock(inode)))
+    return err;
+  err = __sfs_map_blocks(inode, map, 0);
+  up_read(&ii->i_ext_lock);
+
+  //Written blocks (or compressed), or just looking
+  if (err || !create || (map->m_pblk && !(map->m_flags & SFS_MAP_UNWRITTEN)))
+    return err;
+
+  //The map may have changed since : look again
+  map->m_len = len;
+  down_write(&ii->i_ext_lock);
+  err = __sfs_map_blocks(inode, map, 1);
+  up_write(&ii->i_ext_lock);
+  return err;
+}
+
+/**
+ * __sfs_ext_prealloc - Allocate unwritten blocks in [@start, @end)
+ * @inode inode we are working on
+ * @start first logical block
+ * @end first logical block after the range
+ *
+ * Holes of the range are filled, allocated blocks are kept.
+ * Must be called with ii->i_ext_lock held for writing and the map
+ * loaded.
+ * Returns 0 or an error code
+ */
+static int
+__sfs_ext_prealloc(struct inode *inode, sector_t start, sector_t end)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  struct sfs_extent	*ext;
+  struct sfs_map	map;
+  unsigned int		i;
+  int			err;
+
+  for (map.m_lblk = start; map.m_lblk < end; map.m_lblk += map.m_len)
+    {
+      map.m_len = end - map.m_lblk;
+      i = sfs_ext_search(ii, map.m_lblk);
+      //Past the map's end : keep a hole before the range
+      if (i == ii->i_ext_count)
+	{
+	  if ((err = sfs_ext_hole(inode, map.m_lblk)))
+	    return err;
+	  return sfs_ext_alloc(inode, end, SFS_EXT_UNWRITTEN, 0);
+	}
+      ext = &ii->i_ext[i];
+      if (ext->e_pblk)
+	map.m_len = ext->e_lblk + ext->e_len - map.m_lblk;
+      else if ((err = sfs_ext_fill(inode, i, &map, SFS_EXT_UNWRITTEN)))
+	return err;
+    }
+  return 0;
+}
+
+/**
+ * sfs_ext_prealloc - Allocate unwritten blocks in [@start, @end)
+ * @inode inode we are working on
+ * @start first logical block
+ * @end first logical block after the range
+ *
+ * Blocks are taken in runs as long as the bitmap allows, and read as
+ * zeros until they are written.
+ * Returns 0 or an error code
+ */
+int
+sfs_ext_prealloc(struct inode *inode, sector_t start, sector_t end)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  int			err;
+
+  printk(KERN_DEBUG "  sfs_ext_prealloc %lu-%lu\n",
+	 (unsigned long)start, (unsigned long)end);
+
+  down_write(&ii->i_ext_lock);
+  if (!(err = sfs_ext_load(inode)))
+    err = __sfs_ext_prealloc(inode, start, end);
+  mark_inode_dirty(inode);
+  up_write(&ii->i_ext_lock);
+  return err;
+}
+
+//Blocks freed by a truncate above which the bitmap is updated by
+//sfs_free_wq instead of the caller
+#define	SFS_ASYNC_FREE	32768
+
+//Extents released by a truncate, waiting for sfs_free_worker
+struct	sfs_free_work	{
+  struct work_struct	f_work;
+  struct super_block	*f_sb;
+  unsigned int		f_count;
+  struct sfs_extent	f_ext[0];
+};
+
+/**
+ * sfs_free_worker - Give the blocks of a truncate back to the bitmap
+ * @work sfs_free_work->f_work
+ */
+static void
+sfs_free_worker(struct work_struct *work)
+{
+  struct sfs_free_work	*fw = container_of(work, struct sfs_free_work,
+					   f_work);
+  unsigned int		i;
+
+  printk(KERN_DEBUG "  sfs_free_worker %u\n", fw->f_count);
+
+  for (i = 0; i < fw->f_count; i++)
+    {
+      sfs_put_bblocks(fw->f_sb, fw->f_ext[i].e_pblk, fw->f_ext[i].e_len);
+      cond_resched();
+    }
+  if (is_vmalloc_addr(fw))
+    vfree(fw);
+  else
+    kfree(fw);
+}
+
+/**
+ * sfs_free_alloc - Allocate a sfs_free_work for @count extents
+ * @sb SFS super block
+ * @count extents to free
+ *
+ * Returns the work or NULL
+ */
+static struct sfs_free_work*
+sfs_free_alloc(struct super_block *sb, unsigned int count)
+{
+  struct sfs_free_work	*fw;
+  size_t		size;
+
+  size = sizeof(*fw) + count * sizeof(fw->f_ext[0]);
+  if (size <= PAGE_SIZE)
+    fw = kmalloc(size, GFP_NOFS);
+  else
+    fw = vmalloc(size);
+  if (!fw)
+    return NULL;
+  INIT_WORK(&fw->f_work, sfs_free_worker);
+  fw->f_sb = sb;
+  fw->f_count = 0;
+  return fw;
+}
+
+/**
+ * sfs_ext_truncate - Release all blocks after @nblocks
+ * @inode inode we are working on
+ * @nblocks blocks to keep
+ *
+ * The map is cut at once, whole extents at a time, and index blocks
+ * left empty are freed. When a lot of blocks go away (unlink of a huge
+ * file), clearing their bits is left to sfs_free_wq so that the caller
+ * doesn't wait for it. sfs_put_super waits for pending frees.
+ * Returns 0 or an error code
+ */
+int
+sfs_ext_truncate(struct inode *inode, sector_t nblocks)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  struct super_block	*sb = inode->i_sb;
+  struct sfs_free_work	*fw = NULL;
+  struct sfs_extent	*ext;
+  sector_t		freed = 0;
+  unsigned int		i;
+  u32			keep;
+  int			err;
+
+  printk(KERN_DEBUG "  sfs_ext_truncate %lu\n", (unsigned long)nblocks);
+
+  down_write(&ii->i_ext_lock);
+  if ((err = sfs_ext_load(inode)))
+    goto out;
+
+  //Big enough to go in the background?
+  for (i = ii->i_ext_count; i > 0; i--)
+    {
+      ext = &ii->i_ext[i - 1];
+      if (ext->e_lblk + ext->e_len <= nblocks)
+	break;
+      if (ext->e_pblk)
+	freed += min(sfs_ext_plen(ext),
+		     (u32)(ext->e_lblk + ext->e_len - max(ext->e_lblk, nblocks)));
+    }
+  if (freed >= SFS_ASYNC_FREE)
+    fw = sfs_free_alloc(sb, ii->i_ext_count - i);
+
+  while (ii->i_ext_count)
+    {
+      ext = &ii->i_ext[ii->i_ext_count - 1];
+      if (ext->e_lblk + ext->e_len <= nblocks)
+	break;
+      keep = (ext->e_lblk < nblocks) ? nblocks - ext->e_lblk : 0;
+      //A cluster only goes away whole, the blocks kept read from its start
+      if (ext->e_flags & SFS_EXT_COMPRESSED)
+	{
+	  if (!keep)
+	    sfs_put_bblocks(sb, ext->e_pblk, sfs_ext_plen(ext));
+	}
+      else if (ext->e_pblk && fw)
+	{
+	  fw->f_ext[fw->f_count] = *ext;
+	  fw->f_ext[fw->f_count].e_pblk += keep;
+	  fw->f_ext[fw->f_count++].e_len -= keep;
+	}
+      else if (ext->e_pblk)
+	sfs_put_bblocks(sb, ext->e_pblk + keep, ext->e_len - keep);
+      ext->e_len = keep;
+      if (keep)
+	break;
+      ii->i_ext_count--;
+    }
+
+  //Free index blocks no longer needed
+  err = sfs_ext_fit_index(inode);
+  mark_inode_dirty(inode);
+  if (fw)
+    queue_work(sfs_free_wq, &fw->f_work);
+
+ out:
+  up_write(&ii->i_ext_lock);
+  return err;
+}
+
+/**
+ * __sfs_ext_punch - Turn [@start, @end) into a hole
+ * @inode inode we are working on
+ * @start first logical block
+ * @end first logical block after the range
+ *
+ * Must be called with ii->i_ext_lock held for writing and the map
+ * loaded.
+ * Returns 0 or an error code
+ */
+static int
+__sfs_ext_punch(struct inode *inode, sector_t start, sector_t end)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  struct sfs_extent	*ext;
+  unsigned int		i;
+  int			err = 0;
+
+  end = min(end, sfs_ext_end(ii));
+  if (start >= end)
+    return 0;
+
+  i = sfs_ext_search(ii, start);
+  if ((err = sfs_ext_split(inode, i, start)))
+    return err;
+  for (i = sfs_ext_search(ii, start);
+       i < ii->i_ext_count && ii->i_ext[i].e_lblk < end;
+       i++)
+    {
+      if ((err = sfs_ext_split(inode, i, end)))
+	break;
+      //Give the whole extent back to the bitmap
+      ext = &ii->i_ext[i];
+      if (ext->e_pblk)
+	sfs_put_bblocks(inode->i_sb, ext->e_pblk, sfs_ext_plen(ext));
+      ext->e_pblk = 0;
+      ext->e_flags = 0;
+    }
+
+  //Merge the new holes together
+  sfs_ext_compact(inode);
+  mark_inode_dirty(inode);
+  return err;
+}
+
+/**
+ * sfs_ext_punch - Free the blocks of [@start, @end) and leave a hole
+ * @inode inode we are working on
+ * @start first logical block
+ * @end first logical block after the range
+ *
+ * Returns 0 or an error code
+ */
+int
+sfs_ext_punch(struct inode *inode, sector_t start, sector_t end)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  int			err;
+
+  printk(KERN_DEBUG "  sfs_ext_punch %lu-%lu\n",
+	 (unsigned long)start, (unsigned long)end);
+
+  down_write(&ii->i_ext_lock);
+  if (!(err = sfs_ext_load(inode)))
+    err = __sfs_ext_punch(inode, start, end);
+  up_write(&ii->i_ext_lock);
+  return err;
+}
+
+/**
+ * sfs_ext_zero - Free the blocks of [@start, @end) and allocate
+ * unwritten ones instead
+ * @inode inode we are working on
+ * @start first logical block
+ * @end first logical block after the range
+ *
+ * The range reads as zeros and stays allocated.
+ * Returns 0 or an error code
+ */
+int
+sfs_ext_zero(struct inode *inode, sector_t start, sector_t end)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  int			err;
+
+  printk(KERN_DEBUG "  sfs_ext_zero %lu-%lu\n",
+	 (unsigned long)start, (unsigned long)end);
+
+  down_write(&ii->i_ext_lock);
+  if ((err = sfs_ext_load(inode)))
+    goto out;
+  if ((err = __sfs_ext_punch(inode, start, end)))
+    goto out;
+
+  //Fill the hole left
+  err = __sfs_ext_prealloc(inode, start, end);
+
+ out:
+  mark_inode_dirty(inode);
+  up_write(&ii->i_ext_lock);
+  return err;
+}
+
+/**
+ * sfs_ext_collapse - Remove [@start, @end) from the map
+ * @inode inode we are working on
+ * @start first logical block
+ * @end first logical block after the range
+ *
+ * Blocks of the range are freed, and all the following extents are
+ * moved down by @end - @start blocks.
+ * Returns 0 or an error code
+ */
+int
+sfs_ext_collapse(struct inode *inode, sector_t start, sector_t end)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  struct sfs_extent	*ext;
+  const sector_t	shift = end - start;
+  unsigned int		i;
+  int			err;
+
+  printk(KERN_DEBUG "  sfs_ext_collapse %lu-%lu\n",
+	 (unsigned long)start, (unsigned long)end);
+
+  down_write(&ii->i_ext_lock);
+  if ((err = sfs_ext_load(inode)))
+    goto out;
+  if ((err = __sfs_ext_punch(inode, start, end)))
+    goto out;
+
+  //The range is now inside one hole (or after the map's end)
+  i = sfs_ext_search(ii, start);
+  if (i < ii->i_ext_count)
+    {
+      ext = &ii->i_ext[i];
+      ext->e_len -= min_t(sector_t, shift, ext->e_lblk + ext->e_len - start);
+      if (!ext->e_len)
+	sfs_ext_remove(ii, i);
+      else
+	i++;
+      for (; i < ii->i_ext_count; i++)
+	ii->i_ext[i].e_lblk -= shift;
+    }
+  sfs_ext_compact(inode);
+  mark_inode_dirty(inode);
+
+ out:
+  up_write(&ii->i_ext_lock);
+  return err;
+}
+
+/**
+ * sfs_ext_seek - Find the next hole or data from @offset
+ * @inode inode we are working on
+ * @offset where to start
+ * @hole look for a hole (%SFS_SEEK_HOLE) instead of data (%SFS_SEEK_DATA)
+ *
+ * Unwritten blocks are holes, and so is the end of the file, unless
+ * the page cache holds dirty pages there that have no block yet.
+ * Returns the position found, or %-ENXIO
+ */
+loff_t
+sfs_ext_seek(struct inode *inode, loff_t offset, int hole)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  struct address_space	*mapping = inode->i_mapping;
+  const unsigned int	bits = inode->i_blkbits;
+  const loff_t		size = i_size_read(inode);
+  struct sfs_extent	*ext;
+  unsigned int		i;
+  loff_t		start;
+  loff_t		stop;
+  loff_t		found;
+  loff_t		pos = -1;
+  int			err;
+
+  if (offset < 0 || offset >= size)
+    return -ENXIO;
+  //Data in i_data : no hole before i_size
+  if (sfs_inline(inode))
+    return hole ? size : offset;
+
+  if ((err = sfs_ext_read_lock(inode)))
+    return err;
+
+  for (i = sfs_ext_search(ii, offset >> bits); i < ii->i_ext_count; i++)
+    {
+      ext = &ii->i_ext[i];
+      start = max((loff_t)ext->e_lblk << bits, offset);
+      stop = min((loff_t)(ext->e_lblk + ext->e_len) << bits, size);
+      if (start >= size)
+	break;
+      if (ext->e_pblk && !(ext->e_flags & SFS_EXT_UNWRITTEN))
+	{
+	  if (hole)
+	    continue;
+	  pos = start;
+	  break;
+	}
+      //A hole of the map : data where pages are dirty
+      if ((found = sfs_dirty_seek(mapping, start, stop, !hole)) < stop)
+	{
+	  pos = found;
+	  break;
+	}
+    }
+  //After the map, all is hole but dirty pages
+  if (pos < 0)
+    pos = sfs_dirty_seek(mapping, max((loff_t)sfs_ext_end(ii) << bits,
+				      offset), size, !hole);
+  up_read(&ii->i_ext_lock);
+
+  if (pos >= size)
+    return hole ? size : -ENXIO;
+  return pos;
+}
+
+/**
+ * sfs_ext_frag - Count the written extents of [@start, @end)
+ * @inode inode we are working on
+ * @start first logical block
+ * @end first logical block after the range
+ * @blocks where to store the number of written blocks
+ *
+ * Holes and unwritten extents aren't counted.
+ * Returns the number of written extents or an error code
+ */
+int
+sfs_ext_frag(struct inode *inode, sector_t start, sector_t end,
+	     sector_t *blocks)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  struct sfs_extent	*ext;
+  unsigned int		i;
+  int			count = 0;
+  int			err;
+
+  *blocks = 0;
+  if ((err = sfs_ext_read_lock(inode)))
+    return err;
+
+  for (i = sfs_ext_search(ii, start);
+       i < ii->i_ext_count && ii->i_ext[i].e_lblk < end;
+       i++)
+    {
+      ext = &ii->i_ext[i];
+      if (!ext->e_pblk
+	  || (ext->e_flags & (SFS_EXT_UNWRITTEN | SFS_EXT_COMPRESSED)))
+	continue;
+      *blocks += min_t(sector_t, ext->e_lblk + ext->e_len, end)
+	- max_t(sector_t, ext->e_lblk, start);
+      count++;
+    }
+  up_read(&ii->i_ext_lock);
+  return count;
+}
+
+/**
+ * __sfs_ext_swap - Replace the extents of [@lblk, @lblk + @len) by the
+ * run @pblk
+ * @inode inode we are working on
+ * @lblk first logical block
+ * @len number of blocks
+ * @pblk first block of the run
+ * @flags flags of the run
+ * @old filled with the extents replaced (@len entries at most)
+ *
+ * Both splits are done first : once the map changes, nothing can fail.
+ * Must be called with ii->i_ext_lock held for writing, the map loaded
+ * and covering the range.
+ * Returns the number of extents in @old or an error code
+ */
+static int
+__sfs_ext_swap(struct inode *inode, sector_t lblk, u32 len, u32 pblk,
+	       u32 flags, struct sfs_extent *old)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  const sector_t	end = lblk + len;
+  unsigned int		i;
+  unsigned int		j;
+  int			err;
+
+  //Isolate the range
+  if ((err = sfs_ext_split(inode, sfs_ext_search(ii, lblk), lblk))
+      || (err = sfs_ext_split(inode, sfs_ext_search(ii, end), end)))
+    return err;
+
+  //Swap its extents with the run
+  i = sfs_ext_search(ii, lblk);
+  for (j = i; j < ii->i_ext_count && ii->i_ext[j].e_lblk < end; j++)
+    old[j - i] = ii->i_ext[j];
+  memmove(&ii->i_ext[i + 1], &ii->i_ext[j],
+	  (ii->i_ext_count - j) * sizeof(*ii->i_ext));
+  ii->i_ext_count -= j - i - 1;
+  ii->i_ext[i].e_lblk = lblk;
+  ii->i_ext[i].e_pblk = pblk;
+  ii->i_ext[i].e_len = len;
+  ii->i_ext[i].e_flags = flags;
+  if (flags & SFS_EXT_COMPRESSED)
+    ii->i_ext_compr = 1;
+  sfs_ext_merge(inode, i);
+  mark_inode_dirty(inode);
+  return j - i;
+}
+
+/**
+ * sfs_ext_move - Move the written blocks [@lblk, @lblk + @len) to
+ * the donor run @pblk
+ * @inode inode we are working on
+ * @lblk first logical block
+ * @len number of blocks
+ * @pblk first block of the donor run
+ * @old filled with the extents replaced (@len entries at most)
+ *
+ * All the extents of the range are replaced by the donor run at once,
+ * under ii->i_ext_lock. The blocks listed in @old aren't freed : the
+ * caller does it once the data is on the donor run.
+ * Returns the number of extents in @old or an error code
+ */
+int
+sfs_ext_move(struct inode *inode, sector_t lblk, u32 len, u32 pblk,
+	     struct sfs_extent *old)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  struct sfs_extent	*ext;
+  const sector_t	end = lblk + len;
+  sector_t		cur;
+  unsigned int		i;
+  int			err;
+
+  printk(KERN_DEBUG "  sfs_ext_move %lu+%u -> %u\n",
+	 (unsigned long)lblk, len, pblk);
+
+  down_write(&ii->i_ext_lock);
+  if ((err = sfs_ext_load(inode)))
+    goto out;
+
+  //Only written blocks can move
+  for (i = sfs_ext_search(ii, lblk), cur = lblk; cur < end; i++)
+    {
+      ext = &ii->i_ext[i];
+      if (i >= ii->i_ext_count || ext->e_lblk > cur || !ext->e_pblk
+	  || (ext->e_flags & (SFS_EXT_UNWRITTEN | SFS_EXT_COMPRESSED)))
+	{
+	  err = -EINVAL;
+	  goto out;
+	}
+      cur = ext->e_lblk + ext->e_len;
+    }
+  err = __sfs_ext_swap(inode, lblk, len, pblk, 0, old);
+
+ out:
+  up_write(&ii->i_ext_lock);
+  return err;
+}
+
+/**
+ * __sfs_ext_insert - Map the hole [@ext->e_lblk, + @ext->e_len) on
+ * @ext->e_pblk
+ * @inode inode we are working on
+ * @ext extent to insert, with its flags
+ *
+ * The range must be a hole or past the map's end.
+ * Must be called with ii->i_ext_lock held for writing and the map
+ * loaded.
+ * Returns 0 or an error code
+ */
+static int
+__sfs_ext_insert(struct inode *inode, struct sfs_extent *ext)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  const sector_t	end = ext->e_lblk + ext->e_len;
+  unsigned int		i;
+  int			err;
+
+  //Past the map's end : one hole up to the range's end
+  if (sfs_ext_end(ii) < end)
+    {
+      if ((err = sfs_ext_hole(inode, end)))
+	return err;
+      sfs_ext_merge(inode, ii->i_ext_count - 1);
+    }
+
+  i = sfs_ext_search(ii, ext->e_lblk);
+  if ((err = sfs_ext_split(inode, i, ext->e_lblk)))
+    return err;
+  i = sfs_ext_search(ii, ext->e_lblk);
+  if ((err = sfs_ext_split(inode, i, end)))
+    return err;
+  ii->i_ext[i].e_pblk = ext->e_pblk;
+  ii->i_ext[i].e_flags = ext->e_flags;
+  if (ext->e_flags & SFS_EXT_COMPRESSED)
+    ii->i_ext_compr = 1;
+  sfs_ext_merge(inode, i);
+  return 0;
+}
+
+/**
+ * sfs_ext_clone - Share the blocks of [@sstart, @sstart + @len) of @src
+ * with [@dstart, @dstart + @len) of @dst
+ * @src source inode
+ * @sstart first logical block of the source
+ * @dst destination inode (may be @src, the ranges don't overlap)
+ * @dstart first logical block of the destination
+ * @len number of blocks
+ *
+ * The blocks of the destination range are freed first. Written
+ * blocks of the source get one more reference, holes and unwritten
+ * blocks are left as holes.
+ * Callers hold both i_mutex, with the source range written back.
+ * Returns 0 or an error code
+ */
+int
+sfs_ext_clone(struct inode *src, sector_t sstart, struct inode *dst,
+	      sector_t dstart, sector_t len)
+{
+  struct sfs_inode_info	*si = sfs_i(src);
+  struct sfs_inode_info	*di = sfs_i(dst);
+  struct super_block	*sb = src->i_sb;
+  const sector_t	send = sstart + len;
+  struct sfs_extent	*piece;
+  struct sfs_extent	*ext;
+  unsigned int		count = 0;
+  unsigned int		done = 0;
+  unsigned int		i;
+  sector_t		start;
+  int			err;
+
+  printk(KERN_DEBUG "  sfs_ext_clone %lu:%lu -> %lu:%lu +%lu\n",
+	 src->i_ino, (unsigned long)sstart, dst->i_ino,
+	 (unsigned long)dstart, (unsigned long)len);
+
+  //Copy the written pieces of the source
+  if ((err = sfs_ext_read_lock(src)))
+    return err;
+  for (i = sfs_ext_search(si, sstart);
+       i < si->i_ext_count && si->i_ext[i].e_lblk < send;
+       i++)
+    count++;
+  if (count * sizeof(*piece) <= PAGE_SIZE)
+    piece = kmalloc(max(count, 1U) * sizeof(*piece), GFP_NOFS);
+  else
+    piece = vmalloc(count * sizeof(*piece));
+  if (!piece)
+    {
+      up_read(&si->i_ext_lock);
+      return -ENOMEM;
+    }
+  count = 0;
+  for (i = sfs_ext_search(si, sstart);
+       i < si->i_ext_count && si->i_ext[i].e_lblk < send;
+       i++)
+    {
+      ext = &si->i_ext[i];
+      if (!ext->e_pblk || (ext->e_flags & SFS_EXT_UNWRITTEN))
+	continue;
+      //Clusters aren't shared
+      if (ext->e_flags & SFS_EXT_COMPRESSED)
+	{
+	  up_read(&si->i_ext_lock);
+	  err = -EOPNOTSUPP;
+	  goto out_free;
+	}
+      start = max_t(sector_t, ext->e_lblk, sstart);
+      piece[count].e_lblk = dstart + (start - sstart);
+      piece[count].e_pblk = ext->e_pblk + (start - ext->e_lblk);
+      piece[count].e_len = min_t(sector_t, ext->e_lblk + ext->e_len, send)
+	- start;
+      piece[count++].e_flags = 0;
+    }
+  up_read(&si->i_ext_lock);
+
+  //Share them
+  for (i = 0; i < count; i++)
+    if ((err = sfs_refc_get(sb, piece[i].e_pblk, piece[i].e_len)))
+      {
+	count = i;
+	goto out_put;
+      }
+
+  down_write(&di->i_ext_lock);
+  if (!(err = sfs_ext_load(dst))
+      && !(err = __sfs_ext_punch(dst, dstart, dstart + len)))
+    for (; done < count; done++)
+      if ((err = __sfs_ext_insert(dst, &piece[done])))
+	break;
+  mark_inode_dirty(dst);
+  up_write(&di->i_ext_lock);
+
+ out_put:
+  //References of the pieces not inserted
+  for (i = done; i < count; i++)
+    sfs_put_bblocks(sb, piece[i].e_pblk, piece[i].e_len);
+ out_free:
+  if (is_vmalloc_addr(piece))
+    vfree(piece);
+  else
+    kfree(piece);
+  return err;
+}
+
+/**
+ * sfs_ext_cow - Give @lblk a block of its own if it is shared
+ * @inode inode we are working on
+ * @lblk logical block about to be written
+ *
+ * A new block is mapped at @lblk and the shared one loses a
+ * reference. The caller copies the data.
+ * Returns the new block, 0 if @lblk isn't shared, or an error code
+ */
+int
+sfs_ext_cow(struct inode *inode, sector_t lblk)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  struct super_block	*sb = inode->i_sb;
+  struct sfs_extent	*ext;
+  struct sfs_map	map;
+  unsigned int		got;
+  unsigned int		i;
+  u32			old;
+  int			blk = 0;
+  int			err;
+
+  if (!SBI_PTR(sb)->s_refc_blocks)
+    return 0;
+
+  //Most blocks aren't shared
+  map.m_lblk = lblk;
+  map.m_len = 1;
+  if ((err = sfs_map_blocks(inode, &map, 0)))
+    return err;
+  if (!map.m_pblk || (map.m_flags & SFS_MAP_COMPRESSED))
+    return 0;
+  //Unreadable counts fail the write : it could land on a shared block
+  if ((err = sfs_refc_test(sb, map.m_pblk, 1)) <= 0)
+    return err;
+
+  printk(KERN_DEBUG "  sfs_ext_cow %lu\n", (unsigned long)lblk);
+
+  down_write(&ii->i_ext_lock);
+  //Look again, under the write lock
+  i = sfs_ext_search(ii, lblk);
+  ext = &ii->i_ext[i];
+  if (i >= ii->i_ext_count || ext->e_lblk > lblk || !ext->e_pblk
+      || (ext->e_flags & SFS_EXT_COMPRESSED))
+    goto out;
+  old = ext->e_pblk + (lblk - ext->e_lblk);
+  if ((blk = sfs_refc_test(sb, old, 1)) <= 0)
+    goto out;
+
+  if ((blk = sfs_get_bblocks(sb, sfs_ext_goal(inode, i), 1, &got)) < 0)
+    goto out;
+  //Isolate the block
+  if ((err = sfs_ext_split(inode, i, lblk))
+      || (err = sfs_ext_split(inode, sfs_ext_search(ii, lblk), lblk + 1)))
+    {
+      sfs_put_bblocks(sb, blk, 1);
+      blk = err;
+      goto out;
+    }
+  i = sfs_ext_search(ii, lblk);
+  ii->i_ext[i].e_pblk = blk;
+  sfs_ext_merge(inode, i);
+  mark_inode_dirty(inode);
+  //Only drops a reference
+  sfs_put_bblocks(sb, old, 1);
+
+ out:
+  up_write(&ii->i_ext_lock);
+  return blk;
+}
+
+/**
+ * sfs_ext_shared - Tell if blocks of [@start, @end) are shared
+ * @inode inode we are working on
+ * @start first logical block
+ * @end first logical block after the range
+ *
+ * Returns 1 if one of them is shared, 0 if not, or an error code
+ */
+int
+sfs_ext_shared(struct inode *inode, sector_t start, sector_t end)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  struct super_block	*sb = inode->i_sb;
+  struct sfs_extent	*ext;
+  unsigned int		i;
+  sector_t		first;
+  int			ret = 0;
+
+  if (!SBI_PTR(sb)->s_refc_blocks)
+    return 0;
+  if ((ret = sfs_ext_read_lock(inode)))
+    return ret;
+  for (i = sfs_ext_search(ii, start);
+       !ret && i < ii->i_ext_count && ii->i_ext[i].e_lblk < end;
+       i++)
+    {
+      ext = &ii->i_ext[i];
+      if (!ext->e_pblk || (ext->e_flags & SFS_EXT_COMPRESSED))
+	continue;
+      first = max_t(sector_t, ext->e_lblk, start);
+      ret = sfs_refc_test(sb, ext->e_pblk + (first - ext->e_lblk),
+			  min_t(sector_t, ext->e_lblk + ext->e_len, end)
+			  - first);
+    }
+  up_read(&ii->i_ext_lock);
+  return ret;
+}
+
+/**
+ * sfs_ext_cluster - Replace the cluster starting at @first by new blocks
+ * @inode inode we are working on
+ * @first first logical block of the cluster
+ * @pblk first block of the new run
+ * @len logical blocks of the cluster
+ * @flags 0, or %SFS_EXT_COMPRESSED with the blocks of the run
+ * @old filled with the blocks replaced (%SFS_CLUSTER_BLOCKS entries at
+ *      most), e_len holding their number on disk
+ *
+ * The rest of the cluster becomes a hole. All splits are done first :
+ * once the map changes, nothing can fail. The blocks listed in @old
+ * aren't freed : the caller does it once the inode is written.
+ * Returns the number of extents in @old or an error code (the run isn't
+ * freed)
+ */
+int
+sfs_ext_cluster(struct inode *inode, sector_t first, u32 pblk, u32 len,
+		u32 flags, struct sfs_extent *old)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  struct sfs_extent	*ext;
+  sector_t		end;
+  unsigned int		i;
+  unsigned int		j;
+  int			count = 0;
+  int			err;
+
+  printk(KERN_DEBUG "  sfs_ext_cluster %lu -> %u (%x)\n",
+	 (unsigned long)first, pblk, flags);
+
+  down_write(&ii->i_ext_lock);
+  if ((err = sfs_ext_load(inode)))
+    goto out;
+  //Past the end : a hole first
+  if (sfs_ext_end(ii) < first + len
+      && (err = sfs_ext_hole(inode, first + len)))
+    goto out;
+  //Compressed clusters only start on a cluster and end before i_size :
+  //none of these splits cuts one
+  end = min_t(sector_t, first + SFS_CLUSTER_BLOCKS, sfs_ext_end(ii));
+  if ((err = sfs_ext_split(inode, sfs_ext_search(ii, first), first))
+      || (err = sfs_ext_split(inode, sfs_ext_search(ii, first + len),
+			      first + len))
+      || (err = sfs_ext_split(inode, sfs_ext_search(ii, end), end)))
+    goto out;
+
+  //Blocks past the new cluster go
+  for (i = sfs_ext_search(ii, first + len);
+       i < ii->i_ext_count && ii->i_ext[i].e_lblk < end;
+       i++)
+    {
+      ext = &ii->i_ext[i];
+      if (ext->e_pblk)
+	old[count++] = *ext;
+      ext->e_pblk = 0;
+      ext->e_flags = 0;
+    }
+  //Cannot fail, the range is split already
+  count += __sfs_ext_swap(inode, first, len, pblk, flags, old + count);
+  sfs_ext_compact(inode);
+
+  //Only blocks are handed back, with their number on disk
+  for (i = j = 0; i < count; i++)
+    if (old[i].e_pblk)
+      {
+	old[j] = old[i];
+	old[j].e_len = sfs_ext_plen(&old[i]);
+	old[j++].e_flags = 0;
+      }
+  count = j;
+
+ out:
+  mark_inode_dirty(inode);
+  up_write(&ii->i_ext_lock);
+  return err ? err : count;
+}
+
+//On-disk table holding extent slot @n : 0 for the inode, then the
+//indirect block and the blocks behind the double indirect one
+static inline unsigned int
+sfs_ext_table(struct super_block *sb, unsigned int n)
+{
+  const unsigned int	direct = SBI_PTR(sb)->s_direct_exts;
+
+  if (n < direct)
+    return 0;
+  return 1 + (n - direct) / INDIRECT_BY_BLOCK;
+}
+
+/**
+ * sfs_ext_atomic - Map [@lblk, @lblk + @len) on the run @pblk, holding
+ * new data, in one map update
+ * @inode inode we are working on
+ * @lblk first logical block
+ * @len number of blocks (%SFS_ATOMIC_MAX at most)
+ * @pblk first block of the run, already written
+ * @old filled with the extents replaced (@len entries at most)
+ *
+ * Readers see either the old extents or the new run. The slots that may
+ * change, from the range to the end of the map once split, must lie in
+ * one on-disk block : the inode, or an index block when i_size doesn't
+ * move. Otherwise a crash could leave half of the update on disk.
+ * The blocks listed in @old aren't freed : the caller does it once the
+ * inode is written.
+ * Returns the number of extents in @old or an error code
+ * (%-EOPNOTSUPP if the update spans several blocks)
+ */
+int
+sfs_ext_atomic(struct inode *inode, sector_t lblk, u32 len, u32 pblk,
+	       struct sfs_extent *old)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  struct super_block	*sb = inode->i_sb;
+  unsigned int		first;
+  unsigned int		table;
+  unsigned int		n;
+  int			count;
+
+  printk(KERN_DEBUG "  sfs_ext_atomic %lu+%u -> %u\n",
+	 (unsigned long)lblk, len, pblk);
+
+  if (!len || len > SFS_ATOMIC_MAX)
+    return -EINVAL;
+
+  down_write(&ii->i_ext_lock);
+  if ((count = sfs_ext_load(inode)))
+    goto out;
+  n = ii->i_ext_count;
+  //Past the end : a hole first
+  if (sfs_ext_end(ii) < lblk + len
+      && (count = sfs_ext_hole(inode, lblk + len)))
+    goto out;
+  //The run may merge with the previous extent, both splits add a slot
+  first = sfs_ext_search(ii, lblk);
+  table = sfs_ext_table(sb, first ? first - 1 : 0);
+  count = -EOPNOTSUPP;
+  if (table != sfs_ext_table(sb, ii->i_ext_count + 1)
+      || (table && ((loff_t)(lblk + len) << inode->i_blkbits)
+	  > i_size_read(inode)))
+    {
+      printk(KERN_WARNING "SFS: atomic write of inode %lu spans several"
+	     " blocks of its map\n", inode->i_ino);
+      //Drop the hole added above
+      if (ii->i_ext_count != n)
+	{
+	  ii->i_ext_count = n;
+	  sfs_ext_fit_index(inode);
+	}
+      goto out;
+    }
+  count = __sfs_ext_swap(inode, lblk, len, pblk, 0, old);
+
+ out:
+  up_write(&ii->i_ext_lock);
+  return count;
+}
+
+/**
+ * sfs_ext_compressed - Tell if the map of @inode holds compressed clusters
+ * @inode inode we are working on
+ *
+ * The answer sticks once the inode held one.
+ * Returns 1 if it does, 0 otherwise
+ */
+int
+sfs_ext_compressed(struct inode *inode)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  int			ret;
+
+  if (ii->i_ext_compr)
+    return 1;
+  if (sfs_ext_read_lock(inode))
+    return 0;
+  ret = ii->i_ext_compr;
+  up_read(&ii->i_ext_lock);
+  return ret;
+}
+
+//Extents copied at once by sfs_ext_fiemap
+#define	SFS_FIEMAP_BATCH	32
+
+/**
+ * sfs_ext_fiemap - Report the extents of [@start, @start + @len)
+ * @inode inode we are working on
+ * @fieinfo where to report them
+ * @start first byte
+ * @len number of bytes
+ *
+ * Extents are copied by batches and reported without ii->i_ext_lock
+ * held : filling the user buffer may fault on a page of this file.
+ * Returns 0 or an error code
+ */
+int
+sfs_ext_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+	       u64 start, u64 len)
+{
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  const unsigned int	bits = inode->i_blkbits;
+  struct sfs_extent	batch[SFS_FIEMAP_BATCH];
+  sector_t		lblk = start >> bits;
+  sector_t		last;
+  unsigned int		count;
+  unsigned int		i;
+  int			is_last = 0;
+  u32			flags;
+  int			err;
+
+  if ((err = fiemap_check_flags(fieinfo, FIEMAP_FLAG_SYNC)))
+    return err;
+  //Delayed blocks (compressed and zoned files) get mapped first
+  if ((fieinfo->fi_flags & FIEMAP_FLAG_SYNC)
+      && (err = filemap_write_and_wait(inode->i_mapping)))
+    return err;
+  //Data in i_data : one extent, with no block
+  if (sfs_inline(inode))
+    {
+      if (!i_size_read(inode))
+	return 0;
+      err = fiemap_fill_next_extent(fieinfo, 0, 0, i_size_read(inode),
+				    FIEMAP_EXTENT_DATA_INLINE
+				    | FIEMAP_EXTENT_NOT_ALIGNED
+				    | FIEMAP_EXTENT_LAST);
+      return (err < 0) ? err : 0;
+    }
+
+  //The VFS already bounded start + len to s_maxbytes
+  last = (start + len + (1 << bits) - 1) >> bits;
+
+  while (!is_last && lblk < last)
+    {
+      //Copy the next data extents
+      if ((err = sfs_ext_read_lock(inode)))
+	return err;
+      count = 0;
+      for (i = sfs_ext_search(ii, lblk);
+	   i < ii->i_ext_count && ii->i_ext[i].e_lblk < last;
+	   i++)
+	if (ii->i_ext[i].e_pblk)
+	  {
+	    //Holes after a full batch are skipped : the batch holds the
+	    //last extent if only holes follow
+	    if (count == SFS_FIEMAP_BATCH)
+	      break;
+	    batch[count++] = ii->i_ext[i];
+	  }
+      is_last = (i >= ii->i_ext_count);
+      if (i < ii->i_ext_count)
+	lblk = ii->i_ext[i].e_lblk;
+      up_read(&ii->i_ext_lock);
+
+      for (i = 0; i < count; i++)
+	{
+	  flags = 0;
+	  if (batch[i].e_flags & SFS_EXT_UNWRITTEN)
+	    flags |= FIEMAP_EXTENT_UNWRITTEN;
+	  if (batch[i].e_flags & SFS_EXT_COMPRESSED)
+	    flags |= FIEMAP_EXTENT_ENCODED;
+	  if (is_last && i + 1 == count)
+	    flags |= FIEMAP_EXTENT_LAST;
+	  err = fiemap_fill_next_extent(fieinfo,
+					(u64)batch[i].e_lblk << bits,
+					(u64)batch[i].e_pblk << bits,
+					(u64)batch[i].e_len << bits, flags);
+	  //Buffer full
+	  if (err)
+	    return (err < 0) ? err : 0;
+	}
+    }
+  return 0;
+}
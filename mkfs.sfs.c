@@ -48,6 +48,25 @@ char	device_isblk = 0;
 int	device_fd = -1;
 //file name len limit
 __u32	max_namelen = 0;
+//features enabled (SFS_FEAT_*)
+__u32	features = 0;
+//blocks used by the reference count table
+__u32	count_refc = 0;
+//blocks of a zone (0 : not zoned)
+__u32	zone_blocks = 0;
+//conventional zones (0 : metadata zones + 1)
+__u32	count_conv = 0;
+//first block of the sequential zones
+__u32	zone_start = 0;
+//bytes of an inode
+__u32	inode_size = SFS_INODE_SIZE;
+//extents stored after struct sfs_inode in an inode
+__u32	inode_exts = 0;
+//top block of the inode chunk index (0 : fixed inode table)
+__u32	ichunk_index = 0;
+//first block of the zone write pointer table, and its blocks
+__u32	zone_table = 0;
+__u32	count_ztab = 0;
 
 ///////
 //TOOLS
@@ -55,7 +74,8 @@ __u32	max_namelen = 0;
 //Usage message
 void	usage(void)
 {
-  printf("%s [-nXX] [-iXX] /dev/name [blocks]\n", mkfs_name);
+  printf("%s [-nXX] [-iXX] [-ISIZE] [-d] [-r] [-zBLOCKS [-cZONES]] /dev/name"
+	 " [blocks]\n", mkfs_name);
   exit(EXIT_USAGE);
 }
 
@@ -170,28 +190,92 @@ void	check_blocks(void)
   printf("SFS will use %d blocks (4096bytes each)\n", count_blocks);
 }
 
+////
+//Check the inode size : a quarter of the space after struct sfs_inode
+//holds extents, the rest struct sfs_inode_extra and extended attributes.
+//128 bytes inodes keep all of it for attributes, which is still short
+//for most security labels : they want 256 bytes inodes, or go to a
+//block of their own.
+////
+void	check_inode_size(void)
+{
+  __u32	xattr;
+
+  if (inode_size < SFS_INODE_SIZE || inode_size > SFS_INODE_SIZE_MAX
+      || (inode_size & (inode_size - 1)))
+    die("Invalid inode size");
+  if (inode_size == SFS_INODE_SIZE)
+    return;
+  if (inode_size >= SFS_INODE_SIZE_MAX)
+    inode_exts = (inode_size - SFS_INODE_SIZE) / 4
+      / sizeof(struct sfs_block_idx);
+  xattr = inode_size - SFS_INODE_SIZE - sizeof(struct sfs_inode_extra)
+    - inode_exts * sizeof(struct sfs_block_idx);
+  features |= SFS_FEAT_INODE_SIZE;
+  printf("%d bytes inodes, %d extents each before index blocks,"
+	 " %d bytes of extended attributes\n",
+	 inode_size, SFS_DIRECT_EXT + inode_exts, xattr);
+  if (inode_size < SFS_INODE_SIZE_MAX)
+    warn("Security labels need 256 bytes inodes to fit in the inode");
+}
+
 void	check_inodes_and_maps(void)
 {
+  __u32	max;
+
+  //Zoned device : whole zones only
+  if (zone_blocks)
+    {
+      count_blocks -= count_blocks % zone_blocks;
+      if (!count_blocks)
+	die("Device smaller than a zone");
+    }
+
+  //Dynamic inodes : allocated by the driver, up to what the chunk
+  //index and the device can hold. The inode map is sized for them and
+  //stays in memory : by default, as many as a 1% table would hold.
+  //Only the chunk of the root inode is written here.
+  if (features & SFS_FEAT_DYN_INODES)
+    {
+      max = count_blocks / SFS_ICHUNK_BLOCKS;
+      if (max > SFS_ICHUNK_MAX)
+	max = SFS_ICHUNK_MAX;
+      max *= SFS_ICHUNK_BLOCKS * INODE_PER_BLOCK(inode_size);
+      if (!count_inodes)
+	count_inodes = (count_blocks / 100 + 1) * INODE_PER_BLOCK(inode_size);
+      if (count_inodes > max)
+	count_inodes = max;
+      count_iblocks = 0;
+    }
   //Use 1% in inodes
-  if(!count_inodes)
+  else if(!count_inodes)
     {
       count_iblocks = (count_blocks / 100);
       if (!count_iblocks)
 	count_iblocks++;
-      count_inodes = INODE_PER_BLOCK * count_iblocks;
+      count_inodes = INODE_PER_BLOCK(inode_size) * count_iblocks;
     }
   //Count how blocks needed
   else
     {
-      count_iblocks = count_inodes / INODE_PER_BLOCK;
-      if (count_inodes % INODE_PER_BLOCK)
+      count_iblocks = count_inodes / INODE_PER_BLOCK(inode_size);
+      if (count_inodes % INODE_PER_BLOCK(inode_size))
 	count_iblocks++;
     }
 
   //Count blocks used by inode map
-  count_imap = count_iblocks / BIT_PER_BLOCK;
-  if (count_iblocks % BIT_PER_BLOCK)
-    count_imap++;
+  if (features & SFS_FEAT_DYN_INODES)
+    {
+      count_imap = count_inodes / BIT_PER_BLOCK;
+      if (count_inodes % BIT_PER_BLOCK)
+	count_imap++;
+    }
+  else
+    {
+      count_imap = count_iblocks / BIT_PER_BLOCK;
+      if (count_iblocks % BIT_PER_BLOCK)
+	count_imap++;
+    }
 
   //Count blocks used by block map
   count_bmap = count_blocks / BIT_PER_BLOCK;
@@ -202,12 +286,59 @@ void	check_inodes_and_maps(void)
   printf("%d blocks used by inode map\n", count_imap);
   printf("%d blocks used by block map\n", count_bmap);
 
-  firstdatablock = 1 + count_imap + count_bmap + count_iblocks; //+1 -> SuperBlock
+  //One byte per block to count files sharing it
+  if (features & SFS_FEAT_REFLINK)
+    {
+      count_refc = count_blocks / REFC_PER_BLOCK;
+      if (count_blocks % REFC_PER_BLOCK)
+	count_refc++;
+      printf("%d blocks used by reference counts\n", count_refc);
+    }
+
+  firstdatablock = 1 + count_imap + count_bmap + count_iblocks + count_refc; //+1 -> SuperBlock
+  //Chunk index (both levels) and first chunk after the reference counts
+  if (features & SFS_FEAT_DYN_INODES)
+    {
+      ichunk_index = firstdatablock;
+      firstdatablock += 2 + SFS_ICHUNK_BLOCKS;
+      printf("%d blocks used by the first inode chunk and its index\n",
+	     2 + SFS_ICHUNK_BLOCKS);
+    }
+  //Write pointer table, an entry for each zone the device can hold
+  if (zone_blocks)
+    {
+      count_ztab = count_blocks / zone_blocks;
+      count_ztab = (count_ztab + SFS_ZONE_WP_PER_BLOCK - 1)
+	/ SFS_ZONE_WP_PER_BLOCK;
+      zone_table = firstdatablock;
+      firstdatablock += count_ztab;
+      printf("%d blocks used by zone write pointers\n", count_ztab);
+    }
   if (firstdatablock >= count_blocks)
     die("Not enought block to store the whole filesystem!");
   printf("%d blocks reserved by filesystem\n", firstdatablock);
 }
 
+////
+//Place the sequential zones after the metadata
+////
+void	check_zones(void)
+{
+  if (!zone_blocks)
+    return;
+  //Metadata, then room for directories and index blocks
+  if (!count_conv)
+    count_conv = (firstdatablock + zone_blocks - 1) / zone_blocks + 1;
+  zone_start = count_conv * zone_blocks;
+  if (zone_start <= firstdatablock)
+    die("Conventional zones can't hold the metadata");
+  if (zone_start >= count_blocks)
+    die("No sequential zone left for data");
+  features |= SFS_FEAT_ZONED;
+  printf("%d conventional zones, %d sequential zones of %d blocks\n",
+	 count_conv, (count_blocks - zone_start) / zone_blocks, zone_blocks);
+}
+
 void	write_sb(void)
 {
   __u8	block[SFS_BLOCK_SIZE];
@@ -224,6 +355,14 @@ void	write_sb(void)
   sb->s_state = SFS_VALID_FS;
   sb->s_namelen = max_namelen;
   sb->s_magic = SFS_MAGIC;
+  sb->s_features = features;
+  sb->s_refc_blocks = count_refc;
+  sb->s_zone_blocks = zone_blocks;
+  sb->s_zone_start = zone_start;
+  sb->s_inode_size = inode_size;
+  sb->s_inode_exts = inode_exts;
+  sb->s_ichunk_index = ichunk_index;
+  sb->s_zone_table = zone_table;
 
   //Write on disk
   printf("Writing superblock...\r");
@@ -268,18 +407,13 @@ void	write_bmap(void)
   free(bmap);
 }
 
-void		write_ino_table(void)
+//Fill the root inode (/) of an inode table or chunk
+void		fill_iroot(__u8 *itab)
 {
-  __u8			*itab;
   struct sfs_inode	*iroot;
 
-  itab = calloc(count_iblocks, SFS_BLOCK_SIZE);
-  printf("Writing inode table...\r");
-
-  //Store the root inode (/)
-  iroot = (void*)itab;
   //Inode 0 and 1 reserved
-  iroot += 2;
+  iroot = (void*)(itab + SFS_ROOT_INO * inode_size);
   //Set mode
   iroot->i_mode = IROOT_DEF_MODE;
   iroot->i_uid = 0;
@@ -290,10 +424,81 @@ void		write_ino_table(void)
   iroot->i_ctime = iroot->i_atime;
   iroot->i_nlink = 2;
   bzero(iroot->i_data, sizeof(iroot->i_data));
+}
+
+void		write_ino_table(void)
+{
+  __u8			*itab;
+
+  if (!count_iblocks)
+    return;
+  itab = calloc(count_iblocks, SFS_BLOCK_SIZE);
+  printf("Writing inode table...\r");
+  fill_iroot(itab);
 
   //Writing on disk
   if (write(device_fd, itab, count_iblocks << SFS_BLOCK_LOG_SIZE) == -1)
     die ("Can't write inode table");
+  free(itab);
+}
+
+void	write_refc(void)
+{
+  __u8	*refc;
+
+  if (!count_refc)
+    return;
+  //No block is shared
+  refc = calloc(count_refc, SFS_BLOCK_SIZE);
+  printf("Writing reference counts...\r");
+
+  //Write on disk
+  if (write(device_fd, refc, count_refc << SFS_BLOCK_LOG_SIZE) == -1)
+    die ("Can't write reference counts");
+
+  free(refc);
+}
+
+//Chunk index (top block, then the first second level block), then the
+//chunk holding the root inode
+void	write_ichunks(void)
+{
+  __u8	*chunk;
+  __u32	*index;
+
+  if (!ichunk_index)
+    return;
+  chunk = calloc(2 + SFS_ICHUNK_BLOCKS, SFS_BLOCK_SIZE);
+  printf("Writing inode chunk...\r");
+  index = (void*)chunk;
+  index[0] = ichunk_index + 1;
+  index = (void*)(chunk + SFS_BLOCK_SIZE);
+  index[0] = ichunk_index + 2;
+  fill_iroot(chunk + 2 * SFS_BLOCK_SIZE);
+
+  //Write on disk
+  if (write(device_fd, chunk, (2 + SFS_ICHUNK_BLOCKS) << SFS_BLOCK_LOG_SIZE)
+      == -1)
+    die ("Can't write inode chunk");
+
+  free(chunk);
+}
+
+//All zones empty
+void	write_zone_table(void)
+{
+  __u8	*ztab;
+
+  if (!count_ztab)
+    return;
+  ztab = calloc(count_ztab, SFS_BLOCK_SIZE);
+  printf("Writing zone table...\r");
+
+  //Write on disk
+  if (write(device_fd, ztab, count_ztab << SFS_BLOCK_LOG_SIZE) == -1)
+    die ("Can't write zone table");
+
+  free(ztab);
 }
 
 //MKFS.SFS ENTRY POINT
@@ -307,7 +512,7 @@ int	main(int ac, char *av[])
 
   //Check opts
   opterr = 0;
-  while((c = getopt(ac, av, "i:n:")) != -1)
+  while((c = getopt(ac, av, "c:di:I:n:rz:")) != -1)
     {
       switch(c)
 	{
@@ -316,11 +521,32 @@ int	main(int ac, char *av[])
 	  if (*err)
 	    die("Invalid inode number");
 	  break;
+	case 'I':
+	  inode_size = strtoul(optarg, &err, 0);
+	  if (*err)
+	    die("Invalid inode size");
+	  break;
 	case 'n':
 	  max_namelen = strtoul(optarg, &err, 0);
 	  if (*err)
 	    die("Invalid file name limit");
 	  break;
+	case 'r':
+	  features |= SFS_FEAT_REFLINK;
+	  break;
+	case 'd':
+	  features |= SFS_FEAT_DYN_INODES;
+	  break;
+	case 'z':
+	  zone_blocks = strtoul(optarg, &err, 0);
+	  if (*err || !zone_blocks)
+	    die("Invalid zone size");
+	  break;
+	case 'c':
+	  count_conv = strtoul(optarg, &err, 0);
+	  if (*err || !count_conv)
+	    die("Invalid conventional zone number");
+	  break;
 	default :
 	  usage();
 	}
@@ -349,11 +575,16 @@ int	main(int ac, char *av[])
   //Write FS:
   check_device();
   check_blocks();
+  check_inode_size();
   check_inodes_and_maps();
+  check_zones();
   write_sb();
   write_imap();
   write_bmap();
   write_ino_table();
+  write_refc();
+  write_ichunks();
+  write_zone_table();
 
   return EXIT_DONE;
 }
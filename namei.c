@@ -5,6 +5,7 @@
  */
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
+#include <linux/xattr.h>
 #include "sfs_fs.h"
 #include "sfs.h"
 
@@ -31,6 +32,9 @@ sfs_dentry_by_name(struct inode *dir, struct qstr *child, struct page **res_page
   struct sfs_dirent*	dent;
   //Page address
   char			*kaddr;
+  //Block offset and limit in the page
+  unsigned int		off;
+  unsigned int		limit;
 
   printk(KERN_DEBUG " sfs_lookup\n");
 
@@ -49,15 +53,15 @@ sfs_dentry_by_name(struct inode *dir, struct qstr *child, struct page **res_page
       //Lock the page
       lock_page(*res_page);
 
-      //End is ino = 0 (An entry can't be broken into 2 pages!)
+      //On each block, end is ino = 0 (An entry can't be broken into 2 blocks!)
       kaddr = (void*)page_address(*res_page);
-      dent = (void*)kaddr;
-      while (dent->d_ino)
-	{
+      limit = sfs_page_bytes(dir, pidx);
+      for (off = 0; off < limit; off += SFS_DIR_CHUNK)
+	for (dent = (void*)(kaddr + off);
+	     dent->d_ino;
+	     dent = sfs_next_dentry(dent, strlen(dent->d_name)))
 	  if (!(strcmp(dent->d_name, child->name)))
 	    goto entry_found;
-	  dent = sfs_next_dentry(dent, strlen(dent->d_name));
-	}
       unlock_page(*res_page);
       sfs_put_page(*res_page);
     }
@@ -128,6 +132,8 @@ int sfs_mknod
       //Set up data and ops
       inode->i_mode = mode;
       sfs_set_inode_ops(inode, rdev);
+      if ((err = sfs_init_security(inode, dir)))
+	goto err;
       //Store into directory
       err = sfs_add_link(dentry, inode);
       if(err)
@@ -281,14 +287,28 @@ sfs_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
 
   //Set up data and ops
   inode->i_mode = S_IFLNK | 0777;
-  sfs_set_inode_ops(inode, 0);
-  //Store symlink
-  err = page_symlink(inode, symname, len);
-  if (err)
+  //Short target : in i_data, the extent map stays empty
+  if (len <= SFS_INLINE_LINK)
     {
-      printk(" page_symlink_err !!!\n");
-    goto out_fail;
+      memcpy(sfs_i(inode)->i_data, symname, len);
+      sfs_i(inode)->i_data[SFS_DBINDIRECT] = SFS_INLINE_MARK;
+      inode->i_size = len - 1;
+      sfs_set_feature(dir->i_sb, SFS_FEAT_FAST_SYMLINK);
+      sfs_set_inode_ops(inode, 0);
     }
+  else
+    {
+      sfs_set_inode_ops(inode, 0);
+      //Store symlink
+      err = page_symlink(inode, symname, len);
+      if (err)
+	{
+	  printk(" page_symlink_err !!!\n");
+	  goto out_fail;
+	}
+    }
+  if ((err = sfs_init_security(inode, dir)))
+    goto out_fail;
 
   err = sfs_add_link(dentry, inode);
   if(err)
@@ -321,4 +341,8 @@ struct inode_operations sfs_dir_iops =
     .link	= sfs_link,
     .unlink	= sfs_unlink,
     .symlink	= sfs_symlink,
+    .setxattr	= generic_setxattr,
+    .getxattr	= generic_getxattr,
+    .listxattr	= sfs_listxattr,
+    .removexattr	= generic_removexattr,
   };
@@ -6,14 +6,29 @@
 #ifndef SFS_H_
 # define SFS_H_
 
+# include <linux/workqueue.h>
+
 # define	SBI(sb)		struct sfs_sb_info *sbi = (sb)->s_fs_info
 # define	STORE_SBI(sb, sbi)	(sb)->s_fs_info = (void*)(sbi)
 # define	SBI_PTR(sb)	((struct sfs_sb_info*)((sb)->s_fs_info))
 
-# define	DEPH_NOTFOUND	0
-# define	DEPH_DIRECT	1
-# define	DEPH_UNDIRECT	2
-# define	DEPH_DBUNDIRECT	3
+//Empty zones only the zone cleaner may open (see zone.c)
+# define	SFS_ZONE_RESERVE	1
+
+//Directory entries never cross a block, a directory grows by blocks
+# define	SFS_DIR_CHUNK		SFS_BLOCK_SIZE
+
+//sfs_map->m_flags :
+# define	SFS_MAP_NEW		1 //Block just allocated
+# define	SFS_MAP_UNWRITTEN	2 //Block allocated, reads as zeros
+# define	SFS_MAP_COMPRESSED	4 //Block inside a compressed cluster
+
+//sfs_sb_info->s_mount_opt :
+# define	SFS_MOUNT_COMPRESS	1 //Compress clusters at writeback
+# define	SFS_MOUNT_NBREAD	2 //O_NONBLOCK reads don't wait for the disk
+
+//sfs_inode_info->i_state bits :
+# define	SFS_I_NBREAD		0 //Background read of sfs_nbread_start
 
 struct	sfs_sb_info	{
   //SFS data
@@ -26,15 +41,95 @@ struct	sfs_sb_info	{
   u32	s_firstdatablock;
   u16	s_state;
   u16	s_namelen;
+  u32	s_features;
+  u32	s_refc_start;
+  u32	s_refc_blocks;
+  u32	s_mount_opt;
+  //SFS_FEAT_ZONED (s_zone_blocks is 0 otherwise)
+  u32	s_zone_blocks;
+  u32	s_zone_start;
+  u32	s_nzones;
+  //Bytes of an inode, inodes in a block of the table, extents in the
+  //tail of an inode, and extents in the whole inode
+  u32	s_inode_size;
+  u32	s_inode_per_block;
+  u32	s_inode_exts;
+  u32	s_direct_exts;
+  //Inodes have room for struct sfs_inode_extra, and extended attributes
+  //in ii->i_tail after it
+  u32	s_inode_extra;
+  u32	s_xattr_ioff;
+  u32	s_xattr_isize;
+  //Free blocks, and blocks reserved by dirty pages (see bitmap.c)
+  unsigned long	s_free_blocks;
+  unsigned long	s_resv_blocks;
+  //SFS_FEAT_DYN_INODES : top block of the chunk index (0 : fixed inode
+  //table), and inodes of a chunk
+  u32	s_ichunk_index;
+  u32	s_ichunk_inodes;
   //Driver data
+  struct super_block	*s_sb;
   struct buffer_head	*s_bh;
   struct buffer_head	**s_imap;
   struct buffer_head	**s_bmap;
+  //Cluster compression buffers, allocated on first use
+  struct mutex		s_compr_lock;
+  u8			*s_compr_raw;
+  u8			*s_compr_buf;
+  void			*s_compr_wrk;
+  //Zoned device : blocks written in each sequential zone and the open
+  //zone, under s_lock. The cleaner may use the last free zones.
+  u32			*s_zone_wp;
+  u32			s_zone_cur;
+  //On-disk copy of s_zone_wp (NULL without a zone table)
+  struct buffer_head	**s_zone_tbl;
+  u32			s_zone_tbl_blocks;
+  //Writers waiting for the cleaner, and cleaner passes done
+  wait_queue_head_t	s_zone_waitq;
+  unsigned long		s_zone_passes;
+  struct work_struct	s_clean_work;
+  struct task_struct	*s_cleaner;
+  int			s_zone_stop;
+  //Top block of the chunk index, kept in memory ; both levels are
+  //filled under s_ichunk_lock
+  struct buffer_head	*s_ichunk_bh;
+  struct mutex		s_ichunk_lock;
+};
+
+//An extent of the in-memory map
+struct	sfs_extent	{
+  sector_t	e_lblk;	//First logical block
+  u32		e_pblk;	//First physical block (0 : hole)
+  u32		e_len;	//Number of blocks
+  u32		e_flags;//SFS_EXT_UNWRITTEN, SFS_EXT_COMPRESSED (and plen)
+};
+
+//A mapping request/answer (see sfs_map_blocks)
+struct	sfs_map	{
+  sector_t	m_lblk;
+  u32		m_pblk;
+  unsigned int	m_len;
+  unsigned int	m_flags;
+  unsigned int	m_plen;	//SFS_MAP_COMPRESSED : blocks of the cluster on disk
 };
 
 struct		sfs_inode_info	{
-  u32		i_data[INO_DATA_COUNT];
-  struct inode	vfs_inode;
+  u32			i_data[INO_DATA_COUNT];
+  //Bytes of the on-disk inode after struct sfs_inode : extents first
+  u32			i_tail[SFS_INODE_TAIL_MAX / sizeof(u32)];
+  //Extent map, loaded from i_data and index blocks on first use
+  struct rw_semaphore	i_ext_lock;
+  struct sfs_extent	*i_ext;
+  unsigned int		i_ext_count;
+  unsigned int		i_ext_max;
+  int			i_ext_loaded;
+  //The map holds (or held) compressed clusters
+  int			i_ext_compr;
+  //Extended attributes (see xattr.c)
+  struct rw_semaphore	i_xattr_sem;
+  //SFS_I_* bits
+  unsigned long		i_state;
+  struct inode		vfs_inode;
 };
 
 ////////////////////////
@@ -46,6 +141,15 @@ extern struct inode_operations	sfs_file_iops;
 extern struct file_operations	sfs_dir_ops;
 extern struct inode_operations	sfs_dir_iops;
 extern struct inode_operations sfs_symlink_iops;
+extern struct inode_operations sfs_fast_symlink_iops;
+//Frees blocks of big truncates in the background
+extern struct workqueue_struct	*sfs_free_wq;
+//Cleans zones of zoned devices in the background
+extern struct workqueue_struct	*sfs_clean_wq;
+//Reads ahead for O_NONBLOCK reads that missed the cache
+extern struct workqueue_struct	*sfs_read_wq;
+//Extended attribute name spaces
+extern struct xattr_handler	*sfs_xattr_handlers[];
 
 ///
 /// SB
@@ -61,9 +165,15 @@ sfs_get_sb(struct file_system_type *fs_type,
 //Kill superblock
 extern void
 sfs_kill_sb(struct super_block *sb);
+//Record a format feature in the super block
+void
+sfs_set_feature(struct super_block *sb, u32 feature);
 //Get an inode by ID
 struct inode
 *sfs_iget(struct super_block *sb, ino_t ino);
+//Write an inode (and its index blocks), on disk on return if wait
+int
+sfs_write_inode(struct inode *inode, int wait);
 
 ///
 /// INODES
@@ -71,6 +181,9 @@ struct inode
 //Read inode from disk
 struct sfs_inode*
 sfs_raw_inode(struct super_block *sb, ino_t ino, struct buffer_head **bh);
+//Allocate the inode chunk of an inode number (dynamic inodes)
+int
+sfs_ichunk_alloc(struct super_block *sb, ino_t ino);
 //Create a new inode
 struct inode*
 sfs_new_inode(struct super_block *sb);
@@ -98,10 +211,29 @@ int __sfs_write_begin
 (struct file *file, struct address_space *mapping,
  loff_t pos, unsigned len, unsigned flags,
  struct page **pagep, void **fsdata);
+//Copy shared blocks of a page before writing it
+int
+sfs_cow_page(struct inode *inode, struct page *page, unsigned from,
+	     unsigned to);
+//Copy the last block before a truncate if it is shared
+int
+sfs_unshare_block(struct inode *inode, loff_t pos);
+//First dirty page (or page not dirty) of [start, end)
+loff_t
+sfs_dirty_seek(struct address_space *mapping, loff_t start, loff_t end,
+	       int dirty);
 
 ///
 /// BMAPS
 ///
+//Tell if blocks are shared (or -EIO)
+int
+sfs_refc_test(struct super_block *sb, unsigned long start,
+	      unsigned long count);
+//Share blocks with one more file
+int
+sfs_refc_get(struct super_block *sb, unsigned long start,
+	     unsigned long count);
 //Get a ino (mark bit locked)
 int
 sfs_get_binode(struct super_block *sb);
@@ -114,9 +246,40 @@ sfs_get_bblock(struct super_block *sb);
 //Get a block after start (mark bit locked)
 int
 sfs_get_bblock_after(struct super_block *sb, unsigned long start);
+//Get contiguous blocks after goal (mark bits locked)
+int
+sfs_get_bblocks(struct super_block *sb, unsigned long goal,
+		unsigned int count, unsigned int *got);
+//Get exactly count contiguous blocks after goal (mark bits locked)
+int
+sfs_get_brun(struct super_block *sb, unsigned long goal, unsigned int count);
 //Get a block (mark bit unlocked)
 int
 sfs_put_bblock(struct super_block *sb, unsigned long ino);
+//Free contiguous blocks (mark bits unlocked)
+int
+sfs_put_bblocks(struct super_block *sb, unsigned long start,
+		unsigned long count);
+//Mark free blocks used (sb->s_lock held)
+void
+sfs_take_bblocks(struct super_block *sb, unsigned long start,
+		 unsigned long count);
+//Count used blocks
+unsigned long
+sfs_count_bblocks(struct super_block *sb, unsigned long start,
+		  unsigned long count);
+//Tell if an inode is used
+int
+sfs_test_binode(struct super_block *sb, unsigned long ino);
+//Count the free blocks at mount
+void
+sfs_resv_init(struct super_block *sb);
+//Reserve blocks for a dirty page without blocks
+int
+sfs_resv_get(struct super_block *sb, unsigned long count, int force);
+//Give back reserved blocks
+void
+sfs_resv_put(struct super_block *sb, unsigned long count);
 
 ///
 /// DIR
@@ -136,18 +299,180 @@ sfs_empty_dir(struct inode *inode);
 ///
 int
 sfs_getattr(struct vfsmount *mnt, struct dentry *dentry, struct kstat *stat);
+long
+sfs_fallocate(struct inode *inode, int mode, loff_t offset, loff_t len);
+
+///
+/// IOCTL
+///
+long
+sfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+
+///
+/// COMPRESS
+///
+//Tell if writes go through compressed clusters
+int
+sfs_compr_inode(struct inode *inode);
+//Read a page, decompressing its cluster
+int
+sfs_compr_readpage(struct page *page);
+//Write a page, compressing its cluster
+int
+sfs_compr_writepage(struct page *page, struct writeback_control *wbc);
+//Prepare a write without buffers
+int
+sfs_compr_write_begin(struct file *file, struct address_space *mapping,
+		      loff_t pos, unsigned len, unsigned flags,
+		      struct page **pagep, void **fsdata);
+//End a write started by sfs_compr_write_begin
+int
+sfs_compr_write_end(struct file *file, struct address_space *mapping,
+		    loff_t pos, unsigned len, unsigned copied,
+		    struct page *page, void *fsdata);
+//Zero the end of the last page after a truncate
+int
+sfs_compr_truncate_page(struct inode *inode, loff_t size);
+//Reserve the blocks of a page about to be dirtied
+int
+sfs_compr_reserve(struct page *page);
+//Drop cached pages, with their reservations
+void
+sfs_compr_drop_pages(struct address_space *mapping, loff_t start, loff_t end);
+//Free the compression buffers
+void
+sfs_compr_release(struct super_block *sb);
+
+///
+/// INLINE
+///
+//Read a page of a file stored in i_data
+int
+sfs_inline_readpage(struct page *page);
+//Copy a page dirtied by mmap to i_data
+int
+sfs_inline_writepage(struct page *page, struct writeback_control *wbc);
+//Move a file out of i_data, to blocks
+int
+sfs_inline_convert(struct inode *inode);
+//Tell if a write goes to i_data, moving the file in or out
+int
+sfs_inline_prepare(struct inode *inode, loff_t pos, unsigned len);
+//Prepare a write to i_data
+int
+sfs_inline_write_begin(struct file *file, struct address_space *mapping,
+		       loff_t pos, unsigned len, unsigned flags,
+		       struct page **pagep, void **fsdata);
+//End a write started by sfs_inline_write_begin
+int
+sfs_inline_write_end(struct file *file, struct address_space *mapping,
+		     loff_t pos, unsigned len, unsigned copied,
+		     struct page *page, void *fsdata);
+//Zero i_data after i_size
+void
+sfs_inline_truncate(struct inode *inode);
+
+///
+/// XATTR
+///
+//List the extended attribute names of a file
+ssize_t
+sfs_listxattr(struct dentry *dentry, char *buffer, size_t size);
+//Free the attribute block of a deleted inode
+void
+sfs_xattr_delete(struct inode *inode);
+//Store the security label of a new inode
+int
+sfs_init_security(struct inode *inode, struct inode *dir);
+
+///
+/// ZONE
+///
+//Load the zone write pointers
+int
+sfs_zone_init(struct super_block *sb);
+//Wait for the cleaner when only the reserve zones are left
+int
+sfs_zone_wait(struct super_block *sb);
+//Get count contiguous blocks at the open zone's write pointer
+int
+sfs_zone_get_brun(struct super_block *sb, unsigned int count);
+//Stop the cleaner before unmount
+void
+sfs_zone_stop(struct super_block *sb);
+//Free the zone write pointers
+void
+sfs_zone_release(struct super_block *sb);
 
 ///
 /// ITREE
 ///
-//Find a block
+//Map logical blocks to physical blocks (allocate if create)
+int
+sfs_map_blocks(struct inode *inode, struct sfs_map *map, int create);
+//Read extent map from disk
+int
+sfs_ext_load(struct inode *inode);
+//Start reading index blocks
+void
+sfs_ext_readahead(struct inode *inode);
+//Write extent map into i_data and index blocks (and wait if sync)
+int
+sfs_ext_store(struct inode *inode, int sync);
+//Free blocks after nblocks
+int
+sfs_ext_truncate(struct inode *inode, sector_t nblocks);
+//Allocate unwritten blocks in [start, end)
+int
+sfs_ext_prealloc(struct inode *inode, sector_t start, sector_t end);
+//Free blocks of [start, end) and leave a hole
+int
+sfs_ext_punch(struct inode *inode, sector_t start, sector_t end);
+//Free blocks of [start, end) and leave unwritten blocks
+int
+sfs_ext_zero(struct inode *inode, sector_t start, sector_t end);
+//Remove [start, end) and shift the following blocks
+int
+sfs_ext_collapse(struct inode *inode, sector_t start, sector_t end);
+//Next hole or data after offset
+loff_t
+sfs_ext_seek(struct inode *inode, loff_t offset, int hole);
+//Count written extents and blocks of [start, end)
+int
+sfs_ext_frag(struct inode *inode, sector_t start, sector_t end,
+	     sector_t *blocks);
+//Replace written blocks [lblk, lblk + len) by the donor run pblk
+int
+sfs_ext_move(struct inode *inode, sector_t lblk, u32 len, u32 pblk,
+	     struct sfs_extent *old);
+//Share blocks of src [sstart, sstart + len) with dst from dstart
+int
+sfs_ext_clone(struct inode *src, sector_t sstart, struct inode *dst,
+	      sector_t dstart, sector_t len);
+//Unshare lblk before it is written (returns the new block)
+int
+sfs_ext_cow(struct inode *inode, sector_t lblk);
+//Tell if blocks of [start, end) are shared
+int
+sfs_ext_shared(struct inode *inode, sector_t start, sector_t end);
+//Report extents to FS_IOC_FIEMAP
 int
-sfs_find_block(struct inode *inode, sector_t *iblock,
-		       unsigned short *deph, unsigned int *blk);
-//Alocate a block for inode
+sfs_ext_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+	       u64 start, u64 len);
+//Map [lblk, lblk + len) on the written run pblk in one block update
 int
-sfs_alloc_block(struct inode *inode,  sector_t *iblock,
-		unsigned short *deph, unsigned int *blk);
+sfs_ext_atomic(struct inode *inode, sector_t lblk, u32 len, u32 pblk,
+	       struct sfs_extent *old);
+//Replace cluster first by the blocks pblk
+int
+sfs_ext_cluster(struct inode *inode, sector_t first, u32 pblk, u32 len,
+		u32 flags, struct sfs_extent *old);
+//Tell if the map holds compressed clusters
+int
+sfs_ext_compressed(struct inode *inode);
+//Free in-memory extent map
+void
+sfs_ext_release(struct sfs_inode_info *ii);
 
 /*
 ** ********
@@ -165,6 +490,34 @@ extern inline struct sfs_super_block	*sfs_sb(struct super_block *sb)
   return (void*)sbi->s_bh->b_data;
 }
 
+/**
+ * sfs_inode_extra - Fields of a big inode after its tail extents
+ * @inode inode we are working on
+ *
+ * Only valid if sbi->s_inode_extra is set.
+ * Returns a pointer in ii->i_tail
+ */
+extern inline struct sfs_inode_extra*
+sfs_inode_extra(struct inode *inode)
+{
+  return (void*)((struct sfs_block_idx*)sfs_i(inode)->i_tail
+		 + SBI_PTR(inode->i_sb)->s_inode_exts);
+}
+
+//Is the content of the inode stored in i_data (no extent map)?
+extern inline int
+sfs_inline(struct inode *inode)
+{
+  return sfs_i(inode)->i_data[SFS_DBINDIRECT] == SFS_INLINE_MARK;
+}
+
+//Is the target of a symlink stored in i_data?
+extern inline int
+sfs_inline_symlink(struct inode *inode)
+{
+  return S_ISLNK(inode->i_mode) && sfs_inline(inode);
+}
+
 /**
  * sfs_next_dentry - Goto to the next dir-entry in the current page
  * @dent sfs direntry
@@ -179,7 +532,7 @@ sfs_next_dentry(struct sfs_dirent* dent, int len)
 }
 
 //Count pages
-extern inline int
+extern inline unsigned long
 sfs_count_pages(struct inode *inode)
 {
   //Size = 0 -> 0 pages
@@ -188,6 +541,25 @@ sfs_count_pages(struct inode *inode)
   return (inode->i_size + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
 }
 
+/**
+ * sfs_page_bytes - Bytes of a file held by a page
+ * @inode inode we are working on
+ * @pidx page index
+ *
+ * A page holds one or more blocks : directory code walks the blocks
+ * (SFS_DIR_CHUNK) of a page up to this limit.
+ * Returns a size in bytes
+ */
+extern inline unsigned int
+sfs_page_bytes(struct inode *inode, unsigned long pidx)
+{
+  loff_t	left = inode->i_size - ((loff_t)pidx << PAGE_CACHE_SHIFT);
+
+  if (left <= 0)
+    return 0;
+  return (left < PAGE_CACHE_SIZE) ? left : PAGE_CACHE_SIZE;
+}
+
 //Count blocks
 
 //Count pages
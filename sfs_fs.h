@@ -6,6 +6,38 @@
 # define	SFS_ERROR_FS	2
 # define	SFS_MOUNTED	4
 
+//sfs_super_block->s_features :
+//Blocks can be shared between files (reference count table)
+# define	SFS_FEAT_REFLINK	0x0001
+//Extents can be compressed clusters
+# define	SFS_FEAT_COMPRESS	0x0002
+//Host-managed zoned device : file data only goes to sequential zones
+# define	SFS_FEAT_ZONED		0x0004
+//Short symlink targets are stored in i_data
+# define	SFS_FEAT_FAST_SYMLINK	0x0008
+//Small regular files are stored in i_data
+# define	SFS_FEAT_INLINE_DATA	0x0010
+//Inodes are bigger than struct sfs_inode (s_inode_size)
+# define	SFS_FEAT_INODE_SIZE	0x0020
+//Files can be 4GB or bigger (sfs_inode_extra->i_size_hi)
+# define	SFS_FEAT_LARGE_FILE	0x0040
+//Inodes have extended attributes (sfs_inode_extra->i_xattr)
+# define	SFS_FEAT_XATTR		0x0080
+//Inodes live in chunks allocated on demand (s_ichunk_index), not in a
+//fixed table
+# define	SFS_FEAT_DYN_INODES	0x0100
+//Extents can be allocated but unwritten (SFS_EXT_UNWRITTEN)
+# define	SFS_FEAT_UNWRITTEN	0x0200
+//Extents can be holes (b_start is 0)
+# define	SFS_FEAT_HOLES		0x0400
+//Features this driver knows
+# define	SFS_FEAT_ALL		(SFS_FEAT_REFLINK | SFS_FEAT_COMPRESS \
+				 | SFS_FEAT_ZONED | SFS_FEAT_FAST_SYMLINK \
+				 | SFS_FEAT_INLINE_DATA | SFS_FEAT_INODE_SIZE \
+				 | SFS_FEAT_LARGE_FILE | SFS_FEAT_XATTR \
+				 | SFS_FEAT_DYN_INODES | SFS_FEAT_UNWRITTEN \
+				 | SFS_FEAT_HOLES)
+
 //////////////////
 //SFS constants //
 //////////////////
@@ -18,18 +50,66 @@
 //Number of bit in a block
 # define	BIT_PER_BLOCK		(SFS_BLOCK_SIZE << 3) // BlockSize * 8
 //Number of indirect elements
-# define	INDIRECT_BY_BLOCK	(SFS_BLOCK_SIZE / sizeof(sfs_block_idx))
+# define	INDIRECT_BY_BLOCK	(SFS_BLOCK_SIZE / sizeof(struct sfs_block_idx))
+//Number of reference counts in a block (one byte each)
+# define	REFC_PER_BLOCK		SFS_BLOCK_SIZE
+//A block is shared by at most SFS_REFC_MAX + 1 files
+# define	SFS_REFC_MAX		0xFF
 //Number of double indirect pointing to indirect blocks
 # define	DBINDIRECT_BY_BLOCK	(SFS_BLOCK_SIZE / sizeof(__u32))
+//Extents stored in the inode
+# define	SFS_DIRECT_EXT		4
+//i_data index of the indirect block
+# define	SFS_INDIRECT		8
+//i_data index of the double indirect block
+# define	SFS_DBINDIRECT		9
 //Maximum link to an inode
 # define	SFS_MAX_LINK		65530
-//How much inode can be stored in one block
-# define	INODE_PER_BLOCK		\
-  (SFS_BLOCK_SIZE / sizeof(struct sfs_inode))
+//Bytes of struct sfs_inode, the smallest inode
+# define	SFS_INODE_SIZE		64
+//Bytes of the biggest inode
+# define	SFS_INODE_SIZE_MAX	256
+//Bytes after struct sfs_inode in the biggest inode
+# define	SFS_INODE_TAIL_MAX	(SFS_INODE_SIZE_MAX - SFS_INODE_SIZE)
+//How much inode of isize bytes can be stored in one block
+# define	INODE_PER_BLOCK(isize)	(SFS_BLOCK_SIZE / (isize))
+//Write pointers in a block of the zone table (SFS_FEAT_ZONED)
+# define	SFS_ZONE_WP_PER_BLOCK	(SFS_BLOCK_SIZE / sizeof(__u32))
+//Contiguous blocks of an inode chunk (SFS_FEAT_DYN_INODES)
+# define	SFS_ICHUNK_BLOCKS	16
+//Entries of a chunk index block, and chunks its two levels can list
+# define	SFS_ICHUNK_PER_BLOCK	(SFS_BLOCK_SIZE / sizeof(__u32))
+# define	SFS_ICHUNK_MAX		(SFS_ICHUNK_PER_BLOCK * SFS_ICHUNK_PER_BLOCK)
 //Inode data's field
 # define	INO_DATA_COUNT		10
 //Superblock's inode ID
 # define	SFS_ROOT_INO		2
+//i_data[SFS_DBINDIRECT] of a symlink or a file whose data is in i_data
+# define	SFS_INLINE_MARK		0xFFFFFFFF
+//Bytes of i_data for an inline symlink target, with its final 0
+# define	SFS_INLINE_LINK		(SFS_DBINDIRECT * sizeof(__u32))
+//Bytes of i_data for the data of an inline file
+# define	SFS_INLINE_DATA		(SFS_DBINDIRECT * sizeof(__u32))
+//Log2 of the blocks of a compressed cluster
+# define	SFS_CLUSTER_LOG		2
+//Blocks of a compressed cluster
+# define	SFS_CLUSTER_BLOCKS	(1 << SFS_CLUSTER_LOG)
+//Bytes of a compressed cluster, once uncompressed
+# define	SFS_CLUSTER_SIZE	(SFS_BLOCK_SIZE << SFS_CLUSTER_LOG)
+//Blocks written at most by one SFS_IOC_ATOMIC_WRITE
+# define	SFS_ATOMIC_MAX		16
+
+//sfs_block_idx->b_count :
+//Allocated but never written, reads as zeros (SFS_FEAT_UNWRITTEN)
+# define	SFS_EXT_UNWRITTEN	0x80000000
+//A compressed cluster
+# define	SFS_EXT_COMPRESSED	0x40000000
+//Number of blocks
+# define	SFS_EXT_LEN_MASK	0x3FFFFFFF
+//Compressed cluster : number of blocks on disk, and in the file
+# define	SFS_EXT_PLEN_MASK	0x3FFF0000
+# define	SFS_EXT_PLEN_SHIFT	16
+# define	SFS_EXT_CLEN_MASK	0x0000FFFF
 
 struct	sfs_block_idx
 {
@@ -37,6 +117,13 @@ struct	sfs_block_idx
   __u32	b_count;
 };
 
+//Head of the first block of a compressed cluster
+struct	sfs_cluster_hdr
+{
+  __u32	c_clen;		//Compressed bytes following the header
+  __u32	c_rlen;		//Bytes once uncompressed
+};
+
 struct	sfs_super_block
 {
   __u32	s_nblocks;
@@ -49,6 +136,25 @@ struct	sfs_super_block
   __u16	s_namelen;
   __u16 s_magic;
   __u16 s_unused;
+  __u32	s_features;
+  //Reference count table blocks, after the inode table
+  __u32	s_refc_blocks;
+  //SFS_FEAT_ZONED : blocks of a zone, and first block of the sequential
+  //zones (conventional zones before it hold metadata and directories)
+  __u32	s_zone_blocks;
+  __u32	s_zone_start;
+  //SFS_FEAT_INODE_SIZE : bytes of an inode, and extents stored right
+  //after struct sfs_inode in it (before the index blocks)
+  __u16	s_inode_size;
+  __u16	s_inode_exts;
+  //SFS_FEAT_DYN_INODES : block listing the second level index blocks,
+  //which list the first block of each inode chunk (0 : not allocated
+  //yet), s_inode_blocks is 0
+  __u32	s_ichunk_index;
+  //SFS_FEAT_ZONED : first block of the write pointer table (one __u32
+  //per sequential zone, 0 : pointers rebuilt from the block bitmap)
+  __u32	s_zone_table;
+  __u32	s_reserved[1];
 };
 
 struct	sfs_inode
@@ -69,6 +175,115 @@ struct	sfs_inode
   __u32	i_data[INO_DATA_COUNT];
 };
 
+//Big inodes : fields after the tail extents, if the inode has room.
+//The rest of the inode holds extended attributes.
+struct	sfs_inode_extra
+{
+  __u32	i_size_hi;	//Bits 32 to 63 of i_size
+  __u32	i_xattr;	//Block of the attributes not in the inode (0 : none)
+};
+
+//Extended attribute names : sfs_xattr_entry->e_index
+# define	SFS_XATTR_INDEX_USER		1
+# define	SFS_XATTR_INDEX_TRUSTED		2
+# define	SFS_XATTR_INDEX_SECURITY	3
+//sfs_xattr_header->h_magic
+# define	SFS_XATTR_MAGIC		0x53584154
+
+//An extended attribute, in the inode or in its block. Entries are
+//4 bytes aligned, the list ends with e_name_len 0 or with the room.
+struct	sfs_xattr_entry
+{
+  __u8	e_index;	//SFS_XATTR_INDEX_*
+  __u8	e_name_len;	//Name without its prefix
+  __u16	e_value_len;
+  char	e_name[0];	//Name, then value
+};
+
+//Bytes of an entry
+# define	SFS_XATTR_LEN(name_len, value_len)			\
+  ((sizeof(struct sfs_xattr_entry) + (name_len) + (value_len) + 3) & ~3)
+
+//Head of an extended attribute block, entries follow
+struct	sfs_xattr_header
+{
+  __u32	h_magic;
+  __u32	h_reserved;
+};
+
+//SFS_IOC_DEFRAG argument
+struct	sfs_defrag
+{
+  __u64	d_start;	//First logical block
+  __u64	d_len;		//Number of blocks
+  __u64	d_moved;	//Blocks moved (returned)
+};
+
+//SFS_IOC_ATOMIC_WRITE argument
+struct	sfs_atomic_write
+{
+  __u64	a_offset;	//Where to write, a multiple of a_len
+  __u64	a_buf;		//User buffer
+  __u32	a_len;		//Bytes, a power of two within the unit limits
+  __u32	a_flags;	//SFS_ATOMIC_*
+};
+
+//sfs_atomic_write->a_flags :
+//The new mapping is on disk when the ioctl returns (always the case)
+# define	SFS_ATOMIC_SYNC		1
+
+//SFS_IOC_ATOMIC_INFO argument
+struct	sfs_atomic_info
+{
+  __u32	ai_unit_min;	//Smallest atomic write, in bytes
+  __u32	ai_unit_max;	//Largest atomic write, in bytes
+};
+
+//SFS_IOC_SEEK argument (lseek SEEK_DATA and SEEK_HOLE, which this
+//kernel's VFS refuses)
+struct	sfs_seek
+{
+  __u64	s_offset;	//Where to start, and the position found (returned)
+  __u32	s_whence;	//SFS_SEEK_*
+  __u32	s_pad;
+};
+
+//sfs_seek->s_whence :
+//Next byte of data
+# define	SFS_SEEK_DATA		3
+//Next byte of a hole (the end of the file is one)
+# define	SFS_SEEK_HOLE		4
+
+//SFS_IOC_FALLOCATE argument (fallocate modes without
+//FALLOC_FL_KEEP_SIZE, which this kernel's VFS refuses)
+struct	sfs_falloc
+{
+  __u64	f_offset;	//Start of the range
+  __u64	f_len;		//Length of the range
+  __u32	f_mode;		//FALLOC_FL_* flags, as for fallocate
+  __u32	f_pad;
+};
+
+//Ioctls
+# define	SFS_IOC_DEFRAG		_IOWR('S', 1, struct sfs_defrag)
+# define	SFS_IOC_ATOMIC_WRITE	_IOW('S', 2, struct sfs_atomic_write)
+# define	SFS_IOC_ATOMIC_INFO	_IOR('S', 3, struct sfs_atomic_info)
+# define	SFS_IOC_SEEK		_IOWR('S', 4, struct sfs_seek)
+# define	SFS_IOC_FALLOCATE	_IOW('S', 5, struct sfs_falloc)
+
+//Reflink ioctls, for headers older than them
+# ifndef FICLONE
+struct	file_clone_range
+{
+  __s64	src_fd;
+  __u64	src_offset;
+  __u64	src_length;		//0 : up to the source's end
+  __u64	dest_offset;
+};
+#  define	FICLONE			_IOW(0x94, 9, int)
+#  define	FICLONERANGE		_IOW(0x94, 13, struct file_clone_range)
+# endif
+
 struct	sfs_dirent
 {
   __u32	d_ino;
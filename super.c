@@ -8,6 +8,9 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/workqueue.h>
+#include <linux/parser.h>
+#include <linux/log2.h>
 #include "sfs_fs.h"
 #include "sfs.h"
 
@@ -17,6 +20,9 @@
 ** *********
 */
 struct kmem_cache *sfs_inode_cache = NULL;
+struct workqueue_struct *sfs_free_wq = NULL;
+struct workqueue_struct *sfs_clean_wq = NULL;
+struct workqueue_struct *sfs_read_wq = NULL;
 
 /*
 ** *************
@@ -31,15 +37,24 @@ sfs_alloc_inode(struct super_block *sb)
   printk(KERN_DEBUG "SFS: alloc_inode\n");
   if (!(ii = kmem_cache_alloc(sfs_inode_cache, GFP_KERNEL)))
     return NULL;
+  ii->i_ext = NULL;
+  ii->i_ext_count = 0;
+  ii->i_ext_max = 0;
+  ii->i_ext_loaded = 0;
+  ii->i_ext_compr = 0;
+  ii->i_state = 0;
   return &ii->vfs_inode;
 }
 
 static void
 sfs_destroy_inode(struct inode *inode)
 {
+  struct sfs_inode_info	*ii = sfs_i(inode);
+
   printk(KERN_DEBUG "SFS: destroy_inode\n");
 
-  kmem_cache_free(sfs_inode_cache, inode);
+  sfs_ext_release(ii);
+  kmem_cache_free(sfs_inode_cache, ii);
 }
 
 static void
@@ -53,13 +68,17 @@ sfs_put_super(struct super_block *sb)
 
   printk(KERN_DEBUG "SFS: put_super\n");
 
+  //Wait for blocks freed in the background
+  flush_workqueue(sfs_free_wq);
+
   //Free MAPS
   map = sbi->s_imap;
-  map_blocks = sbi->s_imap_blocks + sbi->s_imap_blocks;
+  map_blocks = sbi->s_imap_blocks + sbi->s_bmap_blocks;
   if (map)
     for(i = 0; i < map_blocks && map[i]; i++)
       brelse(map[i]);
   kfree(map);
+  brelse(sbi->s_ichunk_bh);
 
   //Release SB
   hsb = sfs_sb(sb);
@@ -68,20 +87,23 @@ sfs_put_super(struct super_block *sb)
   brelse(sbi->s_bh);
 
   //Remove SBI
+  sfs_compr_release(sb);
+  sfs_zone_release(sb);
   STORE_SBI(sb, NULL);
   kfree(sbi);
 }
 
-static struct buffer_head*
-sfs_update_inode(struct inode *inode)
+static int
+sfs_update_inode(struct inode *inode, int sync)
 {
   struct buffer_head	*bh;
   struct sfs_inode	*iraw;
   struct sfs_inode_info	*ii;
   int			i;
+  int			err = 0;
 
   if (!(iraw = sfs_raw_inode(inode->i_sb, inode->i_ino, &bh)))
-    return NULL;
+    return -EIO;
   iraw->i_mode = inode->i_mode;
   iraw->i_nlink = inode->i_nlink;
   iraw->i_uid = inode->i_uid;
@@ -91,33 +113,45 @@ sfs_update_inode(struct inode *inode)
   iraw->i_ctime = inode->i_ctime.tv_sec;
   ii = sfs_i(inode);
   iraw->i_size = inode->i_size;
+  //4GB or more : the high bits go after the tail extents
+  if (SBI_PTR(inode->i_sb)->s_inode_extra)
+    sfs_inode_extra(inode)->i_size_hi = inode->i_size >> 32;
+  if (inode->i_size >> 32)
+    sfs_set_feature(inode->i_sb, SFS_FEAT_LARGE_FILE);
   inode->i_blocks = sfs_count_blocks(inode);
+  //Flush the extent map into i_data and index blocks, which reach
+  //the disk before the inode when syncing
+  down_write(&ii->i_ext_lock);
+  if (!sfs_inline(inode))
+    err = sfs_ext_store(inode, sync);
   for(i = 0; i < INO_DATA_COUNT; i++)
     iraw->i_data[i] = ii->i_data[i];
+  memcpy(iraw + 1, ii->i_tail, SBI_PTR(inode->i_sb)->s_inode_size
+	 - sizeof(*iraw));
+  up_write(&ii->i_ext_lock);
   mark_buffer_dirty(bh);
-  return bh;
+  if (sync && !err && sync_dirty_buffer(bh))
+    err = -EIO;
+  brelse(bh);
+  return err;
 }
 
-static int
+int
 sfs_write_inode(struct inode *inode, int wait)
 {
-  struct buffer_head	*bh;
-
   printk(KERN_DEBUG "     : write inode %ld\n", inode->i_ino);
-  bh = sfs_update_inode(inode);
-  brelse(bh);
-
-  return 0;
+  return sfs_update_inode(inode, wait);
 }
 static void
 sfs_delete_inode(struct inode *inode)
 {
   printk(KERN_DEBUG "     : delete inode %ld\n", inode->i_ino);
-  truncate_inode_pages(&inode->i_data, 0);
+  sfs_compr_drop_pages(&inode->i_data, 0, (loff_t)-1);
 
   //Truncate inode
   i_size_write(inode, 0);
   sfs_truncate(inode);
+  sfs_xattr_delete(inode);
 
   //Free inode's bit in bitmap
   sfs_put_binode(inode->i_sb, inode->i_ino);
@@ -197,7 +231,10 @@ struct inode	*sfs_iget(struct super_block *sb, ino_t ino)
   sii = sfs_i(inode);
   for(i = 0; i < INO_DATA_COUNT; i++)
     sii->i_data[i] = iraw->i_data[i];
+  memcpy(sii->i_tail, iraw + 1, SBI_PTR(sb)->s_inode_size - sizeof(*iraw));
   inode->i_size = iraw->i_size;
+  if (SBI_PTR(sb)->s_inode_extra)
+    inode->i_size |= (loff_t)sfs_inode_extra(inode)->i_size_hi << 32;
   inode->i_blocks = sfs_count_blocks(inode);
   //Select OPS from type
   sfs_set_inode_ops(inode, 0);
@@ -210,6 +247,79 @@ struct inode	*sfs_iget(struct super_block *sb, ino_t ino)
   return inode;
 }
 
+/**
+ * sfs_set_feature - Record a format feature in the super block
+ * @sb SFS super block
+ * @feature SFS_FEAT_* flag
+ *
+ * Drivers that don't know it won't mount the file system anymore.
+ */
+void
+sfs_set_feature(struct super_block *sb, u32 feature)
+{
+  SBI(sb);
+
+  if (sbi->s_features & feature)
+    return;
+  mutex_lock(&sb->s_lock);
+  sbi->s_features |= feature;
+  sfs_sb(sb)->s_features |= feature;
+  mark_buffer_dirty(sbi->s_bh);
+  mutex_unlock(&sb->s_lock);
+}
+
+//Mount options
+enum
+  {
+    Opt_compress, Opt_nocompress, Opt_nbread, Opt_err
+  };
+
+static match_table_t sfs_tokens =
+  {
+    {Opt_compress, "compress"},
+    {Opt_nocompress, "nocompress"},
+    {Opt_nbread, "nbread"},
+    {Opt_err, NULL}
+  };
+
+/**
+ * sfs_parse_options - Read the mount options
+ * @options comma separated options, may be NULL
+ * @sbi SFS super block info, s_mount_opt is filled
+ *
+ * Returns 1 if all options are known, 0 otherwise
+ */
+static int
+sfs_parse_options(char *options, struct sfs_sb_info *sbi)
+{
+  substring_t	args[MAX_OPT_ARGS];
+  char		*p;
+
+  if (!options)
+    return 1;
+  while ((p = strsep(&options, ",")))
+    {
+      if (!*p)
+	continue;
+      switch (match_token(p, sfs_tokens, args))
+	{
+	case Opt_compress:
+	  sbi->s_mount_opt |= SFS_MOUNT_COMPRESS;
+	  break;
+	case Opt_nocompress:
+	  sbi->s_mount_opt &= ~SFS_MOUNT_COMPRESS;
+	  break;
+	case Opt_nbread:
+	  sbi->s_mount_opt |= SFS_MOUNT_NBREAD;
+	  break;
+	default:
+	  printk("SFS-fs: Unknown mount option \"%s\"\n", p);
+	  return 0;
+	}
+    }
+  return 1;
+}
+
 //Fill a superblock
 static int
 sfs_fill_super(struct super_block *sb, void *data, int silent)
@@ -233,8 +343,8 @@ sfs_fill_super(struct super_block *sb, void *data, int silent)
   printk(KERN_DEBUG "SFS: fill_super\n");
 
   //Check arch compatibility
-  BUILD_BUG_ON(32 != sizeof(struct sfs_super_block));
-  BUILD_BUG_ON(64 != sizeof(struct sfs_inode));
+  BUILD_BUG_ON(64 != sizeof(struct sfs_super_block));
+  BUILD_BUG_ON(SFS_INODE_SIZE != sizeof(struct sfs_inode));
   BUILD_BUG_ON(8  != sizeof(struct sfs_block_idx));
 
   //Allocate sb info
@@ -242,6 +352,10 @@ sfs_fill_super(struct super_block *sb, void *data, int silent)
   if(!sbi)
     return -ENOMEM;
   STORE_SBI(sb, sbi);
+  mutex_init(&sbi->s_compr_lock);
+  mutex_init(&sbi->s_ichunk_lock);
+  if (!sfs_parse_options(data, sbi))
+    goto out;
 
   //Initialise SuperBlock
   if(!sb_set_blocksize(sb, SFS_BLOCK_SIZE))
@@ -267,6 +381,85 @@ sfs_fill_super(struct super_block *sb, void *data, int silent)
   sbi->s_firstdatablock = ssb->s_firstdatablock;
   sbi->s_state = ssb->s_state;
   sbi->s_namelen = ssb->s_namelen;
+  sbi->s_features = ssb->s_features;
+  sbi->s_refc_start = sbi->s_firstinodeblock + ssb->s_inode_blocks;
+  sbi->s_refc_blocks = ssb->s_refc_blocks;
+  sbi->s_sb = sb;
+
+  //Features we don't know change the disk format
+  if (ssb->s_features & ~SFS_FEAT_ALL)
+    goto out_bad_features;
+  if (!(ssb->s_features & SFS_FEAT_REFLINK))
+    sbi->s_refc_blocks = 0;
+  //Big inodes : a power of two, with the tail extents inside
+  sbi->s_inode_size = SFS_INODE_SIZE;
+  if (ssb->s_features & SFS_FEAT_INODE_SIZE)
+    {
+      if (ssb->s_inode_size < SFS_INODE_SIZE
+	  || ssb->s_inode_size > SFS_INODE_SIZE_MAX
+	  || !is_power_of_2(ssb->s_inode_size)
+	  || ssb->s_inode_exts * sizeof(struct sfs_block_idx)
+	  > ssb->s_inode_size - SFS_INODE_SIZE)
+	goto out_bad_inodes;
+      sbi->s_inode_size = ssb->s_inode_size;
+      sbi->s_inode_exts = ssb->s_inode_exts;
+    }
+  sbi->s_inode_per_block = INODE_PER_BLOCK(sbi->s_inode_size);
+  sbi->s_direct_exts = SFS_DIRECT_EXT + sbi->s_inode_exts;
+  sbi->s_inode_extra = (sbi->s_inode_size >= SFS_INODE_SIZE
+			+ sbi->s_inode_exts * sizeof(struct sfs_block_idx)
+			+ sizeof(struct sfs_inode_extra));
+  //Files end with a 32 bits i_size, or with 32 bits block numbers
+  if (sbi->s_inode_extra)
+    sb->s_maxbytes = min_t(u64, MAX_LFS_FILESIZE,
+			   ((u64)1 << 32 << SFS_BLOCK_LOG_SIZE) - 1);
+  else
+    sb->s_maxbytes = 0xFFFFFFFFULL;
+  if ((ssb->s_features & (SFS_FEAT_LARGE_FILE | SFS_FEAT_XATTR))
+      && !sbi->s_inode_extra)
+    goto out_bad_inodes;
+  //Extended attributes fill the rest of the inode
+  if (sbi->s_inode_extra)
+    {
+      sbi->s_xattr_ioff = sbi->s_inode_exts * sizeof(struct sfs_block_idx)
+	+ sizeof(struct sfs_inode_extra);
+      sbi->s_xattr_isize = sbi->s_inode_size - SFS_INODE_SIZE
+	- sbi->s_xattr_ioff;
+    }
+  //Dynamic inodes : a two level index lists the chunks
+  if (ssb->s_features & SFS_FEAT_DYN_INODES)
+    {
+      sbi->s_ichunk_inodes = SFS_ICHUNK_BLOCKS * sbi->s_inode_per_block;
+      if (!ssb->s_ichunk_index || ssb->s_ichunk_index >= ssb->s_nblocks
+	  || ssb->s_inode_blocks
+	  || ssb->s_ninodes > (u64)SFS_ICHUNK_MAX * sbi->s_ichunk_inodes)
+	goto out_bad_inodes;
+      sbi->s_ichunk_index = ssb->s_ichunk_index;
+    }
+  //Sequential zones after the metadata, whole zones only
+  if (ssb->s_features & SFS_FEAT_ZONED)
+    {
+      if (!ssb->s_zone_blocks || ssb->s_zone_start <= ssb->s_firstdatablock
+	  || ssb->s_zone_start >= ssb->s_nblocks)
+	goto out_bad_zones;
+      sbi->s_zone_blocks = ssb->s_zone_blocks;
+      sbi->s_zone_start = ssb->s_zone_start;
+      sbi->s_nzones = (ssb->s_nblocks - ssb->s_zone_start)
+	/ ssb->s_zone_blocks;
+      sbi->s_zone_tbl_blocks = (sbi->s_nzones + SFS_ZONE_WP_PER_BLOCK - 1)
+	/ SFS_ZONE_WP_PER_BLOCK;
+      if (ssb->s_zone_table
+	  && ssb->s_zone_table + sbi->s_zone_tbl_blocks > ssb->s_firstdatablock)
+	goto out_bad_zones;
+    }
+  //Compressed clusters need a driver that knows them
+  if ((sbi->s_mount_opt & SFS_MOUNT_COMPRESS) && !(sb->s_flags & MS_RDONLY)
+      && !(ssb->s_features & SFS_FEAT_COMPRESS))
+    {
+      ssb->s_features |= SFS_FEAT_COMPRESS;
+      sbi->s_features = ssb->s_features;
+      mark_buffer_dirty(bh);
+    }
 
   //Check validity
   if (!(ssb->s_state & SFS_VALID_FS))
@@ -311,8 +504,18 @@ sfs_fill_super(struct super_block *sb, void *data, int silent)
       ++block;
     }
 
+  sfs_resv_init(sb);
+  if (sbi->s_ichunk_index
+      && !(sbi->s_ichunk_bh = sb_bread(sb, sbi->s_ichunk_index)))
+    goto out_err_map;
+
+  //Write pointers of the sequential zones, from the block bitmap
+  if (sbi->s_zone_blocks && sfs_zone_init(sb))
+    goto out_no_zones;
+
   //Link operation table
   sb->s_op = &sfs_super_operations;
+  sb->s_xattr = sfs_xattr_handlers;
 
   //Get root inode
   iroot = sfs_iget(sb, SFS_ROOT_INO);
@@ -347,6 +550,22 @@ sfs_fill_super(struct super_block *sb, void *data, int silent)
     printk("SFS-fs: Bad magic number on defice %s\n", sb->s_id);
   goto out_brelease;
 
+ out_bad_features:
+  if(!silent)
+    printk("SFS-fs: Unknown features %x on device %s\n",
+	   ssb->s_features & ~SFS_FEAT_ALL, sb->s_id);
+  goto out_brelease;
+
+ out_bad_zones:
+  if(!silent)
+    printk("SFS-fs: Invalid zones on device %s\n", sb->s_id);
+  goto out_brelease;
+
+ out_bad_inodes:
+  if(!silent)
+    printk("SFS-fs: Invalid inodes on device %s\n", sb->s_id);
+  goto out_brelease;
+
  out_no_map:
   if(!silent)
     printk("SFS-fs: Can't create maps\n");
@@ -372,11 +591,19 @@ sfs_fill_super(struct super_block *sb, void *data, int silent)
   ret = -ENOMEM;
   goto out_free_map;
 
+ out_no_zones:
+  if(!silent)
+    printk("SFS-fs: Can't load zones\n");
+  ret = -ENOMEM;
+  goto out_free_map;
+
  out_err_map:
   if(!silent)
     printk("SFS-fs: Can't read blocks maps\n");
  out_free_map:
-  block = sbi->s_imap_blocks + sbi->s_imap_blocks;
+  sfs_zone_release(sb);
+  brelse(sbi->s_ichunk_bh);
+  block = sbi->s_imap_blocks + sbi->s_bmap_blocks;
   for(i = 0; i < block && map[i]; i++)
     brelse(map[i]);
   kfree(map);
@@ -415,6 +642,9 @@ sfs_kill_sb(struct super_block *sb)
 {
   printk("SFS: kill_sb\n");
 
+  //No cleaning once inodes are evicted
+  if (SBI_PTR(sb))
+    sfs_zone_stop(sb);
   //Kill superblock
   kill_block_super(sb);
 }
@@ -429,6 +659,8 @@ void	sfs_init_once(void *ptr)
 {
   struct sfs_inode_info	*inode = ptr;
 
+  init_rwsem(&inode->i_ext_lock);
+  init_rwsem(&inode->i_xattr_sem);
   inode_init_once(&inode->vfs_inode);
 }
 
@@ -448,8 +680,38 @@ int	sfs_init_module(void)
   if (!sfs_inode_cache)
     return -ENOMEM;
 
+  //Background block freeing
+  if (!(sfs_free_wq = create_singlethread_workqueue("sfs_free")))
+    {
+      kmem_cache_destroy(sfs_inode_cache);
+      return -ENOMEM;
+    }
+  //Background zone cleaning
+  if (!(sfs_clean_wq = create_singlethread_workqueue("sfs_clean")))
+    {
+      destroy_workqueue(sfs_free_wq);
+      kmem_cache_destroy(sfs_inode_cache);
+      return -ENOMEM;
+    }
+
+  //Background reads for O_NONBLOCK readers
+  if (!(sfs_read_wq = create_singlethread_workqueue("sfs_read")))
+    {
+      destroy_workqueue(sfs_clean_wq);
+      destroy_workqueue(sfs_free_wq);
+      kmem_cache_destroy(sfs_inode_cache);
+      return -ENOMEM;
+    }
+
   //Register filesystem
   err = register_filesystem(&sfs_fs_type);
+  if (err)
+    {
+      destroy_workqueue(sfs_read_wq);
+      destroy_workqueue(sfs_clean_wq);
+      destroy_workqueue(sfs_free_wq);
+      kmem_cache_destroy(sfs_inode_cache);
+    }
   return (err);
 }
 
@@ -460,6 +722,9 @@ static void	sfs_cleanup_module(void)
 
   //Free inode cache
   kmem_cache_destroy(sfs_inode_cache);
+  destroy_workqueue(sfs_free_wq);
+  destroy_workqueue(sfs_clean_wq);
+  destroy_workqueue(sfs_read_wq);
 
   //Unregister FS
   unregister_filesystem(&sfs_fs_type);
@@ -4,13 +4,37 @@
  * Copyright (C) 2009, Jeremy Cochoy
  */
 #include <linux/buffer_head.h>
+#include <linux/namei.h>
+#include <linux/xattr.h>
 #include "sfs_fs.h"
 #include "sfs.h"
 
+//Follow a target stored in i_data : no page to read
+static void *sfs_follow_link(struct dentry *dentry, struct nameidata *nd)
+{
+  nd_set_link(nd, (char*)sfs_i(dentry->d_inode)->i_data);
+  return NULL;
+}
+
 struct inode_operations sfs_symlink_iops =
   {
     .readlink	= generic_readlink,
     .follow_link	= page_follow_link_light,
     .put_link	= page_put_link,
     .getattr		= sfs_getattr,
+    .setxattr		= generic_setxattr,
+    .getxattr		= generic_getxattr,
+    .listxattr		= sfs_listxattr,
+    .removexattr	= generic_removexattr,
+  };
+
+struct inode_operations sfs_fast_symlink_iops =
+  {
+    .readlink	= generic_readlink,
+    .follow_link	= sfs_follow_link,
+    .getattr		= sfs_getattr,
+    .setxattr		= generic_setxattr,
+    .getxattr		= generic_getxattr,
+    .listxattr		= sfs_listxattr,
+    .removexattr	= generic_removexattr,
   };
@@ -0,0 +1,646 @@
+/*
+ * sfs/xattr.c for SFS
+ *
+ * Copyright (C) 2009, Jeremy Cochoy
+ */
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/buffer_head.h>
+#include <linux/capability.h>
+#include <linux/xattr.h>
+#include <linux/security.h>
+#include "sfs_fs.h"
+#include "sfs.h"
+
+/*
+** Extended attributes need big inodes (mkfs.sfs -I, 256 bytes for a
+** security label to fit) : they go in the
+** inode after struct sfs_inode_extra (sbi->s_xattr_isize bytes), then,
+** if they don't fit, in one block per inode (sfs_inode_extra->i_xattr)
+** starting with a sfs_xattr_header. Both areas hold a list of
+** sfs_xattr_entry.
+**
+** The inode area is in ii->i_tail : reading an attribute found there
+** costs nothing beyond sfs_iget. On each change, the list of the inode
+** is packed again, the inode area first.
+**
+** ii->i_xattr_sem protects both areas. The inode area is changed under
+** ii->i_ext_lock too, as sfs_update_inode copies ii->i_tail with it.
+*/
+
+//Room for entries in an attribute block
+#define	SFS_XATTR_BLOCK_ROOM	(SFS_BLOCK_SIZE - sizeof(struct sfs_xattr_header))
+
+static struct xattr_handler	*sfs_xattr_handler(int index);
+
+//Entry after @e
+static inline struct sfs_xattr_entry*
+sfs_xattr_next(struct sfs_xattr_entry *e)
+{
+  return (void*)e + SFS_XATTR_LEN(e->e_name_len, e->e_value_len);
+}
+
+//Is @e a whole entry before @end?
+static inline int
+sfs_xattr_valid(struct sfs_xattr_entry *e, void *end)
+{
+  return (void*)e + sizeof(*e) <= end && e->e_name_len
+    && (void*)sfs_xattr_next(e) <= end;
+}
+
+//Walk the entries of [@start, @end)
+#define	for_each_xattr(e, start, end)				\
+  for ((e) = (start); sfs_xattr_valid((e), (end)); (e) = sfs_xattr_next(e))
+
+//Attribute area of the inode
+static inline void*
+sfs_xattr_ibody(struct inode *inode)
+{
+  return (u8*)sfs_i(inode)->i_tail + SBI_PTR(inode->i_sb)->s_xattr_ioff;
+}
+
+/**
+ * sfs_xattr_find - Look for an attribute in [@start, @end)
+ * @start first entry
+ * @end end of the area
+ * @index SFS_XATTR_INDEX_*
+ * @name name without its prefix
+ * @len strlen(@name)
+ *
+ * Returns the entry or NULL
+ */
+static struct sfs_xattr_entry*
+sfs_xattr_find(void *start, void *end, int index, const char *name,
+	       size_t len)
+{
+  struct sfs_xattr_entry	*e;
+
+  for_each_xattr(e, start, end)
+    if (e->e_index == index && e->e_name_len == len
+	&& !memcmp(e->e_name, name, len))
+      return e;
+  return NULL;
+}
+
+/**
+ * sfs_xattr_read_block - Read the attribute block of @inode
+ * @inode inode we are working on, with ii->i_xattr_sem held
+ *
+ * Returns the buffer, NULL if @inode has no block, or an ERR_PTR
+ */
+static struct buffer_head*
+sfs_xattr_read_block(struct inode *inode)
+{
+  const u32		blk = sfs_inode_extra(inode)->i_xattr;
+  struct buffer_head	*bh;
+
+  if (!blk)
+    return NULL;
+  if (!(bh = sb_bread(inode->i_sb, blk)))
+    return ERR_PTR(-EIO);
+  if (((struct sfs_xattr_header*)bh->b_data)->h_magic != SFS_XATTR_MAGIC)
+    {
+      printk("SFS-fs warning: bad attribute block %u for inode %lu\n",
+	     blk, inode->i_ino);
+      brelse(bh);
+      return ERR_PTR(-EIO);
+    }
+  return bh;
+}
+
+/**
+ * sfs_xattr_get - Read an attribute
+ * @inode inode we are working on
+ * @index SFS_XATTR_INDEX_*
+ * @name name without its prefix
+ * @buffer where to copy the value (NULL : only its size is wanted)
+ * @size bytes of @buffer
+ *
+ * Returns the size of the value or an error code
+ */
+static int
+sfs_xattr_get(struct inode *inode, int index, const char *name,
+	      void *buffer, size_t size)
+{
+  struct sfs_inode_info		*ii = sfs_i(inode);
+  SBI(inode->i_sb);
+  const size_t			len = strlen(name);
+  struct sfs_xattr_entry	*e;
+  struct buffer_head		*bh = NULL;
+  void				*ibody;
+  int				err;
+
+  printk(KERN_DEBUG "sfs_xattr_get %lu %d.%s\n", inode->i_ino, index, name);
+
+  if (!sbi->s_inode_extra)
+    return -EOPNOTSUPP;
+  if (!len)
+    return -EINVAL;
+  if (len > 255)
+    return -ERANGE;
+
+  down_read(&ii->i_xattr_sem);
+  ibody = sfs_xattr_ibody(inode);
+  if (!(e = sfs_xattr_find(ibody, ibody + sbi->s_xattr_isize, index, name,
+			   len)))
+    {
+      //Not in the inode : in the block, if any
+      bh = sfs_xattr_read_block(inode);
+      err = PTR_ERR(bh);
+      if (IS_ERR(bh))
+	goto out;
+      err = -ENODATA;
+      if (!bh || !(e = sfs_xattr_find(bh->b_data
+				      + sizeof(struct sfs_xattr_header),
+				      bh->b_data + SFS_BLOCK_SIZE, index,
+				      name, len)))
+	goto out_brelse;
+    }
+
+  err = e->e_value_len;
+  if (buffer)
+    {
+      if (size < e->e_value_len)
+	err = -ERANGE;
+      else
+	memcpy(buffer, e->e_name + e->e_name_len, e->e_value_len);
+    }
+
+ out_brelse:
+  brelse(bh);
+ out:
+  up_read(&ii->i_xattr_sem);
+  return err;
+}
+
+/**
+ * sfs_xattr_gather - Copy the entries of [@start, @end) but @name
+ * @start first entry
+ * @end end of the area
+ * @index SFS_XATTR_INDEX_*
+ * @name name without its prefix
+ * @len strlen(@name)
+ * @to where to copy them, moved after the last one
+ *
+ * Returns 1 if @name was found, 0 otherwise
+ */
+static int
+sfs_xattr_gather(void *start, void *end, int index, const char *name,
+		 size_t len, void **to)
+{
+  struct sfs_xattr_entry	*e;
+  size_t			elen;
+  int				found = 0;
+
+  for_each_xattr(e, start, end)
+    {
+      elen = SFS_XATTR_LEN(e->e_name_len, e->e_value_len);
+      if (e->e_index == index && e->e_name_len == len
+	  && !memcmp(e->e_name, name, len))
+	found = 1;
+      else
+	{
+	  memcpy(*to, e, elen);
+	  *to += elen;
+	}
+    }
+  return found;
+}
+
+/**
+ * sfs_xattr_set - Create, replace or remove an attribute
+ * @inode inode we are working on
+ * @index SFS_XATTR_INDEX_*
+ * @name name without its prefix
+ * @value new value (NULL : remove)
+ * @size bytes of @value
+ * @flags XATTR_CREATE, XATTR_REPLACE
+ *
+ * All the entries are packed again : in the inode while they fit, in
+ * the block after. The block is allocated or freed as needed.
+ * Returns 0 or an error code
+ */
+static int
+sfs_xattr_set(struct inode *inode, int index, const char *name,
+	      const void *value, size_t size, int flags)
+{
+  struct sfs_inode_info		*ii = sfs_i(inode);
+  struct super_block		*sb = inode->i_sb;
+  SBI(sb);
+  const size_t			len = strlen(name);
+  u8				ibuf[SFS_INODE_TAIL_MAX];
+  struct sfs_xattr_header	*hdr;
+  struct sfs_xattr_entry	*e;
+  struct buffer_head		*bh;
+  void				*all;
+  void				*end;
+  u8				*bbuf = NULL;
+  size_t			elen;
+  size_t			ipos = 0;
+  size_t			bpos = sizeof(*hdr);
+  int				found;
+  int				blk;
+  int				err;
+
+  printk(KERN_DEBUG "sfs_xattr_set %lu %d.%s\n", inode->i_ino, index, name);
+
+  if (!sbi->s_inode_extra)
+    return -EOPNOTSUPP;
+  if (!len)
+    return -EINVAL;
+  if (len > 255)
+    return -ERANGE;
+  if (value && SFS_XATTR_LEN(len, size) > SFS_XATTR_BLOCK_ROOM)
+    return -ENOSPC;
+
+  if (!(all = kzalloc(sbi->s_xattr_isize + SFS_XATTR_BLOCK_ROOM
+		      + SFS_XATTR_LEN(len, size), GFP_NOFS))
+      || !(bbuf = kzalloc(SFS_BLOCK_SIZE, GFP_NOFS)))
+    {
+      kfree(all);
+      return -ENOMEM;
+    }
+
+  down_write(&ii->i_xattr_sem);
+  bh = sfs_xattr_read_block(inode);
+  err = PTR_ERR(bh);
+  if (IS_ERR(bh))
+    goto out;
+
+  //All the entries but @name, one after the other
+  end = all;
+  found = sfs_xattr_gather(sfs_xattr_ibody(inode),
+			   sfs_xattr_ibody(inode) + sbi->s_xattr_isize,
+			   index, name, len, &end);
+  if (bh)
+    found |= sfs_xattr_gather(bh->b_data + sizeof(*hdr),
+			      bh->b_data + SFS_BLOCK_SIZE,
+			      index, name, len, &end);
+  err = -EEXIST;
+  if (found && (flags & XATTR_CREATE))
+    goto out_brelse;
+  err = -ENODATA;
+  if (!found && (flags & XATTR_REPLACE))
+    goto out_brelse;
+  if (value)
+    {
+      e = end;
+      e->e_index = index;
+      e->e_name_len = len;
+      e->e_value_len = size;
+      memcpy(e->e_name, name, len);
+      memcpy(e->e_name + len, value, size);
+      end += SFS_XATTR_LEN(len, size);
+    }
+
+  //The inode first, the block after
+  memset(ibuf, 0, sizeof(ibuf));
+  err = -ENOSPC;
+  for_each_xattr(e, all, end)
+    {
+      elen = SFS_XATTR_LEN(e->e_name_len, e->e_value_len);
+      if (ipos + elen <= sbi->s_xattr_isize)
+	{
+	  memcpy(ibuf + ipos, e, elen);
+	  ipos += elen;
+	  continue;
+	}
+      if (bpos + elen > SFS_BLOCK_SIZE)
+	goto out_brelse;
+      memcpy(bbuf + bpos, e, elen);
+      bpos += elen;
+    }
+
+  blk = sfs_inode_extra(inode)->i_xattr;
+  if (bpos > sizeof(*hdr))
+    {
+      //A new block for the entries left
+      if (!bh)
+	{
+	  if ((err = blk = sfs_get_bblock(sb)) < 0)
+	    goto out;
+	  if (!(bh = sb_getblk(sb, blk)))
+	    {
+	      sfs_put_bblock(sb, blk);
+	      err = -EIO;
+	      goto out;
+	    }
+	}
+      hdr = (void*)bbuf;
+      hdr->h_magic = SFS_XATTR_MAGIC;
+      lock_buffer(bh);
+      memcpy(bh->b_data, bbuf, SFS_BLOCK_SIZE);
+      set_buffer_uptodate(bh);
+      unlock_buffer(bh);
+      mark_buffer_dirty(bh);
+      if (IS_SYNC(inode))
+	sync_dirty_buffer(bh);
+    }
+  //All in the inode : the block goes away
+  else if (bh)
+    {
+      bforget(bh);
+      bh = NULL;
+      sfs_put_bblock(sb, blk);
+      blk = 0;
+    }
+
+  down_write(&ii->i_ext_lock);
+  memcpy(sfs_xattr_ibody(inode), ibuf, sbi->s_xattr_isize);
+  sfs_inode_extra(inode)->i_xattr = blk;
+  up_write(&ii->i_ext_lock);
+  sfs_set_feature(sb, SFS_FEAT_XATTR);
+  inode->i_ctime = CURRENT_TIME_SEC;
+  mark_inode_dirty(inode);
+  err = 0;
+
+ out_brelse:
+  brelse(bh);
+ out:
+  up_write(&ii->i_xattr_sem);
+  kfree(bbuf);
+  kfree(all);
+  return err;
+}
+
+/**
+ * sfs_xattr_list_area - List the attribute names of [@start, @end)
+ * @inode inode we are working on
+ * @start first entry
+ * @end end of the area
+ * @buffer where to copy them (NULL : only the size is wanted)
+ * @size bytes of @buffer
+ *
+ * Returns the bytes of the names, or %-ERANGE
+ */
+static ssize_t
+sfs_xattr_list_area(struct inode *inode, void *start, void *end,
+		    char *buffer, size_t size)
+{
+  struct sfs_xattr_entry	*e;
+  struct xattr_handler		*handler;
+  size_t			total = 0;
+  size_t			len;
+
+  for_each_xattr(e, start, end)
+    {
+      if (!(handler = sfs_xattr_handler(e->e_index)))
+	continue;
+      len = handler->list(inode, buffer ? buffer + total : NULL,
+			  buffer ? size - total : 0, e->e_name,
+			  e->e_name_len);
+      if (buffer && len > size - total)
+	return -ERANGE;
+      total += len;
+    }
+  return total;
+}
+
+/**
+ * sfs_listxattr - List the attribute names of a file
+ * @dentry file
+ * @buffer where to copy them (NULL : only the size is wanted)
+ * @size bytes of @buffer
+ *
+ * Returns the bytes of the names or an error code
+ */
+ssize_t
+sfs_listxattr(struct dentry *dentry, char *buffer, size_t size)
+{
+  struct inode		*inode = dentry->d_inode;
+  struct sfs_inode_info	*ii = sfs_i(inode);
+  SBI(inode->i_sb);
+  struct buffer_head	*bh;
+  void			*ibody;
+  ssize_t		ret;
+  ssize_t		bret;
+
+  printk(KERN_DEBUG "sfs_listxattr %lu\n", inode->i_ino);
+
+  if (!sbi->s_inode_extra)
+    return -EOPNOTSUPP;
+
+  down_read(&ii->i_xattr_sem);
+  ibody = sfs_xattr_ibody(inode);
+  ret = sfs_xattr_list_area(inode, ibody, ibody + sbi->s_xattr_isize,
+			    buffer, size);
+  if (ret < 0)
+    goto out;
+  bh = sfs_xattr_read_block(inode);
+  if (IS_ERR(bh))
+    {
+      ret = PTR_ERR(bh);
+      goto out;
+    }
+  if (bh)
+    {
+      bret = sfs_xattr_list_area(inode, bh->b_data
+				 + sizeof(struct sfs_xattr_header),
+				 bh->b_data + SFS_BLOCK_SIZE,
+				 buffer ? buffer + ret : NULL,
+				 buffer ? size - ret : 0);
+      ret = (bret < 0) ? bret : ret + bret;
+      brelse(bh);
+    }
+
+ out:
+  up_read(&ii->i_xattr_sem);
+  return ret;
+}
+
+/**
+ * sfs_xattr_delete - Free the attribute block of a deleted inode
+ * @inode inode we are working on
+ */
+void
+sfs_xattr_delete(struct inode *inode)
+{
+  struct super_block	*sb = inode->i_sb;
+  u32			blk;
+
+  if (!SBI_PTR(sb)->s_inode_extra
+      || !(blk = sfs_inode_extra(inode)->i_xattr))
+    return;
+  //Don't let a dirty copy overwrite the block once reused
+  bforget(sb_find_get_block(sb, blk));
+  sfs_put_bblock(sb, blk);
+  sfs_inode_extra(inode)->i_xattr = 0;
+}
+
+/**
+ * sfs_init_security - Label a new inode
+ * @inode new inode, its mode set
+ * @dir directory it is created in
+ *
+ * Without a security module, or without attributes on this file
+ * system, nothing is stored.
+ * Returns 0 or an error code
+ */
+int
+sfs_init_security(struct inode *inode, struct inode *dir)
+{
+  char		*name;
+  void		*value;
+  size_t	len;
+  int		err;
+
+  err = security_inode_init_security(inode, dir, &name, &value, &len);
+  if (err)
+    return (err == -EOPNOTSUPP) ? 0 : err;
+  err = sfs_xattr_set(inode, SFS_XATTR_INDEX_SECURITY, name, value, len, 0);
+  kfree(name);
+  kfree(value);
+  return (err == -EOPNOTSUPP) ? 0 : err;
+}
+
+/*
+** ************
+** * HANDLERS *
+** ************
+*/
+
+/**
+ * sfs_xattr_list_name - Copy @prefix and @name to @list
+ * @prefix name space, with its final dot
+ * @list where to copy them (NULL : only the size is wanted)
+ * @size bytes of @list
+ * @name name without its prefix
+ * @len strlen(@name)
+ *
+ * Returns the bytes of the whole name, with its final 0
+ */
+static size_t
+sfs_xattr_list_name(const char *prefix, char *list, size_t size,
+		    const char *name, size_t len)
+{
+  const size_t	plen = strlen(prefix);
+  const size_t	total = plen + len + 1;
+
+  if (list && total <= size)
+    {
+      memcpy(list, prefix, plen);
+      memcpy(list + plen, name, len);
+      list[plen + len] = 0;
+    }
+  return total;
+}
+
+static size_t
+sfs_xattr_user_list(struct inode *inode, char *list, size_t size,
+		    const char *name, size_t len)
+{
+  return sfs_xattr_list_name(XATTR_USER_PREFIX, list, size, name, len);
+}
+
+static int
+sfs_xattr_user_get(struct inode *inode, const char *name, void *buffer,
+		   size_t size)
+{
+  return sfs_xattr_get(inode, SFS_XATTR_INDEX_USER, name, buffer, size);
+}
+
+static int
+sfs_xattr_user_set(struct inode *inode, const char *name, const void *value,
+		   size_t size, int flags)
+{
+  return sfs_xattr_set(inode, SFS_XATTR_INDEX_USER, name, value, size,
+		       flags);
+}
+
+//Only listed for the administrator
+static size_t
+sfs_xattr_trusted_list(struct inode *inode, char *list, size_t size,
+		       const char *name, size_t len)
+{
+  if (!capable(CAP_SYS_ADMIN))
+    return 0;
+  return sfs_xattr_list_name(XATTR_TRUSTED_PREFIX, list, size, name, len);
+}
+
+static int
+sfs_xattr_trusted_get(struct inode *inode, const char *name, void *buffer,
+		      size_t size)
+{
+  return sfs_xattr_get(inode, SFS_XATTR_INDEX_TRUSTED, name, buffer, size);
+}
+
+static int
+sfs_xattr_trusted_set(struct inode *inode, const char *name,
+		      const void *value, size_t size, int flags)
+{
+  return sfs_xattr_set(inode, SFS_XATTR_INDEX_TRUSTED, name, value, size,
+		       flags);
+}
+
+static size_t
+sfs_xattr_security_list(struct inode *inode, char *list, size_t size,
+			const char *name, size_t len)
+{
+  return sfs_xattr_list_name(XATTR_SECURITY_PREFIX, list, size, name, len);
+}
+
+static int
+sfs_xattr_security_get(struct inode *inode, const char *name, void *buffer,
+		       size_t size)
+{
+  return sfs_xattr_get(inode, SFS_XATTR_INDEX_SECURITY, name, buffer, size);
+}
+
+static int
+sfs_xattr_security_set(struct inode *inode, const char *name,
+		       const void *value, size_t size, int flags)
+{
+  return sfs_xattr_set(inode, SFS_XATTR_INDEX_SECURITY, name, value, size,
+		       flags);
+}
+
+static struct xattr_handler sfs_xattr_user_handler =
+  {
+    .prefix	= XATTR_USER_PREFIX,
+    .list	= sfs_xattr_user_list,
+    .get	= sfs_xattr_user_get,
+    .set	= sfs_xattr_user_set,
+  };
+
+static struct xattr_handler sfs_xattr_trusted_handler =
+  {
+    .prefix	= XATTR_TRUSTED_PREFIX,
+    .list	= sfs_xattr_trusted_list,
+    .get	= sfs_xattr_trusted_get,
+    .set	= sfs_xattr_trusted_set,
+  };
+
+static struct xattr_handler sfs_xattr_security_handler =
+  {
+    .prefix	= XATTR_SECURITY_PREFIX,
+    .list	= sfs_xattr_security_list,
+    .get	= sfs_xattr_security_get,
+    .set	= sfs_xattr_security_set,
+  };
+
+//Handlers by SFS_XATTR_INDEX_*
+static struct xattr_handler *sfs_xattr_index[] =
+  {
+    [SFS_XATTR_INDEX_USER]	= &sfs_xattr_user_handler,
+    [SFS_XATTR_INDEX_TRUSTED]	= &sfs_xattr_trusted_handler,
+    [SFS_XATTR_INDEX_SECURITY]	= &sfs_xattr_security_handler,
+  };
+
+//Handler of an on-disk name index (NULL : unknown)
+static struct xattr_handler*
+sfs_xattr_handler(int index)
+{
+  if (index <= 0 || index >= ARRAY_SIZE(sfs_xattr_index))
+    return NULL;
+  return sfs_xattr_index[index];
+}
+
+//Handlers of the super block (sb->s_xattr)
+struct xattr_handler *sfs_xattr_handlers[] =
+  {
+    &sfs_xattr_user_handler,
+    &sfs_xattr_trusted_handler,
+    &sfs_xattr_security_handler,
+    NULL
+  };
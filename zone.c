@@ -0,0 +1,529 @@
+/*
+ * sfs/zone.c for SFS
+ *
+ * Copyright (C) 2009, Jeremy Cochoy
+ */
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/pagemap.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/writeback.h>
+#include <linux/workqueue.h>
+#include "sfs_fs.h"
+#include "sfs.h"
+
+/*
+** On a host-managed zoned device (SFS_FEAT_ZONED), the blocks before
+** s_zone_start are conventional zones : super block, bitmaps, inode
+** table and reference counts, then directories, symlinks and index
+** blocks, all updated in place by the bitmap allocators.
+**
+** Regular files are written by clusters (see compress.c) : each
+** writeback puts the cluster at the write pointer of the open zone, and
+** frees the old blocks. Freed blocks are dead until their zone is
+** reset, which happens when a zone without used blocks is opened again.
+**
+** The write pointers are kept in the zone table (s_zone_table), written
+** with the bitmaps. A zone is recorded empty once it has been reset
+** (with a discard : this block layer has no zone reset command), and
+** the table block is written then, before the zone gets data. After a
+** crash, the device may have gone further than the table says : at
+** mount, zones the table has partly written, or holding used blocks,
+** are taken as full, and empty zones are reset again before they are
+** opened. Without a table (older mkfs), zones holding used blocks are
+** taken as full, and the others as empty.
+**
+** The cleaner runs when few zones are left empty : it rewrites the used
+** blocks of the zone with the fewest, through the page cache of the
+** files holding them, until the zone is empty. SFS_ZONE_RESERVE zones
+** are kept for it : writers wait for a cleaner pass when only those are
+** left (sfs_zone_wait), and fail with ENOSPC if it freed none.
+*/
+
+//The cleaner starts with this much empty zones left
+#define	SFS_ZONE_LOW		4
+//No zone open
+#define	SFS_ZONE_NONE		((u32)-1)
+
+//First block of a zone
+#define	zone_first(sbi, z)	((sbi)->s_zone_start + (z) * (sbi)->s_zone_blocks)
+
+static void	sfs_zone_clean(struct work_struct *work);
+
+/**
+ * sfs_zone_init - Load the zone write pointers
+ * @sb SFS super block, with its bitmaps read
+ *
+ * Returns 0 or %-ENOMEM
+ */
+int
+sfs_zone_init(struct super_block *sb)
+{
+  SBI(sb);
+  const u32	table = sfs_sb(sb)->s_zone_table;
+  __u32		wp;
+  u32		i;
+  u32		z;
+
+  printk(KERN_DEBUG "SFS: zone_init %u zones\n", sbi->s_nzones);
+
+  INIT_WORK(&sbi->s_clean_work, sfs_zone_clean);
+  init_waitqueue_head(&sbi->s_zone_waitq);
+  sbi->s_zone_cur = SFS_ZONE_NONE;
+  if (!(sbi->s_zone_wp = kcalloc(sbi->s_nzones, sizeof(u32), GFP_KERNEL)))
+    return -ENOMEM;
+  if (table)
+    {
+      sbi->s_zone_tbl = kcalloc(sbi->s_zone_tbl_blocks, sizeof(*sbi->s_zone_tbl),
+				GFP_KERNEL);
+      if (!sbi->s_zone_tbl)
+	goto out_free;
+      for (i = 0; i < sbi->s_zone_tbl_blocks; i++)
+	if (!(sbi->s_zone_tbl[i] = sb_bread(sb, table + i)))
+	  goto out_free;
+    }
+
+  for (z = 0; z < sbi->s_nzones; z++)
+    {
+      wp = 0;
+      if (sbi->s_zone_tbl)
+	wp = ((__u32*)sbi->s_zone_tbl[z / SFS_ZONE_WP_PER_BLOCK]->b_data)
+	  [z % SFS_ZONE_WP_PER_BLOCK];
+      //Where the device's write pointer is past that isn't known : full
+      if (wp || sfs_count_bblocks(sb, zone_first(sbi, z), sbi->s_zone_blocks))
+	sbi->s_zone_wp[z] = sbi->s_zone_blocks;
+    }
+  return 0;
+
+ out_free:
+  sfs_zone_release(sb);
+  return -ENOMEM;
+}
+
+/**
+ * sfs_zone_store - Copy the write pointer of zone @z to the zone table
+ * @sb SFS super block
+ * @z zone index
+ * @sync write the table block now
+ *
+ * Must be called with sb->s_lock held.
+ */
+static void
+sfs_zone_store(struct super_block *sb, u32 z, int sync)
+{
+  SBI(sb);
+  struct buffer_head	*bh;
+
+  if (!sbi->s_zone_tbl)
+    return;
+  bh = sbi->s_zone_tbl[z / SFS_ZONE_WP_PER_BLOCK];
+  ((__u32*)bh->b_data)[z % SFS_ZONE_WP_PER_BLOCK] = sbi->s_zone_wp[z];
+  mark_buffer_dirty(bh);
+  if (sync)
+    sync_dirty_buffer(bh);
+}
+
+/**
+ * sfs_zone_release - Free the zone write pointers
+ * @sb SFS super block
+ */
+void
+sfs_zone_release(struct super_block *sb)
+{
+  SBI(sb);
+  u32	i;
+
+  if (sbi->s_zone_tbl)
+    for (i = 0; i < sbi->s_zone_tbl_blocks; i++)
+      brelse(sbi->s_zone_tbl[i]);
+  kfree(sbi->s_zone_tbl);
+  sbi->s_zone_tbl = NULL;
+  kfree(sbi->s_zone_wp);
+  sbi->s_zone_wp = NULL;
+}
+
+/**
+ * sfs_zone_stop - Stop the cleaner before unmount
+ * @sb SFS super block
+ *
+ * The cleaner takes inodes : it must be done before they are evicted.
+ */
+void
+sfs_zone_stop(struct super_block *sb)
+{
+  SBI(sb);
+
+  if (!sbi->s_zone_wp)
+    return;
+  mutex_lock(&sb->s_lock);
+  sbi->s_zone_stop = 1;
+  mutex_unlock(&sb->s_lock);
+  cancel_work_sync(&sbi->s_clean_work);
+  wake_up_all(&sbi->s_zone_waitq);
+}
+
+/**
+ * sfs_zone_reclaim - Empty the full zones without used blocks
+ * @sb SFS super block
+ *
+ * Must be called with sb->s_lock held.
+ * Returns the number of empty zones
+ */
+static u32
+sfs_zone_reclaim(struct super_block *sb)
+{
+  SBI(sb);
+  u32	empty = 0;
+  u32	z;
+
+  for (z = 0; z < sbi->s_nzones; z++)
+    {
+      if (z == sbi->s_zone_cur)
+	continue;
+      //Reset when opened : the table says full until then
+      if (sbi->s_zone_wp[z]
+	  && !sfs_count_bblocks(sb, zone_first(sbi, z), sbi->s_zone_wp[z]))
+	sbi->s_zone_wp[z] = 0;
+      if (!sbi->s_zone_wp[z])
+	empty++;
+    }
+  return empty;
+}
+
+/**
+ * sfs_zone_open - Open an empty zone
+ * @sb SFS super block
+ *
+ * The open zone is sealed : its blocks left are never written. The new
+ * one is reset, as it may hold dead blocks.
+ * Must be called with sb->s_lock held.
+ * Returns 0 or %-ENOSPC
+ */
+static int
+sfs_zone_open(struct super_block *sb)
+{
+  SBI(sb);
+  u32	empty = 0;
+  u32	next = SFS_ZONE_NONE;
+  u32	z;
+
+  for (z = 0; z < sbi->s_nzones; z++)
+    if (z != sbi->s_zone_cur && !sbi->s_zone_wp[z])
+      {
+	if (next == SFS_ZONE_NONE)
+	  next = z;
+	empty++;
+      }
+  //Zones freed since the last cleaning
+  if (empty <= SFS_ZONE_RESERVE)
+    {
+      empty = sfs_zone_reclaim(sb);
+      for (next = 0; next < sbi->s_nzones; next++)
+	if (next != sbi->s_zone_cur && !sbi->s_zone_wp[next])
+	  break;
+    }
+
+  if (empty <= SFS_ZONE_LOW && !sbi->s_zone_stop)
+    queue_work(sfs_clean_wq, &sbi->s_clean_work);
+  if (!empty || (empty <= SFS_ZONE_RESERVE && current != sbi->s_cleaner))
+    return -ENOSPC;
+
+  if (sbi->s_zone_cur != SFS_ZONE_NONE)
+    {
+      sbi->s_zone_wp[sbi->s_zone_cur] = sbi->s_zone_blocks;
+      sfs_zone_store(sb, sbi->s_zone_cur, 0);
+    }
+  sbi->s_zone_cur = next;
+  //Back to the zone start, on disk before the zone gets data
+  sb_issue_discard(sb, zone_first(sbi, next), sbi->s_zone_blocks);
+  sfs_zone_store(sb, next, 1);
+  return 0;
+}
+
+/**
+ * sfs_zone_get_brun - Get @count contiguous blocks at the write pointer
+ * @sb SFS super block
+ * @count number of blocks wanted
+ *
+ * The blocks must be written in order, before the next call.
+ * Returns the first block id or %-ENOSPC
+ */
+int
+sfs_zone_get_brun(struct super_block *sb, unsigned int count)
+{
+  SBI(sb);
+  u32	z;
+  int	blk;
+  int	err;
+
+  printk(" ===>zone %u\n", count);
+
+  if (!count || count > sbi->s_zone_blocks)
+    return -ENOSPC;
+
+  mutex_lock(&sb->s_lock);
+  z = sbi->s_zone_cur;
+  if (z == SFS_ZONE_NONE || sbi->s_zone_wp[z] + count > sbi->s_zone_blocks)
+    {
+      if ((err = sfs_zone_open(sb)))
+	{
+	  mutex_unlock(&sb->s_lock);
+	  return err;
+	}
+      z = sbi->s_zone_cur;
+    }
+  blk = zone_first(sbi, z) + sbi->s_zone_wp[z];
+  sbi->s_zone_wp[z] += count;
+  sfs_zone_store(sb, z, 0);
+  sfs_take_bblocks(sb, blk, count);
+  mutex_unlock(&sb->s_lock);
+  return blk;
+}
+
+/**
+ * sfs_zone_empty - Count the empty zones
+ * @sb SFS super block
+ *
+ * Must be called with sb->s_lock held.
+ * Returns the number of empty zones, the open one aside
+ */
+static u32
+sfs_zone_empty(struct super_block *sb)
+{
+  SBI(sb);
+  u32	empty = 0;
+  u32	z;
+
+  for (z = 0; z < sbi->s_nzones; z++)
+    if (z != sbi->s_zone_cur && !sbi->s_zone_wp[z])
+      empty++;
+  return empty;
+}
+
+/**
+ * sfs_zone_wait - Wait for the cleaner when only the reserve is left
+ * @sb SFS super block
+ *
+ * Called before a page of a regular file is dirtied, with no page
+ * locked : the writeback of dirty pages would otherwise need the
+ * reserve zones, which only the cleaner may open. One cleaner pass is
+ * waited for. The cleaner skips files whose i_mutex is held.
+ * Returns 0, %-ENOSPC or %-EINTR
+ */
+int
+sfs_zone_wait(struct super_block *sb)
+{
+  SBI(sb);
+  unsigned long	passes;
+  u32		empty;
+
+  if (!sbi->s_zone_blocks || current == sbi->s_cleaner)
+    return 0;
+
+  mutex_lock(&sb->s_lock);
+  if ((empty = sfs_zone_empty(sb)) <= SFS_ZONE_RESERVE)
+    empty = sfs_zone_reclaim(sb);
+  passes = sbi->s_zone_passes;
+  if (empty <= SFS_ZONE_RESERVE && !sbi->s_zone_stop)
+    queue_work(sfs_clean_wq, &sbi->s_clean_work);
+  mutex_unlock(&sb->s_lock);
+  if (empty > SFS_ZONE_RESERVE)
+    return 0;
+
+  printk(KERN_DEBUG "SFS: zone_wait\n");
+  if (wait_event_interruptible(sbi->s_zone_waitq,
+			       sbi->s_zone_passes != passes
+			       || sbi->s_zone_stop))
+    return -EINTR;
+
+  mutex_lock(&sb->s_lock);
+  empty = sfs_zone_reclaim(sb);
+  mutex_unlock(&sb->s_lock);
+  return (empty > SFS_ZONE_RESERVE) ? 0 : -ENOSPC;
+}
+
+/*
+** ***********
+** * CLEANER *
+** ***********
+*/
+
+/**
+ * sfs_zone_move_inode - Rewrite the blocks of a file held by a zone
+ * @inode inode we are working on
+ * @start first block of the zone
+ * @end first block after the zone
+ *
+ * The pages are dirtied, and written back at the open zone.
+ * Returns 0 or an error code
+ */
+static int
+sfs_zone_move_inode(struct inode *inode, u32 start, u32 end)
+{
+  struct address_space	*mapping = inode->i_mapping;
+  const unsigned int	bits = inode->i_blkbits;
+  struct sfs_map	map;
+  struct page		*page;
+  sector_t		nblocks;
+  sector_t		lblk;
+  pgoff_t		idx;
+  pgoff_t		last;
+  u32			pend;
+  u32			from;
+  u32			to;
+  int			err = 0;
+
+  //A writer holding it may be waiting for this pass (sfs_zone_wait)
+  if (!mutex_trylock(&inode->i_mutex))
+    return -EBUSY;
+  nblocks = (i_size_read(inode) + (1 << bits) - 1) >> bits;
+  for (lblk = 0; lblk < nblocks && !err; lblk += map.m_len)
+    {
+      map.m_lblk = lblk;
+      map.m_len = min_t(sector_t, nblocks - lblk, SFS_EXT_LEN_MASK);
+      if ((err = sfs_map_blocks(inode, &map, 0)))
+	break;
+      if (!map.m_pblk || (map.m_flags & SFS_MAP_UNWRITTEN))
+	continue;
+
+      //Logical blocks of the run inside the zone
+      if (map.m_flags & SFS_MAP_COMPRESSED)
+	{
+	  pend = map.m_pblk + map.m_plen;
+	  from = 0;
+	  to = map.m_len;
+	}
+      else
+	{
+	  pend = map.m_pblk + map.m_len;
+	  from = max(map.m_pblk, start) - map.m_pblk;
+	  to = min(pend, end) - map.m_pblk;
+	}
+      if (map.m_pblk >= end || pend <= start || from >= to)
+	continue;
+
+      idx = ((loff_t)(lblk + from) << bits) >> PAGE_CACHE_SHIFT;
+      last = (((loff_t)(lblk + to) << bits) - 1) >> PAGE_CACHE_SHIFT;
+      for (; idx <= last; idx++)
+	{
+	  page = read_mapping_page(mapping, idx, NULL);
+	  if (IS_ERR(page))
+	    {
+	      err = PTR_ERR(page);
+	      break;
+	    }
+	  lock_page(page);
+	  if (page->mapping == mapping)
+	    set_page_dirty(page);
+	  unlock_page(page);
+	  page_cache_release(page);
+	  balance_dirty_pages_ratelimited(mapping);
+	}
+    }
+  mutex_unlock(&inode->i_mutex);
+
+  if (!err)
+    err = filemap_write_and_wait(mapping);
+  return err;
+}
+
+/**
+ * sfs_zone_evacuate - Rewrite all used blocks of zone @z
+ * @sb SFS super block
+ * @z zone index
+ *
+ * There is no reverse map : all regular files are looked at.
+ */
+static void
+sfs_zone_evacuate(struct super_block *sb, u32 z)
+{
+  SBI(sb);
+  const u32		start = zone_first(sbi, z);
+  const u32		end = start + sbi->s_zone_blocks;
+  struct inode		*inode;
+  unsigned long		ino;
+
+  printk(KERN_DEBUG "SFS: zone_evacuate %u\n", z);
+
+  for (ino = SFS_ROOT_INO; ino < sbi->s_ninodes && !sbi->s_zone_stop; ino++)
+    {
+      if (!sfs_test_binode(sb, ino))
+	continue;
+      //Done already
+      if (!sfs_count_bblocks(sb, start, sbi->s_zone_blocks))
+	break;
+      inode = sfs_iget(sb, ino);
+      if (IS_ERR(inode))
+	continue;
+      if (S_ISREG(inode->i_mode) && inode->i_nlink)
+	sfs_zone_move_inode(inode, start, end);
+      iput(inode);
+    }
+}
+
+/**
+ * sfs_zone_clean - Background zone cleaner
+ * @work sbi->s_clean_work
+ *
+ * Full zones without used blocks are emptied first. While few zones
+ * are left empty, the full zone with the fewest used blocks is
+ * evacuated.
+ */
+static void
+sfs_zone_clean(struct work_struct *work)
+{
+  struct sfs_sb_info	*sbi = container_of(work, struct sfs_sb_info,
+					    s_clean_work);
+  struct super_block	*sb = sbi->s_sb;
+  unsigned long		used;
+  unsigned long		best;
+  u32			victim;
+  u32			empty;
+  u32			z;
+
+  printk(KERN_DEBUG "SFS: zone_clean\n");
+
+  while (!sbi->s_zone_stop)
+    {
+      mutex_lock(&sb->s_lock);
+      empty = sfs_zone_reclaim(sb);
+      victim = SFS_ZONE_NONE;
+      best = sbi->s_zone_blocks;
+      if (empty <= SFS_ZONE_LOW)
+	for (z = 0; z < sbi->s_nzones; z++)
+	  {
+	    if (z == sbi->s_zone_cur || sbi->s_zone_wp[z] != sbi->s_zone_blocks)
+	      continue;
+	    used = sfs_count_bblocks(sb, zone_first(sbi, z),
+				     sbi->s_zone_blocks);
+	    if (used < best)
+	      {
+		best = used;
+		victim = z;
+	      }
+	  }
+      mutex_unlock(&sb->s_lock);
+      //Enough empty zones, or nothing to gain
+      if (victim == SFS_ZONE_NONE)
+	break;
+
+      sbi->s_cleaner = current;
+      sfs_zone_evacuate(sb, victim);
+      sbi->s_cleaner = NULL;
+
+      //Blocks left (busy or unreadable files) : try again later
+      if (sfs_count_bblocks(sb, zone_first(sbi, victim), sbi->s_zone_blocks))
+	break;
+    }
+
+  //Writers waiting in sfs_zone_wait look again
+  mutex_lock(&sb->s_lock);
+  sbi->s_zone_passes++;
+  mutex_unlock(&sb->s_lock);
+  wake_up_all(&sbi->s_zone_waitq);
+}